@@ -0,0 +1,43 @@
+#!/usr/bin/env ruby
+
+require 'bitarray'
+
+# An elementary cellular automaton. Each cell is updated from its own state
+# and the states of its left and right neighbors, and the ends of the row wrap
+# around. Rotating the whole row gives the neighbors of every cell at once, so
+# each step is a few whole-array operations, working on 64 cells at a time.
+#
+# See http://en.wikipedia.org/wiki/Elementary_cellular_automaton for more
+# information.
+class Automaton
+  attr_reader :cells
+
+  # Rules 30 and 110 as BitArray operations on the left, center and right
+  # neighbors of each cell.
+  RULES = {
+    30 => lambda {|l, c, r| l ^ (c | r) },
+    110 => lambda {|l, c, r| (c ^ r) | (c - l) },
+  }
+
+  def initialize(rule = 30, width = 79)
+    @rule = RULES.fetch(rule)
+    @cells = BitArray.new(width)
+    @cells.set_bit(width / 2)
+  end
+
+  def step
+    @cells = @rule.call(@cells.rotate(-1), @cells, @cells.rotate(1))
+  end
+
+  def run(steps = 32)
+    puts @cells.to_s.tr("01", " #")
+    steps.times {
+      step
+      puts @cells.to_s.tr("01", " #")
+    }
+  end
+end
+
+if __FILE__ == $0
+  Automaton.new((ARGV[0] || 30).to_i).run
+end
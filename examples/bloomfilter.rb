@@ -19,16 +19,11 @@ class BloomFilter
   end
 
   def add(input)
-    hash(input).each {|i|
-      @ba.set_bit i
-    }
+    @ba.set_bits(hash(input))
   end
 
   def include?(input)
-    hash(input).each {|i|
-      return false if @ba[i] == 0
-    }
-    return true
+    @ba.all_set?(hash(input))
   end
 
   private
@@ -17,21 +17,15 @@ class BoolNet
     # used to update the state.
     @state = random_network(size)
     @update = random_update(size)
+    # The update array is compiled into a BitArray::Network, which updates
+    # every bit of the state in a single call.
+    @network = BitArray::Network.new(@update.map {|u| u[1]},
+                                     @update.map {|u| u[2]},
+                                     @update.map {|u| u[0]})
   end
 
   def step
-    old_state = @state.clone
-    @update.each_with_index { |u,i|
-      case u[0]
-      when :and
-        @state[i] = old_state[u[1]] & old_state[u[2]]
-      when :or
-        @state[i] = old_state[u[1]] | old_state[u[2]]
-      when :xor
-        @state[i] = old_state[u[1]] ^ old_state[u[2]]
-      end
-    }
-    return @state
+    @network.step!(@state)
   end
   
   def run(steps = 23)
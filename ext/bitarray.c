@@ -1,966 +1,8465 @@
 #include "ruby.h"
 #include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <string.h>
 
-#define UINT_BYTES (sizeof(unsigned int))
-#define UINT_BITS (UINT_BYTES * CHAR_BIT)
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Bits are stored in 64-bit words. Allocated storage is aligned to
+ * WORD_ALIGN bytes, which is enough for any vector load we use. Small arrays
+ * are kept in the bitarray structure itself, in INLINE_WORDS words.
+ */
+#define WORD_BYTES (sizeof(uint64_t))
+#define WORD_BITS (WORD_BYTES * CHAR_BIT)
+#define WORD_MAX UINT64_MAX
+#define WORD_ALIGN 64
+#define INLINE_WORDS 4
 
 /* Accessing a particular bit within a word. */
-#define bitmask(bit) (1 << ((bit) % UINT_BITS))
+#define bitmask(bit) ((uint64_t)1 << ((bit) % WORD_BITS))
 
-/* Determining how many unsigned ints we need to store a given number of bits.
+/* Determining how many words we need to store a given number of bits.
  * We check if (bits - 1) is negative because the C standard helpfully
  * specifies that in an arithmetic expression "... if either operand is
  * unsigned long int, the other is converted to unsigned long int", causing
  * large amounts of hilarity when one of the operands is negative.
  */
-#define uint_array_size(bits) (bits <= 0 ? 0 : (((bits) - 1) / UINT_BITS + 1))
+#define word_array_size(bits) (bits <= 0 ? 0 : (((bits) - 1) / WORD_BITS + 1))
 
 /* Get the number of bits stored in a bitarray. */
 #define bitarray_size(ba) (ba->bits)
 
+/* A rank/select index. See the "Rank and select" section below. */
+struct rank_index {
+    uint64_t *l0;        /* Set bits before each 2^32-bit chunk. */
+    uint64_t *l1;        /* Packed counts for each 2048-bit block. */
+};
+
 struct bitarray {
     long bits;           /* Number of bits. */
-    long array_size;     /* Size of the storage array. */
-    unsigned int *array; /* Array of unsigned ints, used for bit storage. */
+    long array_size;     /* Size of the storage array, in words. */
+    long capacity;       /* Number of words allocated for the array. */
+    uint64_t *array;     /* Array of words, used for bit storage. */
+    void *buffer;        /* The shared storage array points into. */
+    size_t mapped;       /* If array is an mmap'd file, the mapping size. */
+    int read_only;       /* Non-zero if the bits must not be changed. */
+    int locks;           /* Bulk operations using the bits without the GVL. */
+    struct rank_index *rank_index; /* Built on demand, or NULL. */
+    uint64_t hash;       /* Cached hash of the bits, if hashed is set. */
+    int hashed;
+    uint64_t inline_words[INLINE_WORDS]; /* The array, if it's small enough. */
 };
 
 
-/* Low-level bit-manipulation functions.
- * 
- * These function are used by the Ruby interface functions to modify
- * bitarray structures.
- * 
- * Functions that take an index will raise an IndexError if it is out of range.
- * Negative indices count from the end of the array.
+/* Population count.
+ *
+ * Counting set bits is the most expensive thing most programs do with a
+ * bitarray, so we have several ways of doing it. init_popcount picks the best
+ * ones for the CPU we're running on when the extension is loaded:
+ *
+ * - popcount_small is used for short buffers, and popcount_word for single
+ *   words. They use the POPCNT instruction if the CPU has one, and a portable
+ *   SWAR routine otherwise.
+ * - popcount_bulk is used for long buffers, if the CPU has AVX2 or AVX-512.
+ *   These use the Harley-Seal carry-save adder method, which only needs to do
+ *   a full vector popcount once every 16 vectors.
+ *
+ * All of these count the bits in a buffer of bytes, so they don't care what
+ * type we use for bit storage.
  */
 
 
-/* This function is used by all of the bit-manipulation functions to check
- * indices. It handles negative-index conversion and bounds checking.
- */
+/* Count the bits in a 64-bit word, using the usual SWAR method. */
 static inline long
-check_index(struct bitarray *ba, long index)
+popcount64_swar(uint64_t x)
 {
-    if (index < 0) index += ba->bits;
-    if (index >= ba->bits) {
-        rb_raise(rb_eIndexError, "index %ld out of bit array", index);
-    }
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (long)((x * 0x0101010101010101ULL) >> 56);
+}
 
-    return index;
+
+/* Return the number of trailing (low-order) zero bits in a non-zero word. */
+static inline long
+ctz_word(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    return popcount64_swar((x & -x) - 1);
+#endif
 }
 
 
-/* Set the specified bit to 1. */
-static inline void
-set_bit(struct bitarray *ba, long index)
+/* Return the number of leading (high-order) zero bits in a non-zero word. */
+static inline long
+clz_word(uint64_t x)
 {
-    index = check_index(ba, index);
-    ba->array[index / UINT_BITS] |= bitmask(index);
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    long n = 0;
+    while (!(x & ((uint64_t)1 << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
 }
 
 
-/* Set all bits to 1. */
-static inline void
-set_all_bits(struct bitarray *ba)
+/* Count the bits in a buffer, eight bytes at a time. */
+static long
+popcount_swar(const unsigned char *p, long n)
 {
-    memset(ba->array, 0xff, (ba->array_size * UINT_BYTES));
+    long count = 0;
+    uint64_t x;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&x, p, 8);
+        count += popcount64_swar(x);
+    }
+    for (; n > 0; p++, n--) {
+        count += popcount64_swar(*p);
+    }
+    return count;
 }
 
 
-/* Clear the specified bit to 0. */
-static inline void
-clear_bit(struct bitarray *ba, long index)
+#ifdef HAVE_CPU_DISPATCH
+
+/* Count the bits in a single word with the POPCNT instruction. */
+__attribute__((target("popcnt")))
+static long
+popcount64_popcnt(uint64_t x)
 {
-    index = check_index(ba, index);
-    ba->array[index / UINT_BITS] &= ~bitmask(index);
+    return __builtin_popcountll(x);
 }
 
 
-/* Clear all bits to 0. */
-static inline void
-clear_all_bits(struct bitarray *ba)
+/* Count the bits in a buffer with the POPCNT instruction. */
+__attribute__((target("popcnt")))
+static long
+popcount_popcnt(const unsigned char *p, long n)
 {
-    memset(ba->array, 0x00, (ba->array_size * UINT_BYTES));
+    long count = 0;
+    uint64_t x;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&x, p, 8);
+        count += __builtin_popcountll(x);
+    }
+    for (; n > 0; p++, n--) {
+        count += __builtin_popcount(*p);
+    }
+    return count;
 }
 
 
-/* Toggle the state of the specified bit. */
-static inline void
-toggle_bit(struct bitarray *ba, long index)
+/* A carry-save adder. Adds the bits in a, b, and c, leaving the sum bits in l
+ * and the carry bits in h.
+ */
+#define CSA256(h, l, a, b, c) do {                                          \
+    __m256i u_ = _mm256_xor_si256((a), (b));                                \
+    (h) = _mm256_or_si256(_mm256_and_si256((a), (b)),                       \
+            _mm256_and_si256(u_, (c)));                                     \
+    (l) = _mm256_xor_si256(u_, (c));                                        \
+} while (0)
+
+
+/* Count the bits in each 64-bit lane of v, using a nibble lookup table. */
+__attribute__((target("avx2")))
+static inline __m256i
+popcount256(__m256i v)
 {
-    index = check_index(ba, index);
-    ba->array[index / UINT_BITS] ^= bitmask(index);
+    const __m256i lookup = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i sum = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+            _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(sum, _mm256_setzero_si256());
 }
 
 
-/* Toggle the state of all bits. */
-static inline void 
-toggle_all_bits(struct bitarray *ba)
+/* Count the bits in a buffer with AVX2 Harley-Seal. */
+__attribute__((target("avx2,popcnt")))
+static long
+popcount_avx2(const unsigned char *p, long n)
 {
-    long i;
-    for(i = 0; i < ba->array_size; i++) {
-        ba->array[i] ^= UINT_MAX; 
+    const __m256i *v = (const __m256i *)p;
+    long vectors = n / 32;
+    long i = 0;
+
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256();
+    __m256i twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256();
+    __m256i eights = _mm256_setzero_si256();
+    __m256i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+
+#define LOAD(k) _mm256_loadu_si256(v + i + (k))
+    for (; i + 16 <= vectors; i += 16) {
+        CSA256(twos_a, ones, ones, LOAD(0), LOAD(1));
+        CSA256(twos_b, ones, ones, LOAD(2), LOAD(3));
+        CSA256(fours_a, twos, twos, twos_a, twos_b);
+        CSA256(twos_a, ones, ones, LOAD(4), LOAD(5));
+        CSA256(twos_b, ones, ones, LOAD(6), LOAD(7));
+        CSA256(fours_b, twos, twos, twos_a, twos_b);
+        CSA256(eights_a, fours, fours, fours_a, fours_b);
+        CSA256(twos_a, ones, ones, LOAD(8), LOAD(9));
+        CSA256(twos_b, ones, ones, LOAD(10), LOAD(11));
+        CSA256(fours_a, twos, twos, twos_a, twos_b);
+        CSA256(twos_a, ones, ones, LOAD(12), LOAD(13));
+        CSA256(twos_b, ones, ones, LOAD(14), LOAD(15));
+        CSA256(fours_b, twos, twos, twos_a, twos_b);
+        CSA256(eights_b, fours, fours, fours_a, fours_b);
+        CSA256(sixteens, eights, eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, popcount256(sixteens));
     }
+#undef LOAD
+
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount256(eights), 3));
+    total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount256(fours), 2));
+    total = _mm256_add_epi64(total,
+            _mm256_slli_epi64(popcount256(twos), 1));
+    total = _mm256_add_epi64(total, popcount256(ones));
+    for (; i < vectors; i++) {
+        total = _mm256_add_epi64(total,
+                popcount256(_mm256_loadu_si256(v + i)));
+    }
+
+    long count = _mm256_extract_epi64(total, 0) +
+        _mm256_extract_epi64(total, 1) +
+        _mm256_extract_epi64(total, 2) +
+        _mm256_extract_epi64(total, 3);
+
+    return count + popcount_popcnt(p + vectors * 32, n - vectors * 32);
 }
 
 
-/* Assign the specified value to a bit. If the specified value is invalid,
- * raises an ArgumentError.
- */ 
-static inline void
-assign_bit(struct bitarray *ba, long index, int value)
+/* AVX-512 version of CSA256. The whole adder is a single ternary-logic
+ * instruction for each output: 0xe8 is majority(a, b, c), and 0x96 is
+ * a ^ b ^ c.
+ */
+#define CSA512(h, l, a, b, c) do {                                          \
+    __m512i a_ = (a), b_ = (b), c_ = (c);                                   \
+    (h) = _mm512_ternarylogic_epi64(a_, b_, c_, 0xe8);                      \
+    (l) = _mm512_ternarylogic_epi64(a_, b_, c_, 0x96);                      \
+} while (0)
+
+
+/* Count the bits in each 64-bit lane of v. */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i
+popcount512(__m512i v)
 {
-    if (value == 0) {
-        clear_bit(ba, index);
-    } else if (value == 1) {
-        set_bit(ba, index);
-    } else {
-        rb_raise(rb_eArgError, "bit value %d out of range", value);
+    const __m512i lookup = _mm512_broadcast_i32x4(_mm_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low_mask = _mm512_set1_epi8(0x0f);
+    __m512i lo = _mm512_and_si512(v, low_mask);
+    __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+    __m512i sum = _mm512_add_epi8(_mm512_shuffle_epi8(lookup, lo),
+            _mm512_shuffle_epi8(lookup, hi));
+    return _mm512_sad_epu8(sum, _mm512_setzero_si512());
+}
+
+
+/* Count the bits in a buffer with AVX-512 Harley-Seal. */
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static long
+popcount_avx512(const unsigned char *p, long n)
+{
+    const __m512i *v = (const __m512i *)p;
+    long vectors = n / 64;
+    long i = 0;
+
+    __m512i total = _mm512_setzero_si512();
+    __m512i ones = _mm512_setzero_si512();
+    __m512i twos = _mm512_setzero_si512();
+    __m512i fours = _mm512_setzero_si512();
+    __m512i eights = _mm512_setzero_si512();
+    __m512i sixteens, twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+
+#define LOAD(k) _mm512_loadu_si512(v + i + (k))
+    for (; i + 16 <= vectors; i += 16) {
+        CSA512(twos_a, ones, ones, LOAD(0), LOAD(1));
+        CSA512(twos_b, ones, ones, LOAD(2), LOAD(3));
+        CSA512(fours_a, twos, twos, twos_a, twos_b);
+        CSA512(twos_a, ones, ones, LOAD(4), LOAD(5));
+        CSA512(twos_b, ones, ones, LOAD(6), LOAD(7));
+        CSA512(fours_b, twos, twos, twos_a, twos_b);
+        CSA512(eights_a, fours, fours, fours_a, fours_b);
+        CSA512(twos_a, ones, ones, LOAD(8), LOAD(9));
+        CSA512(twos_b, ones, ones, LOAD(10), LOAD(11));
+        CSA512(fours_a, twos, twos, twos_a, twos_b);
+        CSA512(twos_a, ones, ones, LOAD(12), LOAD(13));
+        CSA512(twos_b, ones, ones, LOAD(14), LOAD(15));
+        CSA512(fours_b, twos, twos, twos_a, twos_b);
+        CSA512(eights_b, fours, fours, fours_a, fours_b);
+        CSA512(sixteens, eights, eights, eights_a, eights_b);
+        total = _mm512_add_epi64(total, popcount512(sixteens));
+    }
+#undef LOAD
+
+    total = _mm512_slli_epi64(total, 4);
+    total = _mm512_add_epi64(total,
+            _mm512_slli_epi64(popcount512(eights), 3));
+    total = _mm512_add_epi64(total,
+            _mm512_slli_epi64(popcount512(fours), 2));
+    total = _mm512_add_epi64(total,
+            _mm512_slli_epi64(popcount512(twos), 1));
+    total = _mm512_add_epi64(total, popcount512(ones));
+    for (; i < vectors; i++) {
+        total = _mm512_add_epi64(total,
+                popcount512(_mm512_loadu_si512(v + i)));
     }
+
+    long count = _mm512_reduce_add_epi64(total);
+    return count + popcount_popcnt(p + vectors * 64, n - vectors * 64);
 }
 
+#endif /* HAVE_CPU_DISPATCH */
 
-/* Get the state of the specified bit. */
-static inline int
-get_bit(struct bitarray *ba, long index)
+
+/* Buffers shorter than this many bytes are always counted with
+ * popcount_small. The Harley-Seal kernels need 16 vectors to do a full
+ * iteration, and below that they are no faster than POPCNT.
+ */
+#define POPCOUNT_BULK_MIN 1024
+
+static long (*popcount_small)(const unsigned char *, long) = popcount_swar;
+static long (*popcount_bulk)(const unsigned char *, long) = NULL;
+static int have_popcnt = 0;
+
+
+/* Choose popcount kernels for the CPU we're running on. Called from
+ * Init_bitarray.
+ */
+static void
+init_popcount(void)
 {
-    index = check_index(ba, index);
+#ifdef HAVE_CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        popcount_small = popcount_popcnt;
+        have_popcnt = 1;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        popcount_bulk = popcount_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        popcount_bulk = popcount_avx2;
+    }
+#endif
+}
 
-    /* We could shift the bit down, but this is easier. We need an unsigned int
-     * to prevent overflow.
-     */
-    unsigned int b = (ba->array[index / UINT_BITS] & bitmask(index));
-    if (b > 0) {
-        return 1;
-    } else {
-        return 0;
+
+/* Count the set bits in a buffer of n bytes. */
+static inline long
+popcount_bytes(const void *p, long n)
+{
+    if (popcount_bulk && n >= POPCOUNT_BULK_MIN) {
+        return popcount_bulk(p, n);
     }
+    return popcount_small(p, n);
 }
 
 
-/* Return the number of set bits in the array. */
+/* Count the bits in a single storage word. This is used for the partial
+ * words at the edges of a range, and other places that count a word at a
+ * time. Where the CPU is picked at load time, the portable version is the
+ * SWAR routine, since __builtin_popcountll would call a slower library
+ * function.
+ */
 static inline long
-total_set(struct bitarray *ba)
+popcount_word(uint64_t x)
 {
-    /* This is basically the algorithm from K&R, with a running total for all
-     * array elements. There are faster algorithms, but this one is simpler to
-     * implement. The running time is proportionate to the number of set bits.
-     */
-    long count = 0;
-    long i;
-    unsigned x;
-    for (i = 0; i < ba->array_size; i++) {
-        x = ba->array[i];
-        while (x) {
-            x &= x - 1;
-            count++;
-        }
+#if defined(HAVE_CPU_DISPATCH)
+    if (have_popcnt) {
+        return popcount64_popcnt(x);
     }
-    return count;
+    return popcount64_swar(x);
+#elif defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    return popcount64_swar(x);
+#endif
 }
 
 
-/* Initialize an already-allocated bitarray structure. The array is initialized
- * to all zeros.
+/* Low-level bit-manipulation functions.
+ * 
+ * These function are used by the Ruby interface functions to modify
+ * bitarray structures.
+ * 
+ * Functions that take an index will raise an IndexError if it is out of range.
+ * Negative indices count from the end of the array.
  */
-static inline void
-initialize_bitarray(struct bitarray *ba, long size)
+
+
+/* This function is used by all of the bit-manipulation functions to check
+ * indices. It handles negative-index conversion and bounds checking.
+ */
+static inline long
+check_index(struct bitarray *ba, long index)
 {
-    if (size <= 0) {
-        ba->bits = 0;
-        ba->array_size = 0;
-        ba->array = NULL;
-        return;
+    long i = (index < 0 ? index + ba->bits : index);
+    if (i < 0 || i >= ba->bits) {
+        rb_raise(rb_eIndexError, "index %ld out of bit array", index);
     }
 
-    ba->bits = size;
-    ba->array_size = uint_array_size(size);
-    ba->array = ruby_xcalloc(ba->array_size, UINT_BYTES);
+    return i;
 }
 
 
-/* Initialize an already-allocated bitarray structure as a copy of another
- * bitarray structure.
+/* Bits in the last storage word that are past the end of the array are
+ * always kept cleared, so that functions which work on whole words (like
+ * total_set) don't have to treat the last word specially. Anything that writes
+ * whole words should call this afterwards.
  */
 static inline void
-initialize_bitarray_copy(struct bitarray *new_ba, struct bitarray *orig_ba)
+clear_unused_bits(struct bitarray *ba)
 {
-    new_ba->bits = orig_ba->bits;
-    new_ba->array_size = orig_ba->array_size;
-    new_ba->array = ruby_xmalloc2(new_ba->array_size, UINT_BYTES);
-
-    memcpy(new_ba->array, orig_ba->array, new_ba->array_size * UINT_BYTES);
+    long extra = ba->bits % WORD_BITS;
+    if (extra != 0) {
+        ba->array[ba->array_size - 1] &= ~(WORD_MAX << extra);
+    }
 }
 
 
-/* Initialize an already-allocated bitarray structure as the concatenation of
- * two other bitarray structures.
- */
+/* Free a rank/select index. */
 static void
-initialize_bitarray_concat(struct bitarray *new_ba, struct bitarray *x_ba,
-        struct bitarray *y_ba)
+free_rank_index(struct rank_index *index)
 {
-    new_ba->bits = x_ba->bits + y_ba->bits;
-    new_ba->array_size = uint_array_size(new_ba->bits);
-    new_ba->array = ruby_xmalloc2(new_ba->array_size, UINT_BYTES);
-
+    ruby_xfree(index->l0);
+    ruby_xfree(index->l1);
+    ruby_xfree(index);
+}
 
-    /* For each bit set in x_ba and y_ba, set the corresponding bit in new_ba.
-     *
-     * First, copy x_ba->array to the beginning of new_ba->array.
-     */
-    memcpy(new_ba->array, x_ba->array, x_ba->array_size * UINT_BYTES);
 
-    /* Then, if x_ba->bits is a multiple of UINT_BITS, we can just copy
-     * y_ba->array onto the end of new_ba->array.
-     * 
-     * Otherwise, we need to go through y_ba->array bit-by-bit and set the
-     * appropriate bits in new_ba->array.
-     */
-    if ((x_ba->bits % UINT_BITS) == 0) {
-        unsigned int *start = new_ba->array + x_ba->array_size;
-        memcpy(start, y_ba->array, y_ba->array_size * UINT_BYTES);
-    } else {
-        long y_index, new_index;
-        for (y_index = 0, new_index = x_ba->bits;
-                y_index < y_ba->bits;
-                y_index++, new_index++)
-        {
-            if (get_bit(y_ba, y_index) == 1) {
-                set_bit(new_ba, new_index);
-            } else {
-                clear_bit(new_ba, new_index);
-            }
-        }
-    }
+/* Storage helper-function prototype. This is defined in the "Shared storage"
+ * section.
+ */
+static void unshare_bitarray(struct bitarray *ba);
 
-}
+/* The number of bitarrays using a shared storage allocation. */
+struct storage_header {
+    long refs;           /* Number of bitarrays using the storage. */
+    long words;          /* Number of words allocated after the header. */
+};
+#define storage_refs(buffer) (((struct storage_header *)(buffer))->refs)
+#define storage_words(buffer) (((struct storage_header *)(buffer))->words)
 
 
-/* Initialize an already-allocated bitarray structure as the intersection of
- * two other bitarray structures. The new bitarray will be the same length as
- * the smaller of the two original bitarrays.
+/* Throw away anything we've worked out from the contents of a bitarray, like
+ * its rank/select index or hash, and give it its own copy of its storage if
+ * it's sharing it. Every function that changes bits after the bitarray has been
+ * initialized must call this before it does so. It raises an error if the
+ * bitarray is read-only, or locked by a bulk operation (see "Bulk word
+ * operations").
  */
-static void
-initialize_bitarray_intersect(struct bitarray *new_ba, struct bitarray *x_ba,
-        struct bitarray *y_ba)
+static inline void
+bitarray_changed(struct bitarray *ba)
 {
-    struct bitarray *shorter = ((x_ba->bits < y_ba->bits) ? x_ba : y_ba);
+    if (ba->read_only) {
+        rb_error_frozen("BitArray");
+    }
+    if (ba->locks) {
+        rb_raise(rb_eThreadError,
+                "BitArray is in use by a bulk operation in another thread");
+    }
+    if (ba->buffer && storage_refs(ba->buffer) > 1) {
+        unshare_bitarray(ba);
+    }
+    ba->hashed = 0;
+    if (ba->rank_index) {
+        free_rank_index(ba->rank_index);
+        ba->rank_index = NULL;
+    }
+}
 
-    new_ba->bits = shorter->bits;
-    new_ba->array_size = shorter->array_size;
-    new_ba->array = ruby_xmalloc2(new_ba->array_size, UINT_BYTES);
 
-    long i;
-    for (i = 0; i < new_ba->array_size; i++) {
-        new_ba->array[i] = x_ba->array[i] & y_ba->array[i];
+/* Get n bits (1 <= n <= WORD_BITS) from a word array, starting at bit pos.
+ * The result is in the low bits of the returned word; anything above those is
+ * garbage. Never reads past the word holding the last requested bit.
+ */
+static inline uint64_t
+get_bits(const uint64_t *src, long pos, long n)
+{
+    long word = pos / WORD_BITS;
+    long offset = pos % WORD_BITS;
+    uint64_t bits = src[word] >> offset;
+    if (offset + n > (long)WORD_BITS) {
+        bits |= src[word + 1] << (WORD_BITS - offset);
     }
+    return bits;
 }
 
 
-/* Initialize an already-allocated bitarray structure as the union of two other
- * bitarray structures. The new bitarray will be the same length as the larger
- * of the two original bitarrays.
+/* Copy len bits from src, starting at bit src_beg, into dst, starting at bit
+ * dst_beg. Bits in dst outside of the destination range are left alone. The
+ * two ranges must not overlap.
+ *
+ * This works on whole words: each destination word is built from at most two
+ * source words with a shift and a merge, so copying an arbitrary bit range
+ * costs about the same as copying an aligned one.
  */
 static void
-initialize_bitarray_union(struct bitarray *new_ba, struct bitarray *x_ba,
-        struct bitarray *y_ba)
+copy_bits(uint64_t *dst, long dst_beg, const uint64_t *src, long src_beg,
+        long len)
 {
-    struct bitarray *longer = ((x_ba->bits > y_ba->bits) ? x_ba : y_ba);
-    struct bitarray *shorter = ((longer == x_ba) ? y_ba : x_ba);
-    initialize_bitarray_copy(new_ba, longer);
-
-    long i;
-    for (i = 0; i < shorter->array_size - 1; i++) {
-        new_ba->array[i] = new_ba->array[i] | shorter->array[i];
+    if (len <= 0) {
+        return;
     }
 
-    long start = ((shorter->array_size - 1) * UINT_BITS);
-    for (i = start; i < shorter->bits; i++) {
-        assign_bit(new_ba, i, get_bit(longer, i) | get_bit(shorter, i));
+    /* If both ranges start on a word boundary, most of this is a memcpy. */
+    if (dst_beg % WORD_BITS == 0 && src_beg % WORD_BITS == 0) {
+        long words = len / WORD_BITS;
+        memcpy(dst + dst_beg / WORD_BITS, src + src_beg / WORD_BITS,
+                words * WORD_BYTES);
+        dst_beg += words * WORD_BITS;
+        src_beg += words * WORD_BITS;
+        len -= words * WORD_BITS;
     }
 
-}
+    /* Otherwise (and for whatever is left over), fill the destination a word
+     * at a time. Only the first and last words need masking.
+     */
+    while (len > 0) {
+        long offset = dst_beg % WORD_BITS;
+        long n = WORD_BITS - offset;
+        if (n > len) {
+            n = len;
+        }
 
+        uint64_t *word = dst + dst_beg / WORD_BITS;
+        uint64_t bits = get_bits(src, src_beg, n) << offset;
+        if (n == (long)WORD_BITS) {
+            *word = bits;
+        } else {
+            uint64_t mask = ((bitmask(n) - 1) << offset);
+            *word = (*word & ~mask) | (bits & mask);
+        }
 
+        dst_beg += n;
+        src_beg += n;
+        len -= n;
+    }
+}
 
-/* Ruby Interface Functions.
- * 
- * These functions put a Ruby face on top of the lower-level functions. With
- * very few exceptions, they should not access the bitarray structs' members
- * directly.
- *
- * "bitarray" refers to the C structure. "BitArray" refers to the Ruby class.
+
+/* Bulk word operations.
  *
- * All publicly-accessible functions (those with an rb_define_method call in
- * Init_bitarray) should have RDoc comment headers.
+ * Everything that works on a whole array goes through word_op (or
+ * copy_bits_op), which runs one of the loops below over the storage words.
+ * Large operations (NOGVL_MIN_WORDS or more) are run without the GVL, so that
+ * other Ruby threads can carry on while we're busy.
  *
- * When in doubt, see how array.c does things.
+ * While an operation runs without the GVL, the bitarrays it uses are locked:
+ * anything that tries to change their bits (that is, anything that calls
+ * bitarray_changed) raises a ThreadError. Reading a bitarray that another
+ * thread is changing is allowed, but may see some words before the change and
+ * some after. Nothing in a word operation may raise or allocate Ruby
+ * objects; that all has to happen before it starts.
  */
+#define NOGVL_MIN_WORDS ((long)((1 << 20) / WORD_BYTES))
+
+enum word_op_type {
+    WORD_COUNT,          /* return popcount(x) */
+    WORD_ZERO,           /* dst = 0 */
+    WORD_ONES,           /* dst = ~0 */
+    WORD_COPY,           /* dst = x */
+    WORD_NOT,            /* dst = ~x */
+    WORD_AND,            /* dst = x & y */
+    WORD_OR,             /* dst = x | y */
+    WORD_XOR,            /* dst = x ^ y */
+    WORD_ANDNOT,         /* dst = x & ~y */
+    WORD_COPY_BITS,      /* copy_bits(dst, dst_beg, x, x_beg, bits) */
+    WORD_AND_ALL,        /* dst = inputs[0] & inputs[1] & ... */
+    WORD_OR_ALL,         /* dst = inputs[0] | inputs[1] | ... */
+    WORD_THRESHOLD,      /* dst = bits set in at least threshold inputs */
+    WORD_COUNT_OF,       /* return popcount(x <combine> y) */
+    WORD_ANY_OF,         /* return non-zero if x <combine> y has a bit set */
+    WORD_COUNT_AND_OR,   /* return popcount(x & y), count2 = popcount(x | y) */
+    WORD_GATHER,         /* dst[i] = op[i](x[gather_a[i]], x[gather_b[i]]) */
+    WORD_REVERSE         /* dst = the first bits bits of x, reversed */
+};
 
+struct word_job {
+    enum word_op_type op;
+    uint64_t *dst;
+    const uint64_t *x;
+    const uint64_t *y;
+    long words;          /* Number of words to work on. */
+    long dst_beg;        /* For WORD_COPY_BITS. */
+    long x_beg;          /* For WORD_COPY_BITS. */
+    long bits;           /* For WORD_COPY_BITS and WORD_REVERSE. */
+    const uint64_t **inputs; /* For the multi-way operations. */
+    const long *input_words; /* The number of words in each input. */
+    long inputs_size;
+    long threshold;      /* For WORD_THRESHOLD. */
+    enum word_op_type combine; /* WORD_AND, WORD_OR, WORD_XOR or
+                                  WORD_ANDNOT, for WORD_COUNT_OF and
+                                  WORD_ANY_OF. */
+    const long *gather_a; /* For WORD_GATHER. */
+    const long *gather_b;
+    const uint64_t *tables;
+    long gather_size;    /* Number of outputs for WORD_GATHER. */
+    long count;          /* The result of WORD_COUNT. */
+    long count2;         /* The second result of WORD_COUNT_AND_OR. */
+    int found;           /* Set when any part of a WORD_ANY_OF job finds a
+                            bit, so the other parts can stop. */
+    int done;
+};
 
-/* Our BitArray class. This is initialized in Init_bitarray, but we declare it
- * here because a few functions need it.
+
+/* Multi-way operations.
+ *
+ * These combine any number of inputs in one pass. The output is worked on a
+ * block of MULTI_BLOCK_WORDS at a time, small enough to stay in the L1 cache
+ * while every input's block is read into it. Inputs may be shorter than the
+ * output; they are treated as though they were padded with zeros.
+ *
+ * WORD_THRESHOLD keeps a count for every bit of the block, stored
+ * "vertically": slice j of the counters holds bit j of every bit's count, so
+ * adding an input word to 64 counts at once is a ripple-carry addition over
+ * the slices, and comparing them with the threshold is a few more word
+ * operations per slice.
  */
-static VALUE rb_bitarray_class;
+#define MULTI_BLOCK_WORDS 64
+#define MULTI_SLICES_MAX 64
 
 
-/* This gets called when a BitArray is garbage collected. It frees the memory
- * used by the bitarray struct.
- */
+/* Run a multi-way job on words [from, to). */
 static void
-rb_bitarray_free(struct bitarray *ba)
+multi_op_range(struct word_job *job, long from, long to)
 {
-    if (ba && ba->array) {
-        ruby_xfree(ba->array);
+    uint64_t counters[MULTI_SLICES_MAX][MULTI_BLOCK_WORDS];
+    long block, i, j, k;
+
+    int slices = 0;
+    while (slices < MULTI_SLICES_MAX &&
+            (job->inputs_size >> slices) != 0) {
+        slices++;
     }
-    ruby_xfree(ba);
-}
 
+    for (block = from; block < to; block += MULTI_BLOCK_WORDS) {
+        uint64_t *dst = job->dst + block;
+        long n = (to - block < MULTI_BLOCK_WORDS ? to - block :
+                MULTI_BLOCK_WORDS);
+
+        if (job->op == WORD_AND_ALL) {
+            /* Every input is at least as long as the output. */
+            memcpy(dst, job->inputs[0] + block, n * WORD_BYTES);
+            for (k = 1; k < job->inputs_size; k++) {
+                const uint64_t *x = job->inputs[k] + block;
+                uint64_t any = 0;
+                for (i = 0; i < n; i++) {
+                    dst[i] &= x[i];
+                    any |= dst[i];
+                }
+                if (any == 0) {
+                    break;
+                }
+            }
+            continue;
+        }
 
-/* This function is called by BitArray.new to allocate a new BitArray.
- * Initialization is done in a seperate function.
- * 
- * This function can be called directly with BitArray.allocate, but that is not
- * very useful.
- */
-static VALUE
-rb_bitarray_alloc(VALUE klass)
-{
-    struct bitarray *ba;
-    return Data_Make_Struct(rb_bitarray_class, struct bitarray, NULL,
-            rb_bitarray_free, ba);
+        if (job->op == WORD_OR_ALL) {
+            memset(dst, 0x00, n * WORD_BYTES);
+        } else {
+            memset(counters, 0x00, sizeof(counters[0]) * slices);
+        }
+        for (k = 0; k < job->inputs_size; k++) {
+            const uint64_t *x = job->inputs[k] + block;
+            long m = job->input_words[k] - block;
+            if (m > n) m = n;
+            if (job->op == WORD_OR_ALL) {
+                for (i = 0; i < m; i++) {
+                    dst[i] |= x[i];
+                }
+                continue;
+            }
+            for (i = 0; i < m; i++) {
+                uint64_t carry = x[i];
+                for (j = 0; carry != 0; j++) {
+                    uint64_t c = counters[j][i];
+                    counters[j][i] = c ^ carry;
+                    carry &= c;
+                }
+            }
+        }
+
+        if (job->op == WORD_THRESHOLD) {
+            /* count >= threshold, a slice at a time from the top. */
+            for (i = 0; i < n; i++) {
+                uint64_t greater = 0, equal = WORD_MAX;
+                for (j = slices - 1; j >= 0; j--) {
+                    if ((job->threshold >> j) & 1) {
+                        equal &= counters[j][i];
+                    } else {
+                        greater |= equal & counters[j][i];
+                        equal &= ~counters[j][i];
+                    }
+                }
+                dst[i] = greater | equal;
+            }
+        }
+    }
 }
 
 
-/* Initialization helper-function prototypes. These functions are defined after
- * rb_bitarray_initialize.
+/* Fused operations and counts.
+ *
+ * WORD_COUNT_OF counts the bits of x & y (or x | y, and so on) without
+ * storing the result anywhere. The words are combined a block at a time into
+ * a buffer that stays in the L1 cache, and each block is counted with
+ * popcount_bytes, so it gets the same POPCNT or Harley-Seal kernels as
+ * WORD_COUNT. WORD_COUNT_AND_OR counts both x & y and x | y from the same
+ * loads of each block, so the Jaccard index only reads its inputs once.
+ * WORD_ANY_OF stops at the first word with a set bit. When it's
+ * split between threads, the first one to find a bit sets job->found, and the
+ * others check that every ANY_OF_BLOCK_WORDS words and give up.
  */
-static VALUE rb_bitarray_from_string(VALUE self, VALUE string);
-static VALUE rb_bitarray_from_array(VALUE self, VALUE array);
+#define COMBINE_BLOCK_WORDS 256
+#define ANY_OF_BLOCK_WORDS 4096
 
+#ifdef __GNUC__
+#define load_flag(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define store_flag(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define load_flag(p) (*(volatile int *)(p))
+#define store_flag(p, v) (*(volatile int *)(p) = (v))
+#endif
 
-/* call-seq:
- *      BitArray.new(size)
- *      BitArray.new(string)
- *      BitArray.new(array)
- *
- * When called with a size, creates a new BitArray of the specified size, with
- * all bits cleared. When called with a string or an array, creates a new
- * BitArray from the argument.
- *
- * If a string is given, it should consist of ones and zeroes. If there are
- * any other characters in the string, the first invalid character and all
- * following characters will be ignored.
- *
- *   b = BitArray.new("10101010")       => 10101010
+
+/* dst = x <op> y, for n words. */
+static inline void
+combine_words(enum word_op_type op, uint64_t *dst, const uint64_t *x,
+        const uint64_t *y, long n)
+{
+    long i;
+    switch (op) {
+        case WORD_AND:
+            for (i = 0; i < n; i++) dst[i] = x[i] & y[i];
+            break;
+        case WORD_OR:
+            for (i = 0; i < n; i++) dst[i] = x[i] | y[i];
+            break;
+        case WORD_XOR:
+            for (i = 0; i < n; i++) dst[i] = x[i] ^ y[i];
+            break;
+        default:
+            for (i = 0; i < n; i++) dst[i] = x[i] & ~y[i];
+            break;
+    }
+}
+
+
+/* Return popcount(x <op> y) for n words. */
+static long
+popcount_combined(enum word_op_type op, const uint64_t *x, const uint64_t *y,
+        long n)
+{
+    uint64_t block[COMBINE_BLOCK_WORDS];
+    long count = 0;
+    while (n > 0) {
+        long m = (n < COMBINE_BLOCK_WORDS ? n : COMBINE_BLOCK_WORDS);
+        combine_words(op, block, x, y, m);
+        count += popcount_bytes(block, m * WORD_BYTES);
+        x += m;
+        y += m;
+        n -= m;
+    }
+    return count;
+}
+
+
+/* Return popcount(x & y) for n words, and add popcount(x | y) to *or_count. */
+static long
+popcount_and_or(const uint64_t *x, const uint64_t *y, long n, long *or_count)
+{
+    uint64_t both[COMBINE_BLOCK_WORDS], either[COMBINE_BLOCK_WORDS];
+    long i, count = 0;
+    while (n > 0) {
+        long m = (n < COMBINE_BLOCK_WORDS ? n : COMBINE_BLOCK_WORDS);
+        for (i = 0; i < m; i++) {
+            both[i] = x[i] & y[i];
+            either[i] = x[i] | y[i];
+        }
+        count += popcount_bytes(both, m * WORD_BYTES);
+        *or_count += popcount_bytes(either, m * WORD_BYTES);
+        x += m;
+        y += m;
+        n -= m;
+    }
+    return count;
+}
+
+
+/* Return non-zero if x <op> y has any bits set, for n words. Only WORD_AND and
+ * WORD_ANDNOT are supported. Checks eight words at a time, which the compiler
+ * can vectorize, and stops as soon as it finds something.
+ */
+static int
+any_combined(enum word_op_type op, const uint64_t *x, const uint64_t *y,
+        long n)
+{
+    uint64_t block[8];
+    long i;
+    for (; n > 0; x += 8, y += 8, n -= 8) {
+        long m = (n < 8 ? n : 8);
+        uint64_t any = 0;
+        combine_words(op, block, x, y, m);
+        for (i = 0; i < m; i++) {
+            any |= block[i];
+        }
+        if (any != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Run WORD_ANY_OF on words [from, to), returning 1 if it finds a set bit.
+ * Returns 0 early if another part of the job already has.
+ */
+static long
+any_of_range(struct word_job *job, long from, long to)
+{
+    while (from < to) {
+        long n = to - from;
+        if (n > ANY_OF_BLOCK_WORDS) {
+            n = ANY_OF_BLOCK_WORDS;
+        }
+        if (load_flag(&job->found)) {
+            return 0;
+        }
+        if (any_combined(job->combine, job->x + from, job->y + from, n)) {
+            store_flag(&job->found, 1);
+            return 1;
+        }
+        from += n;
+    }
+    return 0;
+}
+
+
+/* Boolean networks.
+ *
+ * WORD_GATHER computes a whole step of a boolean network: output bit i is
+ * op[i] applied to input bits gather_a[i] and gather_b[i]. The input bits are
+ * gathered 64 at a time into two words, and then all 64 ops are applied at
+ * once using four mask words per output word, in tables. Bit i of mask k is
+ * what op[i] gives when its inputs are (k >> 1, k & 1), so every op is one of
+ * the 16 boolean functions of two inputs.
+ *
+ * The inputs are usually all over the input array, so the loop prefetches
+ * the words it will need GATHER_PREFETCH_DISTANCE bits ahead.
+ */
+#define GATHER_PREFETCH_DISTANCE 16
+
+#ifdef __GNUC__
+#define prefetch_read(p) __builtin_prefetch((p), 0)
+#else
+#define prefetch_read(p) ((void)0)
+#endif
+
+
+/* Run a gather job on output words [from, to). */
+static void
+gather_range(struct word_job *job, long from, long to)
+{
+    const uint64_t *x = job->x;
+    const long *a = job->gather_a;
+    const long *b = job->gather_b;
+    long end = job->gather_size;
+    long w, i;
+
+    for (w = from; w < to; w++) {
+        long base = w * WORD_BITS;
+        long n = (end - base < (long)WORD_BITS ? end - base : (long)WORD_BITS);
+        uint64_t wa = 0, wb = 0;
+
+        for (i = 0; i < n; i++) {
+            long k = base + i;
+            if (k + GATHER_PREFETCH_DISTANCE < end) {
+                prefetch_read(x + a[k + GATHER_PREFETCH_DISTANCE] / WORD_BITS);
+                prefetch_read(x + b[k + GATHER_PREFETCH_DISTANCE] / WORD_BITS);
+            }
+            wa |= ((x[a[k] / WORD_BITS] >> (a[k] % WORD_BITS)) & 1) << i;
+            wb |= ((x[b[k] / WORD_BITS] >> (b[k] % WORD_BITS)) & 1) << i;
+        }
+
+        const uint64_t *t = job->tables + 4 * w;
+        job->dst[w] = (~wa & ~wb & t[0]) | (~wa & wb & t[1]) |
+            (wa & ~wb & t[2]) | (wa & wb & t[3]);
+    }
+}
+
+
+/* Reversing.
+ *
+ * WORD_REVERSE reverses the order of the bits of x. Word j of the result is
+ * made from the two words j places from the end of x, with their bits
+ * reversed. The unused bits at the end of x's last word end up at the start
+ * of the reversed words, so they're shifted out.
+ */
+
+
+/* Reverse the bits of a word: swap adjacent bits, then pairs, then nibbles,
+ * and then reverse the bytes.
+ */
+static inline uint64_t
+reverse_word(uint64_t word)
+{
+    word = ((word >> 1) & 0x5555555555555555ULL) |
+        ((word & 0x5555555555555555ULL) << 1);
+    word = ((word >> 2) & 0x3333333333333333ULL) |
+        ((word & 0x3333333333333333ULL) << 2);
+    word = ((word >> 4) & 0x0f0f0f0f0f0f0f0fULL) |
+        ((word & 0x0f0f0f0f0f0f0f0fULL) << 4);
+#ifdef __GNUC__
+    return __builtin_bswap64(word);
+#else
+    word = ((word >> 8) & 0x00ff00ff00ff00ffULL) |
+        ((word & 0x00ff00ff00ff00ffULL) << 8);
+    word = ((word >> 16) & 0x0000ffff0000ffffULL) |
+        ((word & 0x0000ffff0000ffffULL) << 16);
+    return (word >> 32) | (word << 32);
+#endif
+}
+
+
+/* Run a reverse job on words [from, to). */
+static void
+reverse_range(struct word_job *job, long from, long to)
+{
+    const uint64_t *x = job->x;
+    long words = job->words;
+    long pad = words * WORD_BITS - job->bits;
+    long j;
+
+    for (j = from; j < to; j++) {
+        uint64_t word = reverse_word(x[words - 1 - j]) >> pad;
+        if (pad > 0 && j + 1 < words) {
+            word |= reverse_word(x[words - 2 - j]) << (WORD_BITS - pad);
+        }
+        job->dst[j] = word;
+    }
+}
+
+
+/* Run a job on words [from, to), returning the count for WORD_COUNT and 0
+ * otherwise. WORD_COUNT_AND_OR adds its second count to *count2.
+ *
+ * For WORD_COPY_BITS, "word" i means the bits that land in the i-th word of
+ * the destination range, so the words of a job never share destination words
+ * with each other.
+ */
+static long
+word_job_range(struct word_job *job, long from, long to, long *count2)
+{
+    uint64_t *dst = job->dst;
+    const uint64_t *x = job->x;
+    const uint64_t *y = job->y;
+    long i;
+
+    switch (job->op) {
+        case WORD_COUNT:
+            return popcount_bytes(x + from, (to - from) * WORD_BYTES);
+        case WORD_ZERO:
+            memset(dst + from, 0x00, (to - from) * WORD_BYTES);
+            break;
+        case WORD_ONES:
+            memset(dst + from, 0xff, (to - from) * WORD_BYTES);
+            break;
+        case WORD_COPY:
+            memcpy(dst + from, x + from, (to - from) * WORD_BYTES);
+            break;
+        case WORD_NOT:
+            for (i = from; i < to; i++) dst[i] = ~x[i];
+            break;
+        case WORD_AND:
+            for (i = from; i < to; i++) dst[i] = x[i] & y[i];
+            break;
+        case WORD_OR:
+            for (i = from; i < to; i++) dst[i] = x[i] | y[i];
+            break;
+        case WORD_XOR:
+            for (i = from; i < to; i++) dst[i] = x[i] ^ y[i];
+            break;
+        case WORD_ANDNOT:
+            for (i = from; i < to; i++) dst[i] = x[i] & ~y[i];
+            break;
+        case WORD_COPY_BITS: {
+            long offset = job->dst_beg % WORD_BITS;
+            long beg = from * WORD_BITS - offset;
+            long end = to * WORD_BITS - offset;
+            if (beg < 0) beg = 0;
+            if (end > job->bits) end = job->bits;
+            copy_bits(dst, job->dst_beg + beg, x, job->x_beg + beg, end - beg);
+            break;
+        }
+        case WORD_AND_ALL:
+        case WORD_OR_ALL:
+        case WORD_THRESHOLD:
+            multi_op_range(job, from, to);
+            break;
+        case WORD_COUNT_OF:
+            return popcount_combined(job->combine, x + from, y + from,
+                    to - from);
+        case WORD_ANY_OF:
+            return any_of_range(job, from, to);
+        case WORD_COUNT_AND_OR:
+            return popcount_and_or(x + from, y + from, to - from, count2);
+        case WORD_GATHER:
+            gather_range(job, from, to);
+            break;
+        case WORD_REVERSE:
+            reverse_range(job, from, to);
+            break;
+    }
+    return 0;
+}
+
+
+/* Parallel jobs.
+ *
+ * Very large jobs are split into chunks of PARALLEL_CHUNK_WORDS words, which
+ * are shared out between the calling thread and a pool of worker threads.
+ * BitArray.parallelism sets the total number of threads to use; the default
+ * of 1 means there is no pool, and everything runs in the calling thread.
+ *
+ * The pool only works on one job at a time. If another thread already has
+ * it, a job just runs in the calling thread instead. Worker threads are
+ * started when they're first needed, and block all signals so that Ruby
+ * still gets them. A forked child starts again with a new pool.
+ */
+#define PARALLEL_CHUNK_WORDS ((long)((256 * 1024) / WORD_BYTES))
+#define PARALLEL_MIN_WORDS (4 * PARALLEL_CHUNK_WORDS)
+#define PARALLELISM_MAX 256
+
+static int parallelism = 1;
+
+#ifdef HAVE_PTHREAD_H
+
+struct worker_pool {
+    pthread_mutex_t owner;   /* Held by the thread that is using the pool. */
+    pthread_mutex_t mutex;   /* Protects everything below. */
+    pthread_cond_t start;    /* Signalled when there's a new job. */
+    pthread_cond_t finished; /* Signalled when a worker finishes a job. */
+    pthread_t *threads;
+    int size;                /* Number of worker threads. */
+    pid_t pid;               /* The process the workers belong to. */
+    int shutdown;
+    unsigned long generation; /* Incremented for each job. */
+    struct word_job *job;
+    long next_chunk;
+    long chunks;
+    int busy;                /* Workers still working on the current job. */
+    long count;              /* Sum of the counts of the finished chunks. */
+    long count2;             /* And of their second counts. */
+};
+
+static struct worker_pool pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, 0, 0, 0, 0, NULL, 0, 0, 0, 0, 0
+};
+
+
+/* Work on chunks of the pool's current job until there are none left, and
+ * add up their counts. pool.mutex must be held; it's released while each
+ * chunk runs.
+ */
+static void
+pool_work(void)
+{
+    struct word_job *job = pool.job;
+    while (pool.next_chunk < pool.chunks) {
+        long from = pool.next_chunk++ * PARALLEL_CHUNK_WORDS;
+        long to = from + PARALLEL_CHUNK_WORDS;
+        if (to > job->words) {
+            to = job->words;
+        }
+
+        pthread_mutex_unlock(&pool.mutex);
+        long count2 = 0;
+        long count = word_job_range(job, from, to, &count2);
+        pthread_mutex_lock(&pool.mutex);
+        pool.count += count;
+        pool.count2 += count2;
+        if (job->op == WORD_ANY_OF && count != 0) {
+            pool.next_chunk = pool.chunks;
+        }
+    }
+}
+
+
+/* The main loop of each worker thread. */
+static void *
+pool_worker(void *arg)
+{
+    unsigned long seen = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool.mutex);
+    for (;;) {
+        while (!pool.shutdown && pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.mutex);
+        }
+        if (pool.shutdown) {
+            break;
+        }
+        seen = pool.generation;
+        pool_work();
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.finished);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+
+/* Stop the worker threads. pool.owner must be held. */
+static void
+pool_stop(void)
+{
+    int i;
+    pthread_mutex_lock(&pool.mutex);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (i = 0; i < pool.size; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.size = 0;
+    pool.shutdown = 0;
+}
+
+
+/* Make sure there are size worker threads, starting or stopping them as
+ * needed. Returns the number there actually are, which may be fewer if
+ * threads can't be created. pool.owner must be held.
+ */
+static int
+pool_resize(int size)
+{
+    if (pool.size == size) {
+        return size;
+    }
+    if (pool.size > 0) {
+        pool_stop();
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    pool.threads = malloc(size * sizeof(pthread_t));
+    if (pool.threads == NULL) {
+        return 0;
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (pool.size = 0; pool.size < size; pool.size++) {
+        if (pthread_create(&pool.threads[pool.size], NULL, pool_worker,
+                    NULL) != 0) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    pool.pid = getpid();
+    return pool.size;
+}
+
+
+/* Throw away a pool inherited from our parent process. Its threads didn't
+ * survive the fork, and its locks may have been held when it happened.
+ */
+static void
+pool_after_fork(void)
+{
+    pthread_mutex_t unlocked = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t unsignalled = PTHREAD_COND_INITIALIZER;
+    pool.owner = unlocked;
+    pool.mutex = unlocked;
+    pool.start = unsignalled;
+    pool.finished = unsignalled;
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.size = 0;
+    pool.shutdown = 0;
+}
+
+
+/* Run a job with the worker pool. Returns 0 if the pool can't be used, in
+ * which case the job hasn't been run.
+ */
+static int
+run_parallel(struct word_job *job)
+{
+    if (pool.size > 0 && pool.pid != getpid()) {
+        pool_after_fork();
+    }
+    if (pthread_mutex_trylock(&pool.owner) != 0) {
+        return 0;
+    }
+    if (pool_resize(parallelism - 1) == 0) {
+        pthread_mutex_unlock(&pool.owner);
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.job = job;
+    pool.next_chunk = 0;
+    pool.chunks = (job->words - 1) / PARALLEL_CHUNK_WORDS + 1;
+    pool.count = 0;
+    pool.count2 = 0;
+    pool.busy = pool.size;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+
+    pool_work();
+    while (pool.busy > 0) {
+        pthread_cond_wait(&pool.finished, &pool.mutex);
+    }
+    job->count = pool.count;
+    job->count2 = pool.count2;
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.mutex);
+
+    pthread_mutex_unlock(&pool.owner);
+    return 1;
+}
+
+
+/* Change the number of threads used for parallel jobs. */
+static void
+set_parallelism(int n)
+{
+    parallelism = n;
+    if (pool.size > 0 && pool.pid != getpid()) {
+        pool_after_fork();
+    }
+
+    /* Waits for any job that's using the pool to finish. */
+    pthread_mutex_lock(&pool.owner);
+    if (pool.size > n - 1) {
+        pool_resize(0);
+    }
+    pthread_mutex_unlock(&pool.owner);
+}
+
+#else
+
+static int
+run_parallel(struct word_job *job)
+{
+    (void)job;
+    return 0;
+}
+
+static void
+set_parallelism(int n)
+{
+    parallelism = n;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+
+/* Run a whole job, in parallel if it's big enough. This has the signature
+ * rb_thread_call_without_gvl2 wants.
+ */
+static void *
+run_word_job(void *arg)
+{
+    struct word_job *job = arg;
+    if (parallelism < 2 || job->words < PARALLEL_MIN_WORDS ||
+            !run_parallel(job)) {
+        job->count2 = 0;
+        job->count = word_job_range(job, 0, job->words, &job->count2);
+    }
+    job->done = 1;
+    return NULL;
+}
+
+
+/* Run a job, without the GVL if it's big enough. locked is a list of the n
+ * bitarrays that other threads could get at while the job runs; they're
+ * locked until it's finished. Entries may be NULL, or repeated.
+ */
+static void
+run_job_locking(struct word_job *job, struct bitarray **locked, long n)
+{
+    job->done = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    if (job->words >= NOGVL_MIN_WORDS) {
+        long i;
+        for (i = 0; i < n; i++) {
+            if (locked[i]) locked[i]->locks++;
+        }
+        /* This doesn't check for interrupts once it has the GVL back, so it
+         * can't raise and leave the locks held. If there's an interrupt
+         * pending before it starts, it returns without running the job, and
+         * we run it below instead.
+         */
+        rb_thread_call_without_gvl2(run_word_job, job, NULL, NULL);
+        for (i = 0; i < n; i++) {
+            if (locked[i]) locked[i]->locks--;
+        }
+    }
+#endif
+    if (!job->done) {
+        run_word_job(job);
+    }
+}
+
+
+/* Run a job that uses up to two bitarrays, ba1 and ba2, which may be NULL. */
+static void
+run_job(struct word_job *job, struct bitarray *ba1, struct bitarray *ba2)
+{
+    struct bitarray *locked[2];
+    locked[0] = ba1;
+    locked[1] = ba2;
+    run_job_locking(job, locked, 2);
+}
+
+
+/* Run one of the word operations on the given number of words. See
+ * word_op_type for what dst, x and y are used for. Returns the count for
+ * WORD_COUNT, and 0 otherwise.
+ */
+static long
+word_op(enum word_op_type op, uint64_t *dst, const uint64_t *x,
+        const uint64_t *y, long words, struct bitarray *ba1,
+        struct bitarray *ba2)
+{
+    if (words <= 0) {
+        return 0;
+    }
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = op;
+    job.dst = dst;
+    job.x = x;
+    job.y = y;
+    job.words = words;
+    run_job(&job, ba1, ba2);
+    return job.count;
+}
+
+
+/* copy_bits as a bulk operation. src_ba is the bitarray that src belongs
+ * to.
+ */
+static void
+copy_bits_op(uint64_t *dst, long dst_beg, const uint64_t *src, long src_beg,
+        long len, struct bitarray *src_ba)
+{
+    if (len <= 0) {
+        return;
+    }
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = WORD_COPY_BITS;
+    job.dst = dst;
+    job.x = src;
+    job.dst_beg = dst_beg;
+    job.x_beg = src_beg;
+    job.bits = len;
+    job.words = word_array_size(dst_beg % WORD_BITS + len);
+    run_job(&job, src_ba, NULL);
+}
+
+
+/* Set the specified bit to 1. */
+static inline void
+set_bit(struct bitarray *ba, long index)
+{
+    index = check_index(ba, index);
+    bitarray_changed(ba);
+    ba->array[index / WORD_BITS] |= bitmask(index);
+}
+
+
+/* Set all bits to 1. */
+static inline void
+set_all_bits(struct bitarray *ba)
+{
+    bitarray_changed(ba);
+    word_op(WORD_ONES, ba->array, NULL, NULL, ba->array_size, ba, NULL);
+    clear_unused_bits(ba);
+}
+
+
+/* Clear the specified bit to 0. */
+static inline void
+clear_bit(struct bitarray *ba, long index)
+{
+    index = check_index(ba, index);
+    bitarray_changed(ba);
+    ba->array[index / WORD_BITS] &= ~bitmask(index);
+}
+
+
+/* Clear all bits to 0. */
+static inline void
+clear_all_bits(struct bitarray *ba)
+{
+    bitarray_changed(ba);
+    word_op(WORD_ZERO, ba->array, NULL, NULL, ba->array_size, ba, NULL);
+}
+
+
+/* Toggle the state of the specified bit. */
+static inline void
+toggle_bit(struct bitarray *ba, long index)
+{
+    index = check_index(ba, index);
+    bitarray_changed(ba);
+    ba->array[index / WORD_BITS] ^= bitmask(index);
+}
+
+
+/* Toggle the state of all bits. */
+static inline void 
+toggle_all_bits(struct bitarray *ba)
+{
+    bitarray_changed(ba);
+    word_op(WORD_NOT, ba->array, ba->array, NULL, ba->array_size, ba, NULL);
+    clear_unused_bits(ba);
+}
+
+
+/* Assign the specified value to a bit. If the specified value is invalid,
+ * raises an ArgumentError.
+ */ 
+static inline void
+assign_bit(struct bitarray *ba, long index, int value)
+{
+    if (value == 0) {
+        clear_bit(ba, index);
+    } else if (value == 1) {
+        set_bit(ba, index);
+    } else {
+        rb_raise(rb_eArgError, "bit value %d out of range", value);
+    }
+}
+
+
+/* Apply op to the bits of a word selected by mask. op is WORD_ONES, WORD_ZERO
+ * or WORD_NOT.
+ */
+static inline void
+mask_word(uint64_t *word, enum word_op_type op, uint64_t mask)
+{
+    switch (op) {
+        case WORD_ONES:
+            *word |= mask;
+            break;
+        case WORD_ZERO:
+            *word &= ~mask;
+            break;
+        default:
+            *word ^= mask;
+            break;
+    }
+}
+
+
+/* Set, clear or toggle the bits beg..beg+len-1, for an op of WORD_ONES,
+ * WORD_ZERO or WORD_NOT. Only the words at the edges of the range need
+ * masking; the ones in between are done as a bulk operation.
+ */
+static void
+range_op(struct bitarray *ba, enum word_op_type op, long beg, long len)
+{
+    if (len <= 0) {
+        return;
+    }
+    bitarray_changed(ba);
+
+    long end = beg + len;
+    long first = beg / WORD_BITS;
+    long last = (end - 1) / WORD_BITS;
+    uint64_t first_mask = WORD_MAX << (beg % WORD_BITS);
+    uint64_t last_mask = WORD_MAX >> ((WORD_BITS - end % WORD_BITS) % WORD_BITS);
+    if (first == last) {
+        mask_word(ba->array + first, op, first_mask & last_mask);
+        return;
+    }
+
+    mask_word(ba->array + first, op, first_mask);
+    word_op(op, ba->array + first + 1, ba->array + first + 1, NULL,
+            last - first - 1, ba, NULL);
+    mask_word(ba->array + last, op, last_mask);
+}
+
+
+/* Assign the specified value to the bits beg..beg+len-1. If the specified
+ * value is invalid, raises an ArgumentError.
+ */
+static void
+assign_range(struct bitarray *ba, long beg, long len, int value)
+{
+    if (value == 0) {
+        range_op(ba, WORD_ZERO, beg, len);
+    } else if (value == 1) {
+        range_op(ba, WORD_ONES, beg, len);
+    } else {
+        rb_raise(rb_eArgError, "bit value %d out of range", value);
+    }
+}
+
+
+/* Get the state of the specified bit. */
+static inline int
+get_bit(struct bitarray *ba, long index)
+{
+    index = check_index(ba, index);
+
+    /* We could shift the bit down, but this is easier. We need a uint64_t to
+     * prevent overflow.
+     */
+    uint64_t b = (ba->array[index / WORD_BITS] & bitmask(index));
+    if (b > 0) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+
+/* Batches of bits.
+ *
+ * These work on a list of n indices at once, which must already have been
+ * through check_index. Random indices into a large bitarray mostly miss the
+ * cache, so each loop prefetches the word it will need PREFETCH_DISTANCE
+ * indices ahead, and has several misses in flight at a time.
+ */
+#define PREFETCH_DISTANCE 16
+
+#ifdef __GNUC__
+#define prefetch_word(ba, index, rw) \
+    __builtin_prefetch(&(ba)->array[(index) / WORD_BITS], (rw))
+#else
+#define prefetch_word(ba, index, rw) ((void)0)
+#endif
+
+
+/* Set the bits at the given indices to 1. */
+static void
+set_bit_list(struct bitarray *ba, const long *indices, long n)
+{
+    long i;
+    bitarray_changed(ba);
+    for (i = 0; i < n; i++) {
+        if (i + PREFETCH_DISTANCE < n) {
+            prefetch_word(ba, indices[i + PREFETCH_DISTANCE], 1);
+        }
+        ba->array[indices[i] / WORD_BITS] |= bitmask(indices[i]);
+    }
+}
+
+
+/* Clear the bits at the given indices to 0. */
+static void
+clear_bit_list(struct bitarray *ba, const long *indices, long n)
+{
+    long i;
+    bitarray_changed(ba);
+    for (i = 0; i < n; i++) {
+        if (i + PREFETCH_DISTANCE < n) {
+            prefetch_word(ba, indices[i + PREFETCH_DISTANCE], 1);
+        }
+        ba->array[indices[i] / WORD_BITS] &= ~bitmask(indices[i]);
+    }
+}
+
+
+/* Store the bits at the given indices in bits, one per byte. */
+static void
+get_bit_list(struct bitarray *ba, const long *indices, long n,
+        unsigned char *bits)
+{
+    long i;
+    for (i = 0; i < n; i++) {
+        if (i + PREFETCH_DISTANCE < n) {
+            prefetch_word(ba, indices[i + PREFETCH_DISTANCE], 0);
+        }
+        bits[i] = (ba->array[indices[i] / WORD_BITS] >>
+                (indices[i] % WORD_BITS)) & 1;
+    }
+}
+
+
+/* Return the position in the list of the first index whose bit is value, or
+ * -1 if there isn't one.
+ */
+static long
+find_bit_in_list(struct bitarray *ba, const long *indices, long n, int value)
+{
+    long i;
+    for (i = 0; i < n; i++) {
+        if (i + PREFETCH_DISTANCE < n) {
+            prefetch_word(ba, indices[i + PREFETCH_DISTANCE], 0);
+        }
+        if ((int)((ba->array[indices[i] / WORD_BITS] >>
+                        (indices[i] % WORD_BITS)) & 1) == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/* Return the number of set bits in the array. */
+static inline long
+total_set(struct bitarray *ba)
+{
+    return word_op(WORD_COUNT, NULL, ba->array, NULL, ba->array_size, ba,
+            NULL);
+}
+
+
+/* Return the number of set bits in the len bits starting at beg. The range
+ * must already have been checked.
+ */
+static long
+total_set_range(struct bitarray *ba, long beg, long len)
+{
+    if (len <= 0) {
+        return 0;
+    }
+
+    long end = beg + len - 1;
+    long first = beg / WORD_BITS;
+    long last = end / WORD_BITS;
+    uint64_t first_mask = WORD_MAX << (beg % WORD_BITS);
+    uint64_t last_mask = WORD_MAX >> (WORD_BITS - 1 - end % WORD_BITS);
+
+    if (first == last) {
+        return popcount_word(ba->array[first] & first_mask & last_mask);
+    }
+
+    /* Count the partial words at either end, and everything in between. */
+    return popcount_word(ba->array[first] & first_mask) +
+        word_op(WORD_COUNT, NULL, ba->array + first + 1, NULL,
+                last - first - 1, ba, NULL) +
+        popcount_word(ba->array[last] & last_mask);
+}
+
+
+/* Searching for bits.
+ *
+ * These skip over whole words that can't contain a match, and use ctz/clz to
+ * find the bit within the word that does. They return -1 if there is no
+ * matching bit. Indices are not checked; anything at or past the end of the
+ * array simply finds nothing.
+ */
+
+
+/* Return the index of the first set bit at or after from. */
+static long
+next_set_bit(struct bitarray *ba, long from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+    if (from >= ba->bits) {
+        return -1;
+    }
+
+    long i = from / WORD_BITS;
+    uint64_t word = ba->array[i] & (WORD_MAX << (from % WORD_BITS));
+    while (word == 0) {
+        if (++i >= ba->array_size) {
+            return -1;
+        }
+        word = ba->array[i];
+    }
+    return i * WORD_BITS + ctz_word(word);
+}
+
+
+/* Return the index of the first clear bit at or after from. */
+static long
+next_clear_bit(struct bitarray *ba, long from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+    if (from >= ba->bits) {
+        return -1;
+    }
+
+    long i = from / WORD_BITS;
+    uint64_t word = ~ba->array[i] & (WORD_MAX << (from % WORD_BITS));
+    while (word == 0) {
+        if (++i >= ba->array_size) {
+            return -1;
+        }
+        word = ~ba->array[i];
+    }
+
+    /* The unused bits in the last word are clear, so we have to make sure we
+     * didn't find one of those.
+     */
+    long index = i * WORD_BITS + ctz_word(word);
+    return (index < ba->bits ? index : -1);
+}
+
+
+/* Return the index of the last set bit. */
+static long
+last_set_bit(struct bitarray *ba)
+{
+    long i;
+    for (i = ba->array_size - 1; i >= 0; i--) {
+        if (ba->array[i] != 0) {
+            return i * WORD_BITS + (WORD_BITS - 1) - clz_word(ba->array[i]);
+        }
+    }
+    return -1;
+}
+
+
+/* Rank and select.
+ *
+ * rank(i) is the number of set bits before index i, and select(k) is the
+ * index of the set bit with rank k. Both can be answered by scanning the
+ * array, but a bitarray can also have an index that makes them (nearly)
+ * constant-time. The index is built the first time it's needed, and thrown
+ * away by bitarray_changed.
+ *
+ * The layout is a simplified version of "poppy" (Zhou, Andersen and
+ * Kaminsky, 2013). The array is split into 2048-bit blocks, each of which is
+ * split into four 512-bit sub-blocks. For each block, l1 holds one word:
+ *
+ *   bits  0-31: set bits between the start of the 2^32-bit chunk and the
+ *               start of the block
+ *   bits 32-61: set bits in each of the first three sub-blocks, 10 bits
+ *               apiece
+ *
+ * l0 holds the number of set bits before each 2^32-bit chunk. That works out
+ * at a little over 3% of the size of the array. Answering a query takes one
+ * l0 and one l1 lookup, and a popcount of at most eight words.
+ */
+#define RANK_L0_SHIFT 32
+#define RANK_L1_BITS 2048
+#define RANK_L1_WORDS ((long)(RANK_L1_BITS / WORD_BITS))
+#define RANK_L2_BITS 512
+#define RANK_L2_WORDS ((long)(RANK_L2_BITS / WORD_BITS))
+
+/* Number of set bits before the start of block b. */
+#define rank_block_base(index, b) \
+    ((index)->l0[((uint64_t)(b) * RANK_L1_BITS) >> RANK_L0_SHIFT] + \
+     ((index)->l1[b] & 0xffffffff))
+
+/* Number of set bits in sub-block s (0-2) of an l1 entry. */
+#define rank_sub_count(entry, s) (((entry) >> (32 + 10 * (s))) & 0x3ff)
+
+
+/* Build a rank/select index for a bitarray. */
+static struct rank_index *
+build_rank_index(struct bitarray *ba)
+{
+    /* There's always one more block than we need for the bits, so that
+     * rank(bits) has a block to start from.
+     */
+    long l1_size = ba->array_size / RANK_L1_WORDS + 1;
+    long l0_size = (long)(((uint64_t)(l1_size - 1) * RANK_L1_BITS) >>
+            RANK_L0_SHIFT) + 1;
+
+    struct rank_index *index = ALLOC(struct rank_index);
+    index->l0 = ALLOC_N(uint64_t, l0_size);
+    index->l1 = ALLOC_N(uint64_t, l1_size);
+
+    uint64_t total = 0;
+    long b, s;
+    for (b = 0; b < l1_size; b++) {
+        uint64_t chunk = ((uint64_t)b * RANK_L1_BITS) >> RANK_L0_SHIFT;
+        if (((uint64_t)b * RANK_L1_BITS) % ((uint64_t)1 << RANK_L0_SHIFT) == 0) {
+            index->l0[chunk] = total;
+        }
+
+        uint64_t entry = total - index->l0[chunk];
+        for (s = 0; s < 4; s++) {
+            long start = b * RANK_L1_WORDS + s * RANK_L2_WORDS;
+            long words = ba->array_size - start;
+            if (words > RANK_L2_WORDS) {
+                words = RANK_L2_WORDS;
+            }
+
+            uint64_t count = 0;
+            if (words > 0) {
+                count = popcount_bytes(ba->array + start, words * WORD_BYTES);
+            }
+            if (s < 3) {
+                entry |= count << (32 + 10 * s);
+            }
+            total += count;
+        }
+        index->l1[b] = entry;
+    }
+
+    return index;
+}
+
+
+/* Return the rank/select index for a bitarray, building it if necessary. The
+ * index is kept until the bits change, except for a locked bitarray, whose
+ * bits could be changing as we read them, or a mapped one, whose bits another
+ * mapping of the file can change without telling us. Those get a new index
+ * each time, which the caller gives back with done_with_rank_index.
+ */
+static inline struct rank_index *
+rank_index(struct bitarray *ba)
+{
+    if (ba->rank_index) {
+        return ba->rank_index;
+    }
+    struct rank_index *index = build_rank_index(ba);
+    if (!ba->mapped && !ba->locks) {
+        ba->rank_index = index;
+    }
+    return index;
+}
+
+
+/* Free an index from rank_index, if the bitarray didn't keep it. */
+static inline void
+done_with_rank_index(struct bitarray *ba, struct rank_index *index)
+{
+    if (index != ba->rank_index) {
+        free_rank_index(index);
+    }
+}
+
+
+/* Return the number of set bits before index i, using the given index. */
+static long
+index_rank(struct bitarray *ba, struct rank_index *index, long i)
+{
+    long b = i / RANK_L1_BITS;
+    long sub = (i % RANK_L1_BITS) / RANK_L2_BITS;
+    uint64_t entry = index->l1[b];
+    uint64_t count = rank_block_base(index, b);
+
+    long s;
+    for (s = 0; s < sub; s++) {
+        count += rank_sub_count(entry, s);
+    }
+
+    long first = b * RANK_L1_WORDS + sub * RANK_L2_WORDS;
+    long last = i / WORD_BITS;
+    if (last > first) {
+        count += popcount_bytes(ba->array + first,
+                (last - first) * WORD_BYTES);
+    }
+    if (i % WORD_BITS != 0) {
+        count += popcount_word(ba->array[last] & (bitmask(i) - 1));
+    }
+
+    return (long)count;
+}
+
+
+/* Return the number of set bits before index i. i must be between 0 and
+ * ba->bits, inclusive.
+ */
+static long
+rank(struct bitarray *ba, long i)
+{
+    struct rank_index *index = rank_index(ba);
+    long count = index_rank(ba, index, i);
+    done_with_rank_index(ba, index);
+    return count;
+}
+
+
+/* Return the index of the k-th set bit in a word (counting from 0), which
+ * must have more than k set bits. This is the broadword method from Vigna,
+ * "Broadword implementation of rank/select queries" (2008): the byte-wise
+ * running totals of the word's popcount tell us which byte the bit is in, and
+ * the same trick on the running totals within that byte finds the bit. There
+ * are no loops or branches.
+ */
+#define BYTES_ONE 0x0101010101010101ULL
+#define BYTES_HIGH 0x8080808080808080ULL
+
+static inline long
+select_word(uint64_t x, long k)
+{
+    uint64_t s = x - ((x >> 1) & 0x5555555555555555ULL);
+    s = (s & 0x3333333333333333ULL) + ((s >> 2) & 0x3333333333333333ULL);
+    s = (s + (s >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    s *= BYTES_ONE;   /* Byte i is the number of bits in bytes 0-i. */
+
+    /* The bit is in the first byte whose running total is more than k. */
+    uint64_t le = ((k * BYTES_ONE) | BYTES_HIGH) - s;
+    long byte = (long)((((le & BYTES_HIGH) >> 7) * BYTES_ONE) >> 56) * 8;
+    k -= (long)(((s << 8) >> byte) & 0xff);
+
+    /* Byte j of t is the bits of that byte up to and including bit j. */
+    uint64_t t = ((x >> byte) & 0xff) * BYTES_ONE & 0xff7f3f1f0f070301ULL;
+    t = t - ((t >> 1) & 0x5555555555555555ULL);
+    t = (t & 0x3333333333333333ULL) + ((t >> 2) & 0x3333333333333333ULL);
+    t = (t + (t >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    le = ((k * BYTES_ONE) | BYTES_HIGH) - t;
+    return byte + (long)((((le & BYTES_HIGH) >> 7) * BYTES_ONE) >> 56);
+}
+
+
+/* Find the k-th set bit in n words, counting from 0. Returns its index from
+ * the start of the words, or -1 if there aren't that many set bits. These
+ * are the word scans at the end of a select, so like the popcount kernels
+ * there are versions for the instructions the CPU has, picked by init_select.
+ */
+#define SELECT_WORDS(words, n, k, popcount, select) do {                    \
+    long w_, count_;                                                        \
+    for (w_ = 0; w_ < (n); w_++) {                                          \
+        count_ = popcount((words)[w_]);                                     \
+        if (count_ > (k)) {                                                 \
+            return w_ * WORD_BITS + select((words)[w_], (k));               \
+        }                                                                   \
+        (k) -= count_;                                                      \
+    }                                                                       \
+    return -1;                                                              \
+} while (0)
+
+static long
+select_words_portable(const uint64_t *words, long n, long k)
+{
+    SELECT_WORDS(words, n, k, popcount_word, select_word);
+}
+
+
+#ifdef HAVE_CPU_DISPATCH
+
+/* With POPCNT for the scan. */
+__attribute__((target("popcnt")))
+static long
+select_words_popcnt(const uint64_t *words, long n, long k)
+{
+    SELECT_WORDS(words, n, k, __builtin_popcountll, select_word);
+}
+
+
+/* With BMI2, the bit within the word is a PDEP and a TZCNT: depositing a
+ * single bit at position k into the set bits of x leaves only the k-th of
+ * them set.
+ */
+__attribute__((target("popcnt,bmi,bmi2")))
+static inline long
+select_word_pdep(uint64_t x, long k)
+{
+    return (long)_tzcnt_u64(_pdep_u64((uint64_t)1 << k, x));
+}
+
+__attribute__((target("popcnt,bmi,bmi2")))
+static long
+select_words_bmi2(const uint64_t *words, long n, long k)
+{
+    SELECT_WORDS(words, n, k, __builtin_popcountll, select_word_pdep);
+}
+
+#endif /* HAVE_CPU_DISPATCH */
+
+
+static long (*select_words)(const uint64_t *, long, long) =
+    select_words_portable;
+
+
+/* Pick the select word scan for the CPU we're running on. Called from
+ * Init_bitarray.
+ */
+static void
+init_select(void)
+{
+#ifdef HAVE_CPU_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        select_words = select_words_popcnt;
+        if (__builtin_cpu_supports("bmi2")) {
+            select_words = select_words_bmi2;
+        }
+    }
+#endif
+}
+
+
+/* Return the index of the set bit with rank k (that is, the (k+1)-th set
+ * bit), or -1 if there aren't that many set bits.
+ */
+static long
+select_bit(struct bitarray *ba, long k)
+{
+    if (k < 0) {
+        return -1;
+    }
+    struct rank_index *index = rank_index(ba);
+    if (k >= index_rank(ba, index, ba->bits)) {
+        done_with_rank_index(ba, index);
+        return -1;
+    }
+
+    /* Find the last block that starts with no more than k bits before it. */
+    long lo = 0;
+    long hi = ba->array_size / RANK_L1_WORDS;
+    while (lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (rank_block_base(index, mid) <= (uint64_t)k) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    k -= (long)rank_block_base(index, lo);
+
+    /* Then the sub-block, and the word within that. */
+    uint64_t entry = index->l1[lo];
+    long s = 0;
+    while (s < 3 && (long)rank_sub_count(entry, s) <= k) {
+        k -= rank_sub_count(entry, s);
+        s++;
+    }
+
+    /* An index built while the bits were changing may not match them, so
+     * don't trust it to stop us before the end.
+     */
+    long w = lo * RANK_L1_WORDS + s * RANK_L2_WORDS;
+    done_with_rank_index(ba, index);
+    long bit = select_words(ba->array + w, ba->array_size - w, k);
+    if (bit < 0) {
+        return -1;
+    }
+
+    bit += w * WORD_BITS;
+    return bit < ba->bits ? bit : -1;
+}
+
+
+/* Shared storage.
+ *
+ * Copies and views of a bitarray share its storage until one of them changes
+ * it, so clone, dup and view take constant time. The storage allocation
+ * starts with a count of the bitarrays using it, and bitarray_changed gives a
+ * bitarray its own copy of the words before it changes them if that count is
+ * more than one. A view's array points partway into the storage of the
+ * bitarray it was made from.
+ *
+ * Storage is only ever written by a bitarray that has it to itself. So while
+ * one bitarray copies shared storage without the GVL, nothing else can change
+ * it, and the copier's own reference keeps it alive.
+ *
+ * The words are aligned to WORD_ALIGN bytes after the header, so ba->array
+ * points a little way into the allocation; ba->buffer is what gets freed.
+ * Mapped bitarrays don't have any storage of this kind, and are never shared.
+ * Neither do bitarrays of up to INLINE_WORDS words, which keep their words in
+ * the bitarray structure, so that making one takes a single allocation. Those
+ * are copied rather than shared, which is about as cheap at that size.
+ *
+ * Bitarrays are often made and thrown away in large numbers, so storage of up
+ * to STORAGE_POOL_MAX_WORDS words is rounded up to a power of two, and kept on
+ * a free list for its size when it's released, to be used again instead of
+ * going back to malloc. Storage is only ever allocated and released with the
+ * GVL held, so the lists don't need a lock. Each list is kept to
+ * STORAGE_POOL_DEPTH entries, which bounds how much memory it holds on to.
+ */
+#define STORAGE_EXTRA (sizeof(struct storage_header) + WORD_ALIGN - 1)
+#define STORAGE_POOL_MIN_WORDS (INLINE_WORDS * 2)
+#define STORAGE_POOL_CLASSES 8
+#define STORAGE_POOL_MAX_WORDS \
+    (STORAGE_POOL_MIN_WORDS << (STORAGE_POOL_CLASSES - 1))
+#define STORAGE_POOL_DEPTH 32
+
+static struct {
+    void *free;          /* Released storage, linked through its words. */
+    long count;          /* Length of the free list. */
+} storage_pool[STORAGE_POOL_CLASSES];
+
+
+/* Return the aligned array of words in a storage allocation. */
+static inline uint64_t *
+storage_array(void *buffer)
+{
+    return (uint64_t *)(((uintptr_t)buffer + sizeof(struct storage_header) +
+                WORD_ALIGN - 1) & ~(uintptr_t)(WORD_ALIGN - 1));
+}
+
+
+/* Return the size class for storage of the given number of words, which must
+ * be no more than STORAGE_POOL_MAX_WORDS.
+ */
+static inline int
+storage_class(long words)
+{
+    int class = 0;
+    while ((STORAGE_POOL_MIN_WORDS << class) < words) {
+        class++;
+    }
+    return class;
+}
+
+
+/* Allocate storage for at least the given number of words, with one user. */
+static void *
+new_storage(long words)
+{
+    void *buffer;
+    if (words <= STORAGE_POOL_MAX_WORDS) {
+        int class = storage_class(words);
+        words = STORAGE_POOL_MIN_WORDS << class;
+        buffer = storage_pool[class].free;
+        if (buffer) {
+            storage_pool[class].free = *(void **)storage_array(buffer);
+            storage_pool[class].count--;
+            storage_refs(buffer) = 1;
+            return buffer;
+        }
+    }
+
+    buffer = ruby_xmalloc(words * WORD_BYTES + STORAGE_EXTRA);
+    storage_refs(buffer) = 1;
+    storage_words(buffer) = words;
+    return buffer;
+}
+
+
+/* Drop a reference to storage, freeing it if nothing else is using it. */
+static void
+release_storage(void *buffer)
+{
+    if (--storage_refs(buffer) > 0) {
+        return;
+    }
+
+    long words = storage_words(buffer);
+    if (words <= STORAGE_POOL_MAX_WORDS) {
+        int class = storage_class(words);
+        if ((STORAGE_POOL_MIN_WORDS << class) == words &&
+                storage_pool[class].count < STORAGE_POOL_DEPTH) {
+            *(void **)storage_array(buffer) = storage_pool[class].free;
+            storage_pool[class].free = buffer;
+            storage_pool[class].count++;
+            return;
+        }
+    }
+    ruby_xfree(buffer);
+}
+
+
+/* Point a bitarray of no more than INLINE_WORDS words at its own words. */
+static inline void
+use_inline_words(struct bitarray *ba)
+{
+    ba->array = ba->inline_words;
+    ba->buffer = NULL;
+    ba->capacity = INLINE_WORDS;
+}
+
+
+/* Initialize an already-allocated bitarray structure to use the storage of
+ * another bitarray structure, starting at the given word, for the given number
+ * of bits. The bits must either run to the end of orig_ba, or end on a word
+ * boundary, so that the unused bits of the last word are clear.
+ */
+static void
+share_storage(struct bitarray *new_ba, struct bitarray *orig_ba, long word,
+        long bits)
+{
+    new_ba->bits = bits;
+    new_ba->array_size = word_array_size(bits);
+    new_ba->capacity = new_ba->array_size;
+    if (new_ba->array_size == 0) {
+        use_inline_words(new_ba);
+        return;
+    }
+
+    new_ba->array = orig_ba->array + word;
+    new_ba->buffer = orig_ba->buffer;
+    storage_refs(new_ba->buffer)++;
+}
+
+
+/* Give a bitarray that shares its storage a copy of its own. Only its own
+ * words are copied, so a view doesn't pay for the rest of the storage.
+ */
+static void
+unshare_bitarray(struct bitarray *ba)
+{
+    void *buffer = new_storage(ba->array_size);
+    uint64_t *array = storage_array(buffer);
+    word_op(WORD_COPY, array, ba->array, NULL, ba->array_size, ba, NULL);
+
+    release_storage(ba->buffer);
+    ba->buffer = buffer;
+    ba->array = array;
+    ba->capacity = storage_words(buffer);
+}
+
+
+/* Allocate storage for a bitarray of the given number of bits, and set the
+ * size fields. If zero is non-zero the storage is cleared, otherwise its
+ * contents are undefined.
+ */
+static void
+allocate_bitarray(struct bitarray *ba, long bits, int zero)
+{
+    ba->bits = bits;
+    ba->array_size = word_array_size(bits);
+    if (ba->array_size <= INLINE_WORDS) {
+        use_inline_words(ba);
+    } else {
+        ba->buffer = new_storage(ba->array_size);
+        ba->array = storage_array(ba->buffer);
+        ba->capacity = storage_words(ba->buffer);
+    }
+    if (zero) {
+        memset(ba->array, 0x00, ba->array_size * WORD_BYTES);
+    }
+}
+
+
+/* Make sure a bitarray has room for at least the given number of words. When
+ * it doesn't, the storage is at least doubled, so that growing a bitarray a
+ * bit at a time takes amortized constant time per bit. The bitarray must not
+ * be sharing its storage. The storage is moved with ruby_xrealloc, which may
+ * change its alignment; if it does, the words are moved back into place. A
+ * view that's been left with its storage to itself gets new storage instead,
+ * since its words may be anywhere in the old one, and so does a bitarray that
+ * outgrows its inline words.
+ */
+static void
+reserve_bitarray(struct bitarray *ba, long words)
+{
+    if (words <= ba->capacity) {
+        return;
+    }
+    long max = (long)((LONG_MAX - STORAGE_EXTRA) / WORD_BYTES);
+    if (words > max) {
+        rb_raise(rb_eArgError, "BitArray size too big");
+    }
+
+    long capacity = ba->capacity > max / 2 ? max : ba->capacity * 2;
+    if (capacity < words) {
+        capacity = words;
+    }
+
+    if (!ba->buffer && capacity <= INLINE_WORDS) {
+        use_inline_words(ba);
+        return;
+    }
+    if (!ba->buffer || ba->array != storage_array(ba->buffer)) {
+        void *buffer = new_storage(capacity);
+        if (ba->array_size > 0) {
+            memcpy(storage_array(buffer), ba->array,
+                    ba->array_size * WORD_BYTES);
+        }
+        if (ba->buffer) {
+            release_storage(ba->buffer);
+        }
+        ba->buffer = buffer;
+        ba->array = storage_array(buffer);
+        ba->capacity = storage_words(buffer);
+        return;
+    }
+
+    size_t offset = (char *)ba->array - (char *)ba->buffer;
+    char *buffer = ruby_xrealloc(ba->buffer,
+            capacity * WORD_BYTES + STORAGE_EXTRA);
+    uint64_t *array = storage_array(buffer);
+    if ((char *)array != buffer + offset) {
+        memmove(array, buffer + offset, ba->array_size * WORD_BYTES);
+    }
+    storage_words(buffer) = capacity;
+
+    ba->buffer = buffer;
+    ba->array = array;
+    ba->capacity = capacity;
+}
+
+
+/* Change the number of bits in a bitarray. New bits are cleared. Shrinking a
+ * bitarray keeps its storage, so that it can grow again without reallocating.
+ */
+static void
+resize_bitarray(struct bitarray *ba, long bits)
+{
+    if (bits < 0) {
+        rb_raise(rb_eArgError, "negative BitArray size");
+    }
+    bitarray_changed(ba);
+    if (ba->mapped) {
+        rb_raise(rb_eTypeError, "can't resize a mapped BitArray");
+    }
+
+    long words = word_array_size(bits);
+    if (words > ba->array_size) {
+        reserve_bitarray(ba, words);
+        memset(ba->array + ba->array_size, 0x00,
+                (words - ba->array_size) * WORD_BYTES);
+    }
+
+    ba->bits = bits;
+    ba->array_size = words;
+    clear_unused_bits(ba);
+}
+
+
+/* Give up a bitarray's storage and anything worked out from it, leaving it
+ * empty. The bitarray must not be mapped.
+ */
+static void
+empty_bitarray(struct bitarray *ba)
+{
+    if (ba->buffer) {
+        release_storage(ba->buffer);
+    }
+    if (ba->rank_index) {
+        free_rank_index(ba->rank_index);
+        ba->rank_index = NULL;
+    }
+    ba->bits = 0;
+    ba->array_size = 0;
+    ba->hashed = 0;
+    use_inline_words(ba);
+}
+
+
+/* Add a bit to the end of a bitarray. */
+static inline void
+push_bit(struct bitarray *ba, int value)
+{
+    if (value != 0 && value != 1) {
+        rb_raise(rb_eArgError, "bit value %d out of range", value);
+    }
+
+    resize_bitarray(ba, ba->bits + 1);
+    if (value) {
+        ba->array[(ba->bits - 1) / WORD_BITS] |= bitmask(ba->bits - 1);
+    }
+}
+
+
+/* Initialize an already-allocated bitarray structure. The array is initialized
+ * to all zeros.
+ */
+static inline void
+initialize_bitarray(struct bitarray *ba, long size)
+{
+    allocate_bitarray(ba, (size <= 0 ? 0 : size), 1);
+}
+
+
+/* Initialize an already-allocated bitarray structure as a copy of another
+ * bitarray structure.
+ */
+static inline void
+initialize_bitarray_copy(struct bitarray *new_ba, struct bitarray *orig_ba)
+{
+    /* A bitarray that's locked may be being changed without the GVL, so we
+     * take a snapshot of it instead of sharing its storage.
+     */
+    if (orig_ba->buffer && !orig_ba->locks) {
+        share_storage(new_ba, orig_ba, 0, orig_ba->bits);
+        return;
+    }
+    allocate_bitarray(new_ba, orig_ba->bits, 0);
+    word_op(WORD_COPY, new_ba->array, orig_ba->array, NULL,
+            new_ba->array_size, orig_ba, NULL);
+}
+
+
+/* Initialize an already-allocated bitarray structure as the concatenation of
+ * two other bitarray structures.
+ */
+static void
+initialize_bitarray_concat(struct bitarray *new_ba, struct bitarray *x_ba,
+        struct bitarray *y_ba)
+{
+    allocate_bitarray(new_ba, x_ba->bits + y_ba->bits, 0);
+
+    /* Copy x_ba->array to the beginning of new_ba->array, and then copy the
+     * bits of y_ba->array in right after the last bit of x_ba. The unused bits
+     * of x_ba's last word are zero, so they'll be overwritten or stay clear.
+     * y_ba is locked during the first copy too, so that its size can't change
+     * before the second.
+     */
+    word_op(WORD_COPY, new_ba->array, x_ba->array, NULL, x_ba->array_size,
+            x_ba, y_ba);
+    copy_bits_op(new_ba->array, x_ba->bits, y_ba->array, 0, y_ba->bits, y_ba);
+    clear_unused_bits(new_ba);
+}
+
+
+/* Initialize an already-allocated bitarray structure as a copy of len bits
+ * from another bitarray structure, starting at beg. The range must already
+ * have been checked.
+ */
+static void
+initialize_bitarray_subseq(struct bitarray *new_ba, struct bitarray *x_ba,
+        long beg, long len)
+{
+    allocate_bitarray(new_ba, len, 0);
+    copy_bits_op(new_ba->array, 0, x_ba->array, beg, len, x_ba);
+    clear_unused_bits(new_ba);
+}
+
+
+/* Initialize an already-allocated bitarray structure as the intersection of
+ * two other bitarray structures. The new bitarray will be the same length as
+ * the smaller of the two original bitarrays.
+ */
+static void
+initialize_bitarray_intersect(struct bitarray *new_ba, struct bitarray *x_ba,
+        struct bitarray *y_ba)
+{
+    struct bitarray *shorter = ((x_ba->bits < y_ba->bits) ? x_ba : y_ba);
+
+    allocate_bitarray(new_ba, shorter->bits, 0);
+    word_op(WORD_AND, new_ba->array, x_ba->array, y_ba->array,
+            new_ba->array_size, x_ba, y_ba);
+}
+
+
+/* Initialize an already-allocated bitarray structure as x_ba shifted by n
+ * bits: bit i of the new bitarray is bit i + n of x_ba, or 0 if x_ba has no
+ * such bit. A negative n shifts the other way.
+ */
+static void
+initialize_bitarray_shift(struct bitarray *new_ba, struct bitarray *x_ba,
+        long n)
+{
+    long bits = x_ba->bits;
+    allocate_bitarray(new_ba, bits, 0);
+
+    if (n >= bits || n <= -bits) {
+        range_op(new_ba, WORD_ZERO, 0, bits);
+    } else if (n >= 0) {
+        copy_bits_op(new_ba->array, 0, x_ba->array, n, bits - n, x_ba);
+        range_op(new_ba, WORD_ZERO, bits - n, n);
+    } else {
+        copy_bits_op(new_ba->array, -n, x_ba->array, 0, bits + n, x_ba);
+        range_op(new_ba, WORD_ZERO, 0, -n);
+    }
+    clear_unused_bits(new_ba);
+}
+
+
+/* Initialize an already-allocated bitarray structure as x_ba rotated by n
+ * bits: bit i of the new bitarray is bit (i + n) mod size of x_ba.
+ */
+static void
+initialize_bitarray_rotate(struct bitarray *new_ba, struct bitarray *x_ba,
+        long n)
+{
+    long bits = x_ba->bits;
+    allocate_bitarray(new_ba, bits, 0);
+    if (bits == 0) {
+        return;
+    }
+
+    n %= bits;
+    if (n < 0) {
+        n += bits;
+    }
+    copy_bits_op(new_ba->array, 0, x_ba->array, n, bits - n, x_ba);
+    copy_bits_op(new_ba->array, bits - n, x_ba->array, 0, n, x_ba);
+    clear_unused_bits(new_ba);
+}
+
+
+/* Swap the storage of two bitarrays of the same size. Neither may be sharing
+ * its storage or be mapped. Inline words are swapped along with the pointers,
+ * since a bitarray can only use its own.
+ */
+static void
+swap_storage(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    int x_inline = (x_ba->array == x_ba->inline_words);
+    int y_inline = (y_ba->array == y_ba->inline_words);
+    if (x_inline || y_inline) {
+        uint64_t words[INLINE_WORDS];
+        memcpy(words, x_ba->inline_words, sizeof(words));
+        memcpy(x_ba->inline_words, y_ba->inline_words, sizeof(words));
+        memcpy(y_ba->inline_words, words, sizeof(words));
+    }
+
+    uint64_t *array = x_ba->array;
+    void *buffer = x_ba->buffer;
+    long capacity = x_ba->capacity;
+    x_ba->array = (y_inline ? x_ba->inline_words : y_ba->array);
+    x_ba->buffer = y_ba->buffer;
+    x_ba->capacity = y_ba->capacity;
+    y_ba->array = (x_inline ? y_ba->inline_words : array);
+    y_ba->buffer = buffer;
+    y_ba->capacity = capacity;
+    x_ba->hashed = 0;
+    y_ba->hashed = 0;
+}
+
+
+/* Initialize an already-allocated bitarray structure as x_ba with its bits in
+ * reverse order.
+ */
+static void
+initialize_bitarray_reverse(struct bitarray *new_ba, struct bitarray *x_ba)
+{
+    allocate_bitarray(new_ba, x_ba->bits, 0);
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = WORD_REVERSE;
+    job.dst = new_ba->array;
+    job.x = x_ba->array;
+    job.words = new_ba->array_size;
+    job.bits = new_ba->bits;
+    if (job.words > 0) {
+        run_job(&job, x_ba, NULL);
+    }
+}
+
+
+/* Replace the bits of ba with those of new_ba, a temporary bitarray of the
+ * same size, which is freed. This is how the in-place versions of shift,
+ * rotate and reverse work: they build the result in new storage, and then
+ * swap it in. bitarray_changed(ba) must already have been called.
+ */
+static void
+replace_bitarray(struct bitarray *ba, struct bitarray *new_ba)
+{
+    if (ba->mapped) {
+        word_op(WORD_COPY, ba->array, new_ba->array, NULL, ba->array_size,
+                ba, NULL);
+    } else {
+        swap_storage(ba, new_ba);
+    }
+    if (new_ba->buffer) {
+        release_storage(new_ba->buffer);
+    }
+}
+
+
+/* In-place bitwise operations.
+ *
+ * These combine y_ba into x_ba a word at a time, without allocating anything.
+ * x_ba keeps its size: if y_ba is shorter it is treated as though it were
+ * padded with zeros, and if it is longer the extra bits are ignored.
+ */
+
+
+/* Return the number of words that x_ba and y_ba have in common. Call this
+ * after bitarray_changed(x_ba), which can let other threads run.
+ */
+static inline long
+common_words(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    return (x_ba->array_size < y_ba->array_size ?
+            x_ba->array_size : y_ba->array_size);
+}
+
+
+/* x_ba = x_ba & y_ba */
+static void
+bitarray_and(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    bitarray_changed(x_ba);
+    long n = common_words(x_ba, y_ba);
+    word_op(WORD_AND, x_ba->array, x_ba->array, y_ba->array, n, x_ba, y_ba);
+    word_op(WORD_ZERO, x_ba->array + n, NULL, NULL, x_ba->array_size - n,
+            x_ba, NULL);
+}
+
+
+/* x_ba = x_ba | y_ba */
+static void
+bitarray_or(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    bitarray_changed(x_ba);
+    long n = common_words(x_ba, y_ba);
+    word_op(WORD_OR, x_ba->array, x_ba->array, y_ba->array, n, x_ba, y_ba);
+    clear_unused_bits(x_ba);
+}
+
+
+/* x_ba = x_ba ^ y_ba */
+static void
+bitarray_xor(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    bitarray_changed(x_ba);
+    long n = common_words(x_ba, y_ba);
+    word_op(WORD_XOR, x_ba->array, x_ba->array, y_ba->array, n, x_ba, y_ba);
+    clear_unused_bits(x_ba);
+}
+
+
+/* x_ba = x_ba & ~y_ba */
+static void
+bitarray_andnot(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    bitarray_changed(x_ba);
+    long n = common_words(x_ba, y_ba);
+    word_op(WORD_ANDNOT, x_ba->array, x_ba->array, y_ba->array, n, x_ba, y_ba);
+}
+
+
+/* Counting and testing the result of a bitwise operation, without building
+ * it. Sizes work as they do for the operators: bits past the end of the
+ * shorter bitarray count as zeros.
+ */
+
+
+/* Run WORD_COUNT_OF or WORD_ANY_OF over the words x_ba and y_ba have in
+ * common.
+ */
+static long
+common_op(enum word_op_type op, enum word_op_type combine,
+        struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    long n = common_words(x_ba, y_ba);
+    if (n == 0) {
+        return 0;
+    }
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = op;
+    job.combine = combine;
+    job.x = x_ba->array;
+    job.y = y_ba->array;
+    job.words = n;
+    run_job(&job, x_ba, y_ba);
+    return job.count;
+}
+
+
+/* Return the number of set bits in the words of ba after the first n. */
+static inline long
+total_set_after(struct bitarray *ba, long n)
+{
+    return word_op(WORD_COUNT, NULL, ba->array + n, NULL, ba->array_size - n,
+            ba, NULL);
+}
+
+
+/* Return popcount(x_ba <combine> y_ba), where combine is WORD_AND, WORD_OR or
+ * WORD_XOR.
+ */
+static long
+count_combined(enum word_op_type combine, struct bitarray *x_ba,
+        struct bitarray *y_ba)
+{
+    long count = common_op(WORD_COUNT_OF, combine, x_ba, y_ba);
+    if (combine != WORD_AND) {
+        long n = common_words(x_ba, y_ba);
+        count += total_set_after(x_ba, n) + total_set_after(y_ba, n);
+    }
+    return count;
+}
+
+
+/* Return popcount(x_ba & y_ba), and set *either to popcount(x_ba | y_ba).
+ * Each word of both bitarrays is only read once.
+ */
+static long
+count_and_or(struct bitarray *x_ba, struct bitarray *y_ba, long *either)
+{
+    long n = common_words(x_ba, y_ba);
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = WORD_COUNT_AND_OR;
+    job.x = x_ba->array;
+    job.y = y_ba->array;
+    job.words = n;
+    if (n > 0) {
+        run_job(&job, x_ba, y_ba);
+    }
+    *either = job.count2 + total_set_after(x_ba, n) + total_set_after(y_ba, n);
+    return job.count;
+}
+
+
+/* Return non-zero if x_ba and y_ba have any set bits in common. */
+static int
+bitarray_intersects(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    return common_op(WORD_ANY_OF, WORD_AND, x_ba, y_ba) != 0;
+}
+
+
+/* Return non-zero if every bit set in x_ba is also set in y_ba. */
+static int
+bitarray_subset(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    if (common_op(WORD_ANY_OF, WORD_ANDNOT, x_ba, y_ba) != 0) {
+        return 0;
+    }
+    return next_set_bit(x_ba, common_words(x_ba, y_ba) * WORD_BITS) < 0;
+}
+
+
+/* Initialize an already-allocated bitarray structure as the union of two other
+ * bitarray structures. The new bitarray will be the same length as the larger
+ * of the two original bitarrays.
+ */
+static void
+initialize_bitarray_union(struct bitarray *new_ba, struct bitarray *x_ba,
+        struct bitarray *y_ba)
+{
+    struct bitarray *longer = ((x_ba->bits > y_ba->bits) ? x_ba : y_ba);
+    struct bitarray *shorter = ((longer == x_ba) ? y_ba : x_ba);
+    initialize_bitarray_copy(new_ba, longer);
+    bitarray_or(new_ba, shorter);
+}
+
+
+/* Initialize an already-allocated bitarray structure as the exclusive or of
+ * two other bitarray structures. Like the union, the new bitarray will be the
+ * same length as the larger of the two original bitarrays.
+ */
+static void
+initialize_bitarray_xor(struct bitarray *new_ba, struct bitarray *x_ba,
+        struct bitarray *y_ba)
+{
+    struct bitarray *longer = ((x_ba->bits > y_ba->bits) ? x_ba : y_ba);
+    struct bitarray *shorter = ((longer == x_ba) ? y_ba : x_ba);
+    initialize_bitarray_copy(new_ba, longer);
+    bitarray_xor(new_ba, shorter);
+}
+
+
+/* Initialize an already-allocated bitarray structure by combining a list of
+ * n bitarrays with WORD_AND_ALL, WORD_OR_ALL or WORD_THRESHOLD, in a single
+ * pass. The intersection is as long as the shortest bitarray; the others are
+ * as long as the longest. threshold must be at least 1.
+ */
+static void
+initialize_bitarray_multi(struct bitarray *new_ba, enum word_op_type op,
+        struct bitarray **list, long n, long threshold)
+{
+    long i, bits = list[0]->bits;
+    for (i = 1; i < n; i++) {
+        if (op == WORD_AND_ALL ? list[i]->bits < bits : list[i]->bits > bits) {
+            bits = list[i]->bits;
+        }
+    }
+    /* No bit can be set in more than n inputs. */
+    allocate_bitarray(new_ba, bits, op == WORD_THRESHOLD && threshold > n);
+    if (new_ba->array_size == 0 || (op == WORD_THRESHOLD && threshold > n)) {
+        return;
+    }
+
+    const uint64_t **inputs = ruby_xmalloc2(n, sizeof(uint64_t *));
+    long *input_words = ruby_xmalloc2(n, sizeof(long));
+    for (i = 0; i < n; i++) {
+        inputs[i] = list[i]->array;
+        input_words[i] = list[i]->array_size;
+    }
+
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = op;
+    job.dst = new_ba->array;
+    job.words = new_ba->array_size;
+    job.inputs = inputs;
+    job.input_words = input_words;
+    job.inputs_size = n;
+    job.threshold = threshold;
+    run_job_locking(&job, list, n);
+
+    ruby_xfree(inputs);
+    ruby_xfree(input_words);
+}
+
+
+
+/* Byte serialization.
+ *
+ * Bits are converted to and from bytes in little-endian order: bit i is bit
+ * (i % 8) of byte (i / 8). That happens to be exactly how the storage array
+ * is laid out in memory on a little-endian machine, so there this is just a
+ * memcpy.
+ */
+
+
+/* Return the number of bytes needed to hold a bitarray's bits. */
+#define bitarray_bytes(ba) ((ba)->bits <= 0 ? 0 : ((ba)->bits - 1) / CHAR_BIT + 1)
+
+
+/* Copy the bits of a bitarray into a buffer of bitarray_bytes(ba) bytes. */
+static void
+bitarray_to_bytes(struct bitarray *ba, unsigned char *dst)
+{
+    long n = bitarray_bytes(ba);
+#ifdef WORDS_BIGENDIAN
+    long i;
+    for (i = 0; i < n; i++) {
+        dst[i] = (unsigned char)(ba->array[i / WORD_BYTES] >>
+                ((i % WORD_BYTES) * CHAR_BIT));
+    }
+#else
+    memcpy(dst, ba->array, n);
+#endif
+}
+
+
+/* Initialize an already-allocated bitarray structure with the given number
+ * of bits, copied from a buffer of bytes. The buffer must hold at least that
+ * many bits.
+ */
+static void
+initialize_bitarray_bytes(struct bitarray *ba, const unsigned char *src,
+        long bits)
+{
+    allocate_bitarray(ba, bits, 1);
+
+    long n = bitarray_bytes(ba);
+#ifdef WORDS_BIGENDIAN
+    long i;
+    for (i = 0; i < n; i++) {
+        ba->array[i / WORD_BYTES] |=
+            (uint64_t)src[i] << ((i % WORD_BYTES) * CHAR_BIT);
+    }
+#else
+    memcpy(ba->array, src, n);
+#endif
+    clear_unused_bits(ba);
+}
+
+
+/* Converting to and from text, and Ruby Arrays. */
+
+
+/* Get or set byte i of a bitarray's storage, in the order described under
+ * "Byte serialization". set_byte assumes the byte is currently zero.
+ */
+static inline unsigned char
+get_byte(struct bitarray *ba, long i)
+{
+    return (unsigned char)(ba->array[i / WORD_BYTES] >>
+            ((i % WORD_BYTES) * CHAR_BIT));
+}
+
+static inline void
+set_byte(struct bitarray *ba, long i, unsigned char byte)
+{
+    ba->array[i / WORD_BYTES] |=
+        (uint64_t)byte << ((i % WORD_BYTES) * CHAR_BIT);
+}
+
+
+/* The characters for each possible byte of storage, lowest bit first. This is
+ * filled in by init_bit_chars.
+ */
+static char bit_chars[256][CHAR_BIT];
+
+
+/* Write the bits of a bitarray as ones and zeroes into a buffer of at least
+ * ba->bits characters. No terminating null is written.
+ */
+static void
+bitarray_to_chars(struct bitarray *ba, char *dst)
+{
+    long full_bytes = ba->bits / CHAR_BIT;
+    long i;
+    for (i = 0; i < full_bytes; i++) {
+        memcpy(dst + i * CHAR_BIT, bit_chars[get_byte(ba, i)], CHAR_BIT);
+    }
+    for (i = full_bytes * CHAR_BIT; i < ba->bits; i++) {
+        dst[i] = ((ba->array[i / WORD_BITS] & bitmask(i)) ? '1' : '0');
+    }
+}
+
+
+/* Append the bits of a bitarray to a Ruby Array, as the Integers 0 and 1. */
+static void
+bitarray_to_values(struct bitarray *ba, VALUE array)
+{
+    /* The values for each word are put together on the stack and then
+     * appended all at once.
+     */
+    VALUE values[WORD_BITS];
+    long i, bit;
+    for (i = 0; i < ba->array_size; i++) {
+        uint64_t word = ba->array[i];
+        long bits = ba->bits - i * WORD_BITS;
+        if (bits > (long)WORD_BITS) {
+            bits = WORD_BITS;
+        }
+        for (bit = 0; bit < bits; bit++, word >>= 1) {
+            values[bit] = INT2FIX(word & 1);
+        }
+        rb_ary_cat(array, values, bits);
+    }
+}
+
+
+/* Initialize an already-allocated bitarray structure from a buffer of Ruby
+ * values. 0, false and nil become 0, and anything else becomes 1.
+ */
+static void
+initialize_bitarray_values(struct bitarray *ba, const VALUE *values, long len)
+{
+    allocate_bitarray(ba, len, 0);
+
+    long i, bit;
+    for (i = 0; i < ba->array_size; i++) {
+        const VALUE *v = values + i * WORD_BITS;
+        long bits = len - i * WORD_BITS;
+        if (bits > (long)WORD_BITS) {
+            bits = WORD_BITS;
+        }
+
+        uint64_t word = 0;
+        for (bit = 0; bit < bits; bit++) {
+            if (RTEST(v[bit]) && v[bit] != INT2FIX(0)) {
+                word |= bitmask(bit);
+            }
+        }
+        ba->array[i] = word;
+    }
+}
+
+
+/* Strings of ones and zeroes are read in two passes: scan_chars finds out
+ * how long the valid part of the string is, and pack_chars packs it into a
+ * zeroed word array. Both have vector versions, which init_bit_chars picks
+ * between when the extension is loaded.
+ *
+ * The portable versions work eight characters at a time. A character is
+ * valid if all but its lowest bit match '0', and multiplying by
+ * 0x0102040810204080 gathers the lowest bit of each byte into the top byte of
+ * the word, in order.
+ */
+static long
+scan_chars_swar(const char *src, long len)
+{
+    long i = 0;
+#ifndef WORDS_BIGENDIAN
+    uint64_t x;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&x, src + i, 8);
+        if ((x & 0xfefefefefefefefeULL) != 0x3030303030303030ULL) {
+            break;
+        }
+    }
+#endif
+    while (i < len && (src[i] == '0' || src[i] == '1')) {
+        i++;
+    }
+    return i;
+}
+
+static void
+pack_chars_swar(uint64_t *dst, const char *src, long len)
+{
+    long i = 0;
+#ifndef WORDS_BIGENDIAN
+    uint64_t x;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&x, src + i, 8);
+        x = ((x & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+        dst[i / WORD_BITS] |= x << (i % WORD_BITS);
+    }
+#endif
+    for (; i < len; i++) {
+        if (src[i] == '1') {
+            dst[i / WORD_BITS] |= bitmask(i);
+        }
+    }
+}
+
+
+#ifdef HAVE_CPU_DISPATCH
+
+/* AVX2 versions, 32 characters at a time. A compare against '1' followed by
+ * a movemask gives us 32 bits in the right order.
+ */
+__attribute__((target("avx2,bmi")))
+static long
+scan_chars_avx2(const char *src, long len)
+{
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i one = _mm256_set1_epi8('1');
+    long i;
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        uint32_t valid = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, zero), _mm256_cmpeq_epi8(v, one)));
+        if (valid != 0xffffffff) {
+            return i + __builtin_ctz(~valid);
+        }
+    }
+    return i + scan_chars_swar(src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+pack_chars_avx2(uint64_t *dst, const char *src, long len)
+{
+    const __m256i one = _mm256_set1_epi8('1');
+    long i;
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        uint32_t lo_bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, one));
+        uint32_t hi_bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, one));
+        dst[i / WORD_BITS] = lo_bits | ((uint64_t)hi_bits << 32);
+    }
+    pack_chars_swar(dst + i / WORD_BITS, src + i, len - i);
+}
+
+
+/* AVX-512 versions, 64 characters at a time. The compares produce a 64-bit
+ * mask directly.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static long
+scan_chars_avx512(const char *src, long len)
+{
+    const __m512i zero = _mm512_set1_epi8('0');
+    const __m512i one = _mm512_set1_epi8('1');
+    long i;
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        uint64_t valid = _mm512_cmpeq_epi8_mask(v, zero) |
+            _mm512_cmpeq_epi8_mask(v, one);
+        if (valid != WORD_MAX) {
+            return i + ctz_word(~valid);
+        }
+    }
+    return i + scan_chars_swar(src + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void
+pack_chars_avx512(uint64_t *dst, const char *src, long len)
+{
+    const __m512i one = _mm512_set1_epi8('1');
+    long i;
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        dst[i / WORD_BITS] = _mm512_cmpeq_epi8_mask(v, one);
+    }
+    pack_chars_swar(dst + i / WORD_BITS, src + i, len - i);
+}
+
+#endif /* HAVE_CPU_DISPATCH */
+
+
+static long (*scan_chars)(const char *, long) = scan_chars_swar;
+static void (*pack_chars)(uint64_t *, const char *, long) = pack_chars_swar;
+
+
+/* Fill in the bit_chars table, and pick the string-packing functions. Called
+ * from Init_bitarray.
+ */
+static void
+init_bit_chars(void)
+{
+    int byte, bit;
+    for (byte = 0; byte < 256; byte++) {
+        for (bit = 0; bit < CHAR_BIT; bit++) {
+            bit_chars[byte][bit] = ((byte >> bit) & 1) + '0';
+        }
+    }
+
+#if defined(HAVE_CPU_DISPATCH) && !defined(WORDS_BIGENDIAN)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan_chars = scan_chars_avx512;
+        pack_chars = pack_chars_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_chars = scan_chars_avx2;
+        pack_chars = pack_chars_avx2;
+    }
+#endif
+}
+
+
+/* Initialize an already-allocated bitarray structure from the ones and
+ * zeroes at the start of a buffer of len characters. Everything from the
+ * first character that isn't '0' or '1' onwards is ignored.
+ */
+static void
+initialize_bitarray_chars(struct bitarray *ba, const char *src, long len)
+{
+    allocate_bitarray(ba, scan_chars(src, len), 1);
+    pack_chars(ba->array, src, ba->bits);
+}
+
+
+/* Hexadecimal. Each byte of storage becomes two hex digits, high digit first,
+ * so the result is the same as unpacking the output of to_bytes with "H*".
+ */
+static const char hex_digits[] = "0123456789abcdef";
+
+
+/* Return the value of a hex digit, or -1 if c isn't one. */
+static inline int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+/* Write a bitarray as 2 * bitarray_bytes(ba) hex digits. */
+static void
+bitarray_to_hex(struct bitarray *ba, char *dst)
+{
+    long n = bitarray_bytes(ba);
+    long i;
+    for (i = 0; i < n; i++) {
+        unsigned char byte = get_byte(ba, i);
+        dst[2 * i] = hex_digits[byte >> 4];
+        dst[2 * i + 1] = hex_digits[byte & 0x0f];
+    }
+}
+
+
+/* Initialize an already-allocated bitarray structure with the given number
+ * of bits, read from a buffer of len hex digits. len must be even, and the
+ * digits must hold at least that many bits. Raises an ArgumentError if
+ * there's an invalid digit.
+ */
+static void
+initialize_bitarray_hex(struct bitarray *ba, const char *src, long len,
+        long bits)
+{
+    allocate_bitarray(ba, bits, 1);
+
+    long n = bitarray_bytes(ba);
+    long i;
+    for (i = 0; i < len / 2; i++) {
+        int hi = hex_value(src[2 * i]);
+        int lo = hex_value(src[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            rb_raise(rb_eArgError, "invalid hex string");
+        }
+        if (i < n) {
+            set_byte(ba, i, (unsigned char)((hi << 4) | lo));
+        }
+    }
+    clear_unused_bits(ba);
+}
+
+
+/* Base64, in the strict form used by "m0" packing: the standard alphabet,
+ * padded with '=', and no line breaks. The encoded bytes are the ones
+ * produced by to_bytes.
+ */
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+/* Return the value of a base64 digit, or -1 if c isn't one. */
+static inline int
+base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+
+/* Return the number of characters needed to base64-encode n bytes. */
+#define base64_size(n) (((n) + 2) / 3 * 4)
+
+
+/* Write a bitarray as base64_size(bitarray_bytes(ba)) base64 characters. */
+static void
+bitarray_to_base64(struct bitarray *ba, char *dst)
+{
+    long n = bitarray_bytes(ba);
+    long i;
+    for (i = 0; i < n; i += 3) {
+        uint32_t group = (uint32_t)get_byte(ba, i) << 16;
+        if (i + 1 < n) group |= (uint32_t)get_byte(ba, i + 1) << 8;
+        if (i + 2 < n) group |= get_byte(ba, i + 2);
+
+        *dst++ = base64_digits[(group >> 18) & 0x3f];
+        *dst++ = base64_digits[(group >> 12) & 0x3f];
+        *dst++ = (i + 1 < n ? base64_digits[(group >> 6) & 0x3f] : '=');
+        *dst++ = (i + 2 < n ? base64_digits[group & 0x3f] : '=');
+    }
+}
+
+
+/* Return the number of bytes encoded by a buffer of len base64 characters,
+ * or -1 if it isn't the right length for strict base64.
+ */
+static long
+base64_decoded_size(const char *src, long len)
+{
+    if (len % 4 != 0) {
+        return -1;
+    }
+    long n = len / 4 * 3;
+    if (len > 0 && src[len - 1] == '=') n--;
+    if (len > 1 && src[len - 2] == '=') n--;
+    return n;
+}
+
+
+/* Initialize an already-allocated bitarray structure with the given number
+ * of bits, read from a buffer of len base64 characters. The buffer must be
+ * the right length (see base64_decoded_size), and must hold at least that
+ * many bits. Raises an ArgumentError if there's an invalid character.
+ */
+static void
+initialize_bitarray_base64(struct bitarray *ba, const char *src, long len,
+        long bits)
+{
+    allocate_bitarray(ba, bits, 1);
+
+    long decoded = base64_decoded_size(src, len);
+    long n = bitarray_bytes(ba);
+    long i, j, out = 0;
+    for (i = 0; i < len; i += 4) {
+        uint32_t group = 0;
+        for (j = 0; j < 4; j++) {
+            int v = base64_value(src[i + j]);
+            if (v < 0) {
+                /* Padding is only allowed where base64_decoded_size found
+                 * it.
+                 */
+                if (src[i + j] != '=' || out + j - 1 < decoded) {
+                    rb_raise(rb_eArgError, "invalid base64 string");
+                }
+                v = 0;
+            }
+            group = (group << 6) | v;
+        }
+        for (j = 0; j < 3 && out < decoded; j++, out++) {
+            if (out < n) {
+                set_byte(ba, out, (unsigned char)(group >> (16 - 8 * j)));
+            }
+        }
+    }
+    clear_unused_bits(ba);
+}
+
+
+/* Memory-mapped files. */
+
+
+/* Initialize an already-allocated bitarray structure to use a mapping of a
+ * file of the given size as its storage. The file's layout is the one
+ * described under "Byte serialization", so this only works on little-endian
+ * machines.
+ */
+static void
+initialize_bitarray_mapped(struct bitarray *ba, void *mapping, size_t bytes,
+        int writable)
+{
+    /* The last word may run past the end of the file, but not past the end
+     * of the last page, which the system fills with zeros. So the unused bits
+     * are clear, as they should be.
+     */
+    ba->bits = bytes * CHAR_BIT;
+    ba->array_size = word_array_size(ba->bits);
+    ba->array = mapping;
+    ba->buffer = NULL;
+    ba->mapped = bytes;
+    ba->read_only = !writable;
+}
+
+
+/* Write any changes to a mapped bitarray back to its file. */
+static void
+sync_bitarray(struct bitarray *ba)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (ba->mapped && !ba->read_only) {
+        if (msync(ba->array, ba->mapped, MS_SYNC) < 0) {
+            rb_sys_fail("msync");
+        }
+    }
+#endif
+}
+
+
+/* EWAH compression.
+ *
+ * EWAH (Enhanced Word-Aligned Hybrid) compresses a bitarray's words by
+ * replacing runs of "clean" words, all zeros or all ones, with a count. The
+ * compressed stream is a series of marker words, each followed by some
+ * literal words that are copied as they are. A marker holds:
+ *
+ * - bit 0: the value of the clean words in its run;
+ * - bits 1-32: the number of clean words in the run;
+ * - bits 33-63: the number of literal words that follow the marker.
+ *
+ * The run comes before the literals. A serialized stream is the number of
+ * bits as a little-endian 64-bit number, followed by the stream words, also
+ * little-endian.
+ *
+ * Streams can be combined and counted directly, a run or a block of literals
+ * at a time, without expanding them into a bitarray. Streams we write never
+ * store a clean word as a literal, and never set the unused bits of the last
+ * word, so that counting them is just a matter of adding up runs of ones and
+ * the popcounts of the literals.
+ */
+#define EWAH_HEADER_BYTES 8
+#define EWAH_RUN_MAX ((uint64_t)0xffffffff)
+#define EWAH_LITERALS_MAX ((uint64_t)0x7fffffff)
+#define ewah_run_bit(marker) ((int)((marker) & 1))
+#define ewah_run_length(marker) ((long)(((marker) >> 1) & EWAH_RUN_MAX))
+#define ewah_literals(marker) ((long)((marker) >> 33))
+
+
+/* Load and store little-endian words. */
+static inline uint64_t
+load_le64(const unsigned char *p)
+{
+    uint64_t word;
+#ifdef WORDS_BIGENDIAN
+    int i;
+    for (word = 0, i = 0; i < 8; i++) {
+        word |= (uint64_t)p[i] << (i * CHAR_BIT);
+    }
+#else
+    memcpy(&word, p, 8);
+#endif
+    return word;
+}
+
+static inline void
+store_le64(unsigned char *p, uint64_t word)
+{
+#ifdef WORDS_BIGENDIAN
+    int i;
+    for (i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(word >> (i * CHAR_BIT));
+    }
+#else
+    memcpy(p, &word, 8);
+#endif
+}
+
+
+/* Writes an EWAH stream into a Ruby String. */
+struct ewah_writer {
+    VALUE str;
+    long bits;           /* Number of bits in the stream. */
+    long words;          /* Number of words written so far. */
+    long marker_pos;     /* Offset of the current marker, or -1. */
+    uint64_t marker;     /* The current marker. */
+};
+
+
+static void
+ewah_writer_init(struct ewah_writer *w, long bits)
+{
+    unsigned char header[EWAH_HEADER_BYTES];
+    store_le64(header, (uint64_t)bits);
+
+    w->str = rb_str_buf_new(EWAH_HEADER_BYTES + 64);
+    rb_str_cat(w->str, (const char *)header, EWAH_HEADER_BYTES);
+    w->bits = bits;
+    w->words = 0;
+    w->marker_pos = -1;
+    w->marker = 0;
+}
+
+
+/* Store the current marker, and start a new one. */
+static void
+ewah_new_marker(struct ewah_writer *w)
+{
+    unsigned char zero[8] = {0};
+    if (w->marker_pos >= 0) {
+        store_le64((unsigned char *)RSTRING_PTR(w->str) + w->marker_pos,
+                w->marker);
+    }
+    w->marker_pos = RSTRING_LEN(w->str);
+    w->marker = 0;
+    rb_str_cat(w->str, (const char *)zero, 8);
+}
+
+
+static void ewah_add_literal(struct ewah_writer *w, uint64_t word);
+
+
+/* Add n clean words with the given bit value. */
+static void
+ewah_add_run(struct ewah_writer *w, int bit, long n)
+{
+    /* A run of ones mustn't cover the unused bits of the last word. */
+    int tail = (bit && w->bits % WORD_BITS != 0 &&
+            w->words + n == (long)word_array_size(w->bits));
+    n -= tail;
+
+    while (n > 0) {
+        if (w->marker_pos < 0 || ewah_literals(w->marker) > 0 ||
+                (ewah_run_length(w->marker) > 0 &&
+                 ewah_run_bit(w->marker) != bit) ||
+                ewah_run_length(w->marker) == (long)EWAH_RUN_MAX) {
+            ewah_new_marker(w);
+            w->marker |= (uint64_t)bit;
+        }
+        long run = ewah_run_length(w->marker);
+        long k = (long)EWAH_RUN_MAX - run;
+        if (k > n) {
+            k = n;
+        }
+        w->marker = (w->marker & ~(EWAH_RUN_MAX << 1)) |
+            ((uint64_t)(run + k) << 1);
+        w->words += k;
+        n -= k;
+    }
+
+    if (tail) {
+        ewah_add_literal(w, ~(WORD_MAX << (w->bits % WORD_BITS)));
+    }
+}
+
+
+/* Add a word, which may turn out to be clean. */
+static void
+ewah_add_literal(struct ewah_writer *w, uint64_t word)
+{
+    if (word == 0 || word == WORD_MAX) {
+        ewah_add_run(w, word != 0, 1);
+        return;
+    }
+
+    if (w->marker_pos < 0 || ewah_literals(w->marker) == (long)EWAH_LITERALS_MAX) {
+        ewah_new_marker(w);
+    }
+    w->marker += (uint64_t)1 << 33;
+
+    unsigned char buf[8];
+    store_le64(buf, word);
+    rb_str_cat(w->str, (const char *)buf, 8);
+    w->words++;
+}
+
+
+/* Finish the stream, and return the String. */
+static VALUE
+ewah_writer_finish(struct ewah_writer *w)
+{
+    if (w->marker_pos >= 0) {
+        store_le64((unsigned char *)RSTRING_PTR(w->str) + w->marker_pos,
+                w->marker);
+    }
+    return w->str;
+}
+
+
+/* Reads an EWAH stream. */
+struct ewah_reader {
+    const unsigned char *p;   /* The next word to read. */
+    const unsigned char *end;
+    int run_bit;
+    long run;                 /* Clean words left in the current run. */
+    long literals;            /* Literal words left after the run. */
+};
+
+
+/* Check the header and structure of a serialized EWAH stream, and set up a
+ * reader for it. Returns the number of bits. Raises an ArgumentError if the
+ * stream is truncated, holds the wrong number of words, or sets unused bits.
+ */
+static long
+ewah_reader_init(struct ewah_reader *r, VALUE str)
+{
+    const unsigned char *p = (const unsigned char *)RSTRING_PTR(str);
+    const unsigned char *end = p + RSTRING_LEN(str);
+    if (RSTRING_LEN(str) < EWAH_HEADER_BYTES) {
+        rb_raise(rb_eArgError, "invalid EWAH string");
+    }
+
+    uint64_t bits = load_le64(p);
+    if (bits > (uint64_t)LONG_MAX) {
+        rb_raise(rb_eArgError, "invalid EWAH string");
+    }
+    p += EWAH_HEADER_BYTES;
+    r->p = p;
+    r->end = end;
+    r->run = r->literals = 0;
+    r->run_bit = 0;
+
+    /* The last word, so we can check its unused bits. */
+    uint64_t last = 0;
+    long words = 0;
+    while (p < end) {
+        if (end - p < 8) {
+            rb_raise(rb_eArgError, "invalid EWAH string");
+        }
+        uint64_t marker = load_le64(p);
+        long literals = ewah_literals(marker);
+        p += 8;
+        if ((end - p) / 8 < literals) {
+            rb_raise(rb_eArgError, "invalid EWAH string");
+        }
+        if (ewah_run_length(marker) > 0) {
+            last = (ewah_run_bit(marker) ? WORD_MAX : 0);
+        }
+        if (literals > 0) {
+            last = load_le64(p + (literals - 1) * 8);
+        }
+        words += ewah_run_length(marker) + literals;
+        p += literals * 8;
+    }
+
+    if (words != (long)word_array_size((long)bits) || (bits % WORD_BITS != 0 &&
+                (last & (WORD_MAX << (bits % WORD_BITS))) != 0)) {
+        rb_raise(rb_eArgError, "invalid EWAH string");
+    }
+    return (long)bits;
+}
+
+
+/* Make sure the reader has a run or literals to read, moving on to the next
+ * marker if necessary. Returns zero at the end of the stream.
+ */
+static inline int
+ewah_more(struct ewah_reader *r)
+{
+    while (r->run == 0 && r->literals == 0) {
+        if (r->p >= r->end) {
+            return 0;
+        }
+        uint64_t marker = load_le64(r->p);
+        r->p += 8;
+        r->run_bit = ewah_run_bit(marker);
+        r->run = ewah_run_length(marker);
+        r->literals = ewah_literals(marker);
+    }
+    return 1;
+}
+
+
+/* Copy n literal words from a reader to a writer. */
+static void
+ewah_copy_literals(struct ewah_writer *w, struct ewah_reader *r, long n)
+{
+    for (; n > 0; n--, r->p += 8, r->literals--) {
+        ewah_add_literal(w, load_le64(r->p));
+    }
+}
+
+
+/* Copy whatever is left of a stream to a writer. */
+static void
+ewah_copy_rest(struct ewah_writer *w, struct ewah_reader *r)
+{
+    while (ewah_more(r)) {
+        ewah_add_run(w, r->run_bit, r->run);
+        r->run = 0;
+        ewah_copy_literals(w, r, r->literals);
+    }
+}
+
+
+/* Combine two EWAH streams with WORD_AND or WORD_OR, a run or a block of
+ * literals at a time. A run of the value that decides the result (0 for and,
+ * 1 for or) becomes a run in the output, whatever the other stream holds;
+ * any other run just passes the other stream's words through.
+ */
+static void
+ewah_combine(enum word_op_type op, struct ewah_writer *w,
+        struct ewah_reader *x, struct ewah_reader *y)
+{
+    int decider = (op == WORD_OR);
+    long i, n;
+
+    while (ewah_more(x) && ewah_more(y)) {
+        if (x->run > 0 && y->run > 0) {
+            n = (x->run < y->run ? x->run : y->run);
+            ewah_add_run(w, (op == WORD_OR ? x->run_bit | y->run_bit :
+                        x->run_bit & y->run_bit), n);
+            x->run -= n;
+            y->run -= n;
+        } else if (x->run > 0 || y->run > 0) {
+            struct ewah_reader *run = (x->run > 0 ? x : y);
+            struct ewah_reader *lit = (run == x ? y : x);
+            n = (run->run < lit->literals ? run->run : lit->literals);
+            if (run->run_bit == decider) {
+                ewah_add_run(w, decider, n);
+                lit->p += n * 8;
+                lit->literals -= n;
+            } else {
+                ewah_copy_literals(w, lit, n);
+            }
+            run->run -= n;
+        } else {
+            n = (x->literals < y->literals ? x->literals : y->literals);
+            for (i = 0; i < n; i++, x->p += 8, y->p += 8) {
+                uint64_t a = load_le64(x->p), b = load_le64(y->p);
+                ewah_add_literal(w, (op == WORD_OR ? a | b : a & b));
+            }
+            x->literals -= n;
+            y->literals -= n;
+        }
+    }
+
+    /* The shorter stream has run out. For and, the output is as long as the
+     * shorter stream; for or, the rest of the longer one is copied.
+     */
+    if (op == WORD_OR) {
+        ewah_copy_rest(w, x);
+        ewah_copy_rest(w, y);
+    }
+}
+
+
+/* Count the set bits in an EWAH stream. */
+static long
+ewah_total_set(struct ewah_reader *r)
+{
+    long count = 0;
+    while (ewah_more(r)) {
+        if (r->run_bit) {
+            count += r->run * WORD_BITS;
+        }
+        count += popcount_bytes(r->p, r->literals * 8);
+        r->p += r->literals * 8;
+        r->run = r->literals = 0;
+    }
+    return count;
+}
+
+
+/* Compress a bitarray into a new EWAH string. */
+static VALUE
+bitarray_to_ewah(struct bitarray *ba)
+{
+    struct ewah_writer w;
+    long i;
+
+    ewah_writer_init(&w, ba->bits);
+    for (i = 0; i < ba->array_size; i++) {
+        ewah_add_literal(&w, ba->array[i]);
+    }
+    return ewah_writer_finish(&w);
+}
+
+
+/* Initialize an already-allocated bitarray structure from an EWAH stream. */
+static void
+initialize_bitarray_ewah(struct bitarray *ba, struct ewah_reader *r, long bits)
+{
+    uint64_t *dst;
+    long i;
+
+    allocate_bitarray(ba, bits, 0);
+    dst = ba->array;
+    while (ewah_more(r)) {
+        memset(dst, (r->run_bit ? 0xff : 0x00), r->run * WORD_BYTES);
+        dst += r->run;
+        for (i = 0; i < r->literals; i++, r->p += 8) {
+            *dst++ = load_le64(r->p);
+        }
+        r->run = r->literals = 0;
+    }
+}
+
+
+/* Compressed bitarrays.
+ *
+ * A compressed bitarray stores a sparse or clustered set of bits in much less
+ * space than a bitarray, using the "Roaring" scheme. The bits are split into
+ * chunks of CHUNK_BITS bits, and only chunks with some bits set are stored.
+ * Each one is kept in a container of whichever of three types is smallest for
+ * its contents:
+ *
+ * - An array container is a sorted array of the offsets of its set bits. It
+ *   is only used for chunks with at most ARRAY_MAX set bits, since past that
+ *   a bitmap is smaller.
+ * - A bitmap container is an ordinary array of CHUNK_WORDS words.
+ * - A run container is a sorted array of runs of set bits.
+ *
+ * The containers are kept in an array sorted by chunk number, so finding the
+ * one that holds a bit is a binary search.
+ */
+#define CHUNK_BITS 65536
+#define CHUNK_WORDS ((long)(CHUNK_BITS / WORD_BITS))
+#define ARRAY_MAX 4096
+
+enum container_type {
+    ARRAY_CONTAINER,
+    BITMAP_CONTAINER,
+    RUN_CONTAINER
+};
+
+/* A run of set bits, from start to start + length inclusive. */
+struct run {
+    uint16_t start;
+    uint16_t length;
+};
+
+struct container {
+    long key;            /* Chunk number. */
+    int type;            /* The container_type. */
+    int count;           /* Number of set bits. */
+    int size;            /* Number of values or runs in use. */
+    int capacity;        /* Number of values or runs allocated. */
+    union {
+        uint16_t *values;
+        uint64_t *words;
+        struct run *runs;
+    } data;
+};
+
+struct compressed_bitarray {
+    long bits;           /* Number of bits. */
+    long size;           /* Number of containers. */
+    long capacity;       /* Number of containers allocated. */
+    struct container *containers; /* Sorted by key. */
+};
+
+
+/* Set the bits from..to-1 in an array of words. */
+static void
+fill_words(uint64_t *words, long from, long to)
+{
+    if (from >= to) {
+        return;
+    }
+
+    long first = from / WORD_BITS;
+    long last = (to - 1) / WORD_BITS;
+    uint64_t first_mask = WORD_MAX << (from % WORD_BITS);
+    uint64_t last_mask = WORD_MAX >> ((WORD_BITS - to % WORD_BITS) % WORD_BITS);
+    if (first == last) {
+        words[first] |= first_mask & last_mask;
+        return;
+    }
+
+    words[first] |= first_mask;
+    memset(words + first + 1, 0xff, (last - first - 1) * WORD_BYTES);
+    words[last] |= last_mask;
+}
+
+
+/* Search an array container for value. Returns its position if it's there,
+ * and -(p + 1) if it isn't, where p is where it would go.
+ */
+static long
+find_value(const struct container *c, int value)
+{
+    long lo = 0, hi = c->size - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (c->data.values[mid] < value) {
+            lo = mid + 1;
+        } else if (c->data.values[mid] > value) {
+            hi = mid - 1;
+        } else {
+            return mid;
+        }
+    }
+    return -(lo + 1);
+}
+
+
+/* Return the position of the last run in a run container that starts at or
+ * before value, or -1 if there isn't one.
+ */
+static long
+find_run(const struct container *c, int value)
+{
+    long lo = 0, hi = c->size - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (c->data.runs[mid].start <= value) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return hi;
+}
+
+
+/* Return non-zero if the bit at offset low in a container is set. */
+static int
+container_contains(const struct container *c, int low)
+{
+    long i;
+    switch (c->type) {
+    case ARRAY_CONTAINER:
+        return find_value(c, low) >= 0;
+    case BITMAP_CONTAINER:
+        return (c->data.words[low / WORD_BITS] & bitmask(low)) != 0;
+    default:
+        i = find_run(c, low);
+        return i >= 0 && low <= c->data.runs[i].start + c->data.runs[i].length;
+    }
+}
+
+
+/* Return the offset of the first set bit at or after low in a container, or
+ * -1 if there isn't one.
+ */
+static long
+container_next(const struct container *c, long low)
+{
+    long i;
+    uint64_t word;
+    switch (c->type) {
+    case ARRAY_CONTAINER:
+        i = find_value(c, low);
+        if (i < 0) {
+            i = -i - 1;
+        }
+        return (i < c->size ? c->data.values[i] : -1);
+    case BITMAP_CONTAINER:
+        i = low / WORD_BITS;
+        word = c->data.words[i] & (WORD_MAX << (low % WORD_BITS));
+        while (word == 0) {
+            if (++i >= CHUNK_WORDS) {
+                return -1;
+            }
+            word = c->data.words[i];
+        }
+        return i * WORD_BITS + ctz_word(word);
+    default:
+        i = find_run(c, low);
+        if (i >= 0 && low <= c->data.runs[i].start + c->data.runs[i].length) {
+            return low;
+        }
+        return (i + 1 < c->size ? c->data.runs[i + 1].start : -1);
+    }
+}
+
+
+/* Write the bits in a container to an array of CHUNK_WORDS words. */
+static void
+container_to_words(const struct container *c, uint64_t *words)
+{
+    int i;
+    if (c->type == BITMAP_CONTAINER) {
+        memcpy(words, c->data.words, CHUNK_WORDS * WORD_BYTES);
+        return;
+    }
+
+    memset(words, 0x00, CHUNK_WORDS * WORD_BYTES);
+    if (c->type == ARRAY_CONTAINER) {
+        for (i = 0; i < c->size; i++) {
+            words[c->data.values[i] / WORD_BITS] |=
+                bitmask(c->data.values[i]);
+        }
+    } else {
+        for (i = 0; i < c->size; i++) {
+            fill_words(words, c->data.runs[i].start,
+                    c->data.runs[i].start + c->data.runs[i].length + 1);
+        }
+    }
+}
+
+
+/* Replace the contents of a container with the bits in an array of
+ * CHUNK_WORDS words, using whichever type of container is smallest. words may
+ * be the container's own bitmap. Returns the number of set bits.
+ */
+static int
+pack_container(struct container *c, const uint64_t *words)
+{
+    long i, count = 0, runs = 0;
+    uint64_t prev = 0;
+    count = popcount_bytes(words, CHUNK_WORDS * WORD_BYTES);
+    for (i = 0; i < CHUNK_WORDS; i++) {
+        runs += popcount_word(words[i] & ~((words[i] << 1) | (prev >> 63)));
+        prev = words[i];
+    }
+
+    /* Sizes in bytes: a run is twice the size of an array value. */
+    int type;
+    if (runs * 2 < count && runs * 4 < CHUNK_BITS / CHAR_BIT) {
+        type = RUN_CONTAINER;
+    } else if (count <= ARRAY_MAX) {
+        type = ARRAY_CONTAINER;
+    } else {
+        type = BITMAP_CONTAINER;
+    }
+
+    if (type == BITMAP_CONTAINER && c->type == BITMAP_CONTAINER) {
+        if (words != c->data.words) {
+            memcpy(c->data.words, words, CHUNK_WORDS * WORD_BYTES);
+        }
+        c->count = count;
+        return count;
+    }
+
+    void *old = c->data.values;
+    if (type == BITMAP_CONTAINER) {
+        c->data.words = ruby_xmalloc(CHUNK_WORDS * WORD_BYTES);
+        memcpy(c->data.words, words, CHUNK_WORDS * WORD_BYTES);
+        c->size = c->capacity = 0;
+    } else if (type == ARRAY_CONTAINER) {
+        uint16_t *values = ruby_xmalloc2(count ? count : 1, sizeof(uint16_t));
+        long n = 0;
+        for (i = 0; i < CHUNK_WORDS; i++) {
+            uint64_t word = words[i];
+            while (word != 0) {
+                values[n++] = i * WORD_BITS + ctz_word(word);
+                word &= word - 1;
+            }
+        }
+        c->data.values = values;
+        c->size = c->capacity = count;
+    } else {
+        /* Go through the bits where runs start and end in order. A bit can
+         * be both, for a run of one bit.
+         */
+        struct run *out = ruby_xmalloc2(runs, sizeof(struct run));
+        long n = 0;
+        prev = 0;
+        for (i = 0; i < CHUNK_WORDS; i++) {
+            uint64_t next = (i + 1 < CHUNK_WORDS ? words[i + 1] : 0);
+            uint64_t starts = words[i] & ~((words[i] << 1) | (prev >> 63));
+            uint64_t ends = words[i] & ~((words[i] >> 1) | (next << 63));
+            uint64_t edges = starts | ends;
+            while (edges != 0) {
+                uint64_t bit = edges & -edges;
+                int pos = i * WORD_BITS + ctz_word(bit);
+                if (starts & bit) {
+                    out[n++].start = pos;
+                }
+                if (ends & bit) {
+                    out[n - 1].length = pos - out[n - 1].start;
+                }
+                edges ^= bit;
+            }
+            prev = words[i];
+        }
+        c->data.runs = out;
+        c->size = c->capacity = runs;
+    }
+
+    ruby_xfree(old);
+    c->type = type;
+    c->count = count;
+    return count;
+}
+
+
+/* Set the bit at offset low in a container. */
+static void
+container_add(struct container *c, int low)
+{
+    uint64_t words[CHUNK_WORDS];
+    long i;
+
+    switch (c->type) {
+    case ARRAY_CONTAINER:
+        i = find_value(c, low);
+        if (i >= 0) {
+            return;
+        }
+        if (c->count == ARRAY_MAX) {
+            container_to_words(c, words);
+            words[low / WORD_BITS] |= bitmask(low);
+            pack_container(c, words);
+            return;
+        }
+
+        i = -i - 1;
+        if (c->size == c->capacity) {
+            c->capacity = (c->capacity < 2 ? 4 : c->capacity * 2);
+            if (c->capacity > ARRAY_MAX) {
+                c->capacity = ARRAY_MAX;
+            }
+            c->data.values = ruby_xrealloc2(c->data.values, c->capacity,
+                    sizeof(uint16_t));
+        }
+        memmove(c->data.values + i + 1, c->data.values + i,
+                (c->size - i) * sizeof(uint16_t));
+        c->data.values[i] = low;
+        c->size++;
+        c->count++;
+        return;
+    case BITMAP_CONTAINER:
+        if (!(c->data.words[low / WORD_BITS] & bitmask(low))) {
+            c->data.words[low / WORD_BITS] |= bitmask(low);
+            c->count++;
+        }
+        return;
+    default:
+        if (!container_contains(c, low)) {
+            container_to_words(c, words);
+            words[low / WORD_BITS] |= bitmask(low);
+            pack_container(c, words);
+        }
+        return;
+    }
+}
+
+
+/* Clear the bit at offset low in a container. */
+static void
+container_remove(struct container *c, int low)
+{
+    uint64_t words[CHUNK_WORDS];
+    long i;
+
+    switch (c->type) {
+    case ARRAY_CONTAINER:
+        i = find_value(c, low);
+        if (i >= 0) {
+            memmove(c->data.values + i, c->data.values + i + 1,
+                    (c->size - i - 1) * sizeof(uint16_t));
+            c->size--;
+            c->count--;
+        }
+        return;
+    case BITMAP_CONTAINER:
+        if (c->data.words[low / WORD_BITS] & bitmask(low)) {
+            c->data.words[low / WORD_BITS] &= ~bitmask(low);
+            if (--c->count <= ARRAY_MAX) {
+                pack_container(c, c->data.words);
+            }
+        }
+        return;
+    default:
+        if (container_contains(c, low)) {
+            container_to_words(c, words);
+            words[low / WORD_BITS] &= ~bitmask(low);
+            pack_container(c, words);
+        }
+        return;
+    }
+}
+
+
+/* Initialize out as a copy of a container. */
+static void
+container_copy(struct container *out, const struct container *c)
+{
+    *out = *c;
+    if (c->type == BITMAP_CONTAINER) {
+        out->data.words = ruby_xmalloc(CHUNK_WORDS * WORD_BYTES);
+        memcpy(out->data.words, c->data.words, CHUNK_WORDS * WORD_BYTES);
+    } else if (c->type == ARRAY_CONTAINER) {
+        out->capacity = (c->size ? c->size : 1);
+        out->data.values = ruby_xmalloc2(out->capacity, sizeof(uint16_t));
+        memcpy(out->data.values, c->data.values, c->size * sizeof(uint16_t));
+    } else {
+        out->capacity = c->size;
+        out->data.runs = ruby_xmalloc2(c->size, sizeof(struct run));
+        memcpy(out->data.runs, c->data.runs, c->size * sizeof(struct run));
+    }
+}
+
+
+/* Initialize out as the intersection of two containers. Returns the number
+ * of set bits, which may be zero.
+ */
+static int
+container_and(struct container *out, const struct container *x,
+        const struct container *y)
+{
+    uint64_t x_words[CHUNK_WORDS], y_words[CHUNK_WORDS];
+    long i, j, n = 0;
+
+    out->key = x->key;
+    out->data.values = NULL;
+
+    if (y->type == ARRAY_CONTAINER && x->type != ARRAY_CONTAINER) {
+        const struct container *t = x;
+        x = y;
+        y = t;
+    }
+
+    if (x->type == ARRAY_CONTAINER) {
+        uint16_t *values = ruby_xmalloc2(x->size ? x->size : 1,
+                sizeof(uint16_t));
+        if (y->type == ARRAY_CONTAINER) {
+            for (i = 0, j = 0; i < x->size && j < y->size; ) {
+                if (x->data.values[i] < y->data.values[j]) {
+                    i++;
+                } else if (x->data.values[i] > y->data.values[j]) {
+                    j++;
+                } else {
+                    values[n++] = x->data.values[i];
+                    i++;
+                    j++;
+                }
+            }
+        } else {
+            for (i = 0; i < x->size; i++) {
+                if (container_contains(y, x->data.values[i])) {
+                    values[n++] = x->data.values[i];
+                }
+            }
+        }
+        out->type = ARRAY_CONTAINER;
+        out->data.values = values;
+        out->size = out->count = n;
+        out->capacity = (x->size ? x->size : 1);
+        return n;
+    }
+
+    container_to_words(x, x_words);
+    container_to_words(y, y_words);
+    for (i = 0; i < CHUNK_WORDS; i++) {
+        x_words[i] &= y_words[i];
+    }
+    out->type = ARRAY_CONTAINER;
+    return pack_container(out, x_words);
+}
+
+
+/* Initialize out as the union of two containers. Returns the number of set
+ * bits.
+ */
+static int
+container_or(struct container *out, const struct container *x,
+        const struct container *y)
+{
+    uint64_t x_words[CHUNK_WORDS], y_words[CHUNK_WORDS];
+    long i, j, n = 0;
+
+    out->key = x->key;
+    out->data.values = NULL;
+
+    if (x->type == ARRAY_CONTAINER && y->type == ARRAY_CONTAINER &&
+            x->size + y->size <= ARRAY_MAX) {
+        uint16_t *values = ruby_xmalloc2(x->size + y->size, sizeof(uint16_t));
+        for (i = 0, j = 0; i < x->size || j < y->size; ) {
+            if (j >= y->size ||
+                    (i < x->size && x->data.values[i] < y->data.values[j])) {
+                values[n++] = x->data.values[i++];
+            } else if (i >= x->size ||
+                    x->data.values[i] > y->data.values[j]) {
+                values[n++] = y->data.values[j++];
+            } else {
+                values[n++] = x->data.values[i];
+                i++;
+                j++;
+            }
+        }
+        out->type = ARRAY_CONTAINER;
+        out->data.values = values;
+        out->size = out->count = n;
+        out->capacity = x->size + y->size;
+        return n;
+    }
+
+    container_to_words(x, x_words);
+    container_to_words(y, y_words);
+    for (i = 0; i < CHUNK_WORDS; i++) {
+        x_words[i] |= y_words[i];
+    }
+    out->type = ARRAY_CONTAINER;
+    return pack_container(out, x_words);
+}
+
+
+/* Find the container for chunk key. Returns its position if there is one,
+ * and -(p + 1) if there isn't, where p is where it would go.
+ */
+static long
+find_container(const struct compressed_bitarray *cb, long key)
+{
+    long lo = 0, hi = cb->size - 1;
+    while (lo <= hi) {
+        long mid = (lo + hi) / 2;
+        if (cb->containers[mid].key < key) {
+            lo = mid + 1;
+        } else if (cb->containers[mid].key > key) {
+            hi = mid - 1;
+        } else {
+            return mid;
+        }
+    }
+    return -(lo + 1);
+}
+
+
+/* Insert a new, empty array container for chunk key at position pos. */
+static struct container *
+insert_container(struct compressed_bitarray *cb, long pos, long key)
+{
+    if (cb->size == cb->capacity) {
+        cb->capacity = (cb->capacity < 2 ? 4 : cb->capacity * 2);
+        cb->containers = ruby_xrealloc2(cb->containers, cb->capacity,
+                sizeof(struct container));
+    }
+    memmove(cb->containers + pos + 1, cb->containers + pos,
+            (cb->size - pos) * sizeof(struct container));
+    cb->size++;
+
+    struct container *c = &cb->containers[pos];
+    memset(c, 0, sizeof(*c));
+    c->key = key;
+    c->type = ARRAY_CONTAINER;
+    return c;
+}
+
+
+/* Remove the container at position pos. */
+static void
+remove_container(struct compressed_bitarray *cb, long pos)
+{
+    ruby_xfree(cb->containers[pos].data.values);
+    memmove(cb->containers + pos, cb->containers + pos + 1,
+            (cb->size - pos - 1) * sizeof(struct container));
+    cb->size--;
+}
+
+
+/* Free everything a compressed bitarray holds, leaving it empty. */
+static void
+free_compressed_bitarray(struct compressed_bitarray *cb)
+{
+    long i;
+    for (i = 0; i < cb->size; i++) {
+        ruby_xfree(cb->containers[i].data.values);
+    }
+    ruby_xfree(cb->containers);
+    cb->containers = NULL;
+    cb->size = cb->capacity = 0;
+}
+
+
+/* Check an index into a compressed bitarray, like check_index. */
+static inline long
+compressed_check_index(struct compressed_bitarray *cb, long index)
+{
+    if (index < 0) index += cb->bits;
+    if (index < 0 || index >= cb->bits) {
+        rb_raise(rb_eIndexError, "index %ld out of bit array", index);
+    }
+    return index;
+}
+
+
+/* Set the specified bit to 1. */
+static void
+compressed_set_bit(struct compressed_bitarray *cb, long index)
+{
+    index = compressed_check_index(cb, index);
+    long pos = find_container(cb, index / CHUNK_BITS);
+    if (pos < 0) {
+        pos = -pos - 1;
+        insert_container(cb, pos, index / CHUNK_BITS);
+    }
+    container_add(&cb->containers[pos], index % CHUNK_BITS);
+}
+
+
+/* Clear the specified bit to 0. */
+static void
+compressed_clear_bit(struct compressed_bitarray *cb, long index)
+{
+    index = compressed_check_index(cb, index);
+    long pos = find_container(cb, index / CHUNK_BITS);
+    if (pos >= 0) {
+        container_remove(&cb->containers[pos], index % CHUNK_BITS);
+        if (cb->containers[pos].count == 0) {
+            remove_container(cb, pos);
+        }
+    }
+}
+
+
+/* Get the state of the specified bit. */
+static int
+compressed_get_bit(struct compressed_bitarray *cb, long index)
+{
+    index = compressed_check_index(cb, index);
+    long pos = find_container(cb, index / CHUNK_BITS);
+    return (pos >= 0 &&
+            container_contains(&cb->containers[pos], index % CHUNK_BITS));
+}
+
+
+/* Return the number of set bits. */
+static long
+compressed_total_set(struct compressed_bitarray *cb)
+{
+    long i, count = 0;
+    for (i = 0; i < cb->size; i++) {
+        count += cb->containers[i].count;
+    }
+    return count;
+}
+
+
+/* Return the index of the first set bit at or after from, or -1 if there
+ * isn't one.
+ */
+static long
+compressed_next_set_bit(struct compressed_bitarray *cb, long from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+
+    long pos = find_container(cb, from / CHUNK_BITS);
+    if (pos >= 0) {
+        long low = container_next(&cb->containers[pos], from % CHUNK_BITS);
+        if (low >= 0) {
+            return cb->containers[pos].key * CHUNK_BITS + low;
+        }
+        pos++;
+    } else {
+        pos = -pos - 1;
+    }
+
+    /* Containers are never empty, so the next one has a set bit. */
+    if (pos >= cb->size) {
+        return -1;
+    }
+    return cb->containers[pos].key * CHUNK_BITS +
+        container_next(&cb->containers[pos], 0);
+}
+
+
+/* Initialize an empty compressed bitarray as a copy of another. */
+static void
+initialize_compressed_copy(struct compressed_bitarray *new_cb,
+        struct compressed_bitarray *orig_cb)
+{
+    long i;
+    new_cb->bits = orig_cb->bits;
+    new_cb->capacity = orig_cb->size;
+    new_cb->containers = ruby_xmalloc2(orig_cb->size ? orig_cb->size : 1,
+            sizeof(struct container));
+    for (new_cb->size = 0; new_cb->size < orig_cb->size; new_cb->size++) {
+        i = new_cb->size;
+        container_copy(&new_cb->containers[i], &orig_cb->containers[i]);
+    }
+}
+
+
+/* Initialize an empty compressed bitarray as the intersection of two others.
+ * Like the bitarray intersection, it has the length of the shorter one.
+ */
+static void
+initialize_compressed_intersect(struct compressed_bitarray *new_cb,
+        struct compressed_bitarray *x_cb, struct compressed_bitarray *y_cb)
+{
+    long i = 0, j = 0;
+    new_cb->bits = (x_cb->bits < y_cb->bits ? x_cb->bits : y_cb->bits);
+    new_cb->capacity = (x_cb->size < y_cb->size ? x_cb->size : y_cb->size);
+    new_cb->containers = ruby_xmalloc2(new_cb->capacity ? new_cb->capacity : 1,
+            sizeof(struct container));
+
+    while (i < x_cb->size && j < y_cb->size) {
+        struct container *x = &x_cb->containers[i];
+        struct container *y = &y_cb->containers[j];
+        if (x->key < y->key) {
+            i++;
+        } else if (x->key > y->key) {
+            j++;
+        } else {
+            struct container *out = &new_cb->containers[new_cb->size];
+            if (container_and(out, x, y) > 0) {
+                new_cb->size++;
+            } else {
+                ruby_xfree(out->data.values);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+
+/* Initialize an empty compressed bitarray as the union of two others. Like
+ * the bitarray union, it has the length of the longer one.
+ */
+static void
+initialize_compressed_union(struct compressed_bitarray *new_cb,
+        struct compressed_bitarray *x_cb, struct compressed_bitarray *y_cb)
+{
+    long i = 0, j = 0;
+    new_cb->bits = (x_cb->bits > y_cb->bits ? x_cb->bits : y_cb->bits);
+    new_cb->capacity = x_cb->size + y_cb->size;
+    new_cb->containers = ruby_xmalloc2(new_cb->capacity ? new_cb->capacity : 1,
+            sizeof(struct container));
+
+    while (i < x_cb->size || j < y_cb->size) {
+        struct container *out = &new_cb->containers[new_cb->size];
+        if (j >= y_cb->size || (i < x_cb->size &&
+                    x_cb->containers[i].key < y_cb->containers[j].key)) {
+            container_copy(out, &x_cb->containers[i++]);
+        } else if (i >= x_cb->size ||
+                x_cb->containers[i].key > y_cb->containers[j].key) {
+            container_copy(out, &y_cb->containers[j++]);
+        } else {
+            container_or(out, &x_cb->containers[i++], &y_cb->containers[j++]);
+        }
+        new_cb->size++;
+    }
+}
+
+
+/* Initialize an empty compressed bitarray from a bitarray. */
+static void
+initialize_compressed_bitarray(struct compressed_bitarray *cb,
+        struct bitarray *ba)
+{
+    uint64_t words[CHUNK_WORDS];
+    long base;
+
+    cb->bits = ba->bits;
+    for (base = 0; base < ba->array_size; base += CHUNK_WORDS) {
+        long n = ba->array_size - base;
+        if (n > CHUNK_WORDS) {
+            n = CHUNK_WORDS;
+        }
+        if (popcount_bytes((unsigned char *)(ba->array + base),
+                    n * WORD_BYTES) == 0) {
+            continue;
+        }
+
+        memcpy(words, ba->array + base, n * WORD_BYTES);
+        memset(words + n, 0x00, (CHUNK_WORDS - n) * WORD_BYTES);
+        struct container *c = insert_container(cb, cb->size,
+                base / CHUNK_WORDS);
+        pack_container(c, words);
+    }
+}
+
+
+/* Initialize an empty bitarray from a compressed bitarray. */
+static void
+initialize_bitarray_compressed(struct bitarray *ba,
+        struct compressed_bitarray *cb)
+{
+    long i;
+    int j;
+
+    allocate_bitarray(ba, cb->bits, 1);
+    for (i = 0; i < cb->size; i++) {
+        struct container *c = &cb->containers[i];
+        uint64_t *words = ba->array + c->key * CHUNK_WORDS;
+        long n = ba->array_size - c->key * CHUNK_WORDS;
+
+        switch (c->type) {
+        case ARRAY_CONTAINER:
+            for (j = 0; j < c->size; j++) {
+                words[c->data.values[j] / WORD_BITS] |=
+                    bitmask(c->data.values[j]);
+            }
+            break;
+        case BITMAP_CONTAINER:
+            memcpy(words, c->data.words,
+                    (n < CHUNK_WORDS ? n : CHUNK_WORDS) * WORD_BYTES);
+            break;
+        default:
+            for (j = 0; j < c->size; j++) {
+                fill_words(words, c->data.runs[j].start,
+                        c->data.runs[j].start + c->data.runs[j].length + 1);
+            }
+            break;
+        }
+    }
+}
+
+
+/* Bloom filters.
+ *
+ * A Bloom filter is a bitarray of m bits. To add a key it sets k bits chosen
+ * by hashing the key; a key might be in the filter if all k of its bits are
+ * set. The k bit positions come from two 64-bit hashes h1 and h2 of the key,
+ * as h1 + i * h2 for i = 0..k-1 (Kirsch and Mitzenmacher's double hashing),
+ * so each key is only hashed once. The hash is wyhash, which is fast and
+ * good enough for this, but not cryptographic.
+ *
+ * In a blocked filter, h1 picks one 512-bit block (a cache line; the storage
+ * array is aligned to one), and all k bits are chosen within that block. A
+ * lookup then touches one cache line instead of k, at the cost of a slightly
+ * higher false positive rate for the same size.
+ */
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BATCH 16
+#define BLOOM_HASHES_MAX 64
+
+struct bloom_filter {
+    VALUE bitmap;        /* The BitArray holding the bits. */
+    int hashes;          /* Number of bits set per key (k). */
+    int blocked;         /* Non-zero for the cache-line-blocked layout. */
+};
+
+/* The positions of one key's bits. */
+struct bloom_hash {
+    uint64_t h1;
+    uint64_t h2;
+};
+
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+
+/* Multiply two 64-bit numbers, leaving the low half of the 128-bit product
+ * in a and the high half in b.
+ */
+static inline void
+wymum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), lo, c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+
+/* Multiply two 64-bit numbers, and fold the product into 64 bits. */
+static inline uint64_t
+wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+
+static inline uint64_t
+wyr8(const unsigned char *p)
+{
+    return load_le64(p);
+}
+
+
+static inline uint64_t
+wyr4(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) |
+        ((uint64_t)p[3] << 24);
+}
+
+
+/* Hash n bytes with wyhash. */
+static uint64_t
+wyhash(const unsigned char *p, long n, uint64_t seed)
+{
+    const uint64_t *s = wyhash_secret;
+    uint64_t a, b;
+    long i = n;
+
+    seed ^= wymix(seed ^ s[0], s[1]);
+    if (n <= 16) {
+        if (n >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((n >> 3) << 2));
+            b = (wyr4(p + n - 4) << 32) | wyr4(p + n - 4 - ((n >> 3) << 2));
+        } else if (n > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[n >> 1] << 8) | p[n - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ s[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ s[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ s[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ s[1], wyr8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ s[0] ^ (uint64_t)n, b ^ s[1]);
+}
+
+
+/* Hash a key into the two hashes used for double hashing. h2 is made odd, so
+ * that in a blocked filter the k positions are all different.
+ */
+static inline void
+bloom_hash_key(struct bloom_hash *h, const unsigned char *p, long n)
+{
+    h->h1 = wyhash(p, n, 0);
+    h->h2 = wymix(h->h1 ^ wyhash_secret[2], wyhash_secret[3]) | 1;
+}
+
+
+/* Map a 64-bit hash onto 0..n-1, without a division. */
+static inline long
+bloom_reduce(uint64_t hash, long n)
+{
+#ifdef __SIZEOF_INT128__
+    return (long)(((__uint128_t)hash * (uint64_t)n) >> 64);
+#else
+    return (long)(hash % (uint64_t)n);
+#endif
+}
+
+
+/* Return the first bit of the block holding a key's bits in a blocked filter,
+ * or -1 if the filter isn't blocked.
+ */
+static inline long
+bloom_block(const struct bloom_hash *h, long bits, int blocked)
+{
+    if (!blocked) {
+        return -1;
+    }
+    return bloom_reduce(h->h1, bits / BLOOM_BLOCK_BITS) * BLOOM_BLOCK_BITS;
+}
+
+
+/* Return the position of bit i of a key in a filter of the given number of
+ * bits, given the key's block from bloom_block.
+ */
+static inline long
+bloom_bit(const struct bloom_hash *h, int i, long bits, long block)
+{
+    if (block >= 0) {
+        uint64_t offset = (h->h2 + i * (h->h2 >> 32 | 1)) % BLOOM_BLOCK_BITS;
+        return block + (long)offset;
+    }
+    return bloom_reduce(h->h1 + i * h->h2, bits);
+}
+
+
+/* Set a key's bits. */
+static void
+bloom_add(struct bitarray *ba, const struct bloom_hash *h, int hashes,
+        int blocked)
+{
+    long block = bloom_block(h, ba->bits, blocked);
+    int i;
+    for (i = 0; i < hashes; i++) {
+        long bit = bloom_bit(h, i, ba->bits, block);
+        ba->array[bit / WORD_BITS] |= bitmask(bit);
+    }
+}
+
+
+/* Return non-zero if all of a key's bits are set. */
+static int
+bloom_check(struct bitarray *ba, const struct bloom_hash *h, int hashes,
+        int blocked)
+{
+    long block = bloom_block(h, ba->bits, blocked);
+    int i;
+    for (i = 0; i < hashes; i++) {
+        long bit = bloom_bit(h, i, ba->bits, block);
+        if (!(ba->array[bit / WORD_BITS] & bitmask(bit))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* Equality, hashing and comparison.
+ *
+ * The unused bits at the end of the last word should always be clear, but we
+ * mask them off anyway rather than trust that for a mapped file, and compare
+ * everything before them with memcmp. Hashes use wyhash (see "Bloom
+ * filters"), and are cached until the bits change. They aren't cached for a
+ * locked bitarray, since its bits could be changing as we read them, or for a
+ * mapped one, since another mapping of the file can change its bits without
+ * telling us.
+ */
+
+
+/* Return the last word of a bitarray, without any unused bits. */
+static inline uint64_t
+last_word(struct bitarray *ba)
+{
+    uint64_t word = ba->array[ba->array_size - 1];
+    if (ba->bits % WORD_BITS != 0) {
+        word &= ~(WORD_MAX << (ba->bits % WORD_BITS));
+    }
+    return word;
+}
+
+
+/* Return non-zero if two bitarrays have the same bits. */
+static int
+bitarray_equal(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    if (x_ba->bits != y_ba->bits) {
+        return 0;
+    }
+    if (x_ba->array_size == 0 || x_ba->array == y_ba->array) {
+        return 1;
+    }
+    if (x_ba->hashed && y_ba->hashed && !x_ba->mapped && !y_ba->mapped &&
+            x_ba->hash != y_ba->hash) {
+        return 0;
+    }
+    return memcmp(x_ba->array, y_ba->array,
+            (x_ba->array_size - 1) * WORD_BYTES) == 0 &&
+        last_word(x_ba) == last_word(y_ba);
+}
+
+
+/* Return a hash of the bits of a bitarray. */
+static uint64_t
+bitarray_hash(struct bitarray *ba)
+{
+    if (ba->hashed) {
+        return ba->hash;
+    }
+
+    uint64_t hash = wyhash_secret[0] ^ (uint64_t)ba->bits;
+    if (ba->array_size > 0) {
+        hash = wyhash((const unsigned char *)ba->array,
+                (ba->array_size - 1) * WORD_BYTES, hash);
+        hash = wymix(hash ^ last_word(ba), wyhash_secret[1]);
+    }
+    if (!ba->locks && !ba->mapped) {
+        ba->hash = hash;
+        ba->hashed = 1;
+    }
+    return hash;
+}
+
+
+/* Compare two bitarrays bit by bit from the start, returning -1, 0 or 1. The
+ * first bit that differs decides; if there isn't one, the shorter bitarray
+ * comes first.
+ */
+static int
+bitarray_compare(struct bitarray *x_ba, struct bitarray *y_ba)
+{
+    long bits = (x_ba->bits < y_ba->bits ? x_ba->bits : y_ba->bits);
+    long words = word_array_size(bits);
+    long i;
+
+    if (x_ba->array != y_ba->array) {
+        for (i = 0; i < words; i++) {
+            uint64_t diff = x_ba->array[i] ^ y_ba->array[i];
+            if (diff != 0) {
+                long bit = i * WORD_BITS + ctz_word(diff);
+                if (bit >= bits) {
+                    break;
+                }
+                return (x_ba->array[i] & bitmask(bit)) ? 1 : -1;
+            }
+        }
+    }
+
+    if (x_ba->bits == y_ba->bits) {
+        return 0;
+    }
+    return (x_ba->bits < y_ba->bits ? -1 : 1);
+}
+
+
+/* Compiled boolean networks.
+ *
+ * A network holds the two inputs and the op of each of its outputs, in the
+ * form WORD_GATHER wants (see "Boolean networks"). Running it a step at a
+ * time on the same state swaps the state's storage with a scratch bitarray
+ * after each step, so nothing is allocated or copied per step.
+ */
+struct network {
+    long size;           /* Number of outputs. */
+    long *a;             /* The first input of each output. */
+    long *b;             /* The second input of each output. */
+    uint64_t *tables;    /* Four masks per output word. */
+    long max_input;      /* The highest input index used, or -1. */
+    VALUE scratch;       /* BitArray used by step!, or Qnil. */
+};
+
+
+/* Free the arrays of a network. */
+static void
+free_network(struct network *net)
+{
+    ruby_xfree(net->a);
+    ruby_xfree(net->b);
+    ruby_xfree(net->tables);
+    net->a = net->b = NULL;
+    net->tables = NULL;
+    net->size = 0;
+    net->max_input = -1;
+}
+
+
+/* Set the op of output i to a truth table. Bit k of the table is the output
+ * for the inputs (k >> 1, k & 1).
+ */
+static inline void
+set_network_op(struct network *net, long i, int table)
+{
+    int k;
+    for (k = 0; k < 4; k++) {
+        if ((table >> k) & 1) {
+            net->tables[4 * (i / WORD_BITS) + k] |= bitmask(i);
+        }
+    }
+}
+
+
+/* Compute one step of a network from in_ba into out_ba, which must be the
+ * network's size. They must not share storage.
+ */
+static void
+network_step(struct network *net, struct bitarray *in_ba,
+        struct bitarray *out_ba)
+{
+    struct word_job job;
+    memset(&job, 0, sizeof(job));
+    job.op = WORD_GATHER;
+    job.dst = out_ba->array;
+    job.x = in_ba->array;
+    job.words = out_ba->array_size;
+    job.gather_a = net->a;
+    job.gather_b = net->b;
+    job.tables = net->tables;
+    job.gather_size = net->size;
+    if (job.words > 0) {
+        run_job(&job, in_ba, out_ba);
+    }
+}
+
+
+/* Ruby Interface Functions.
+ * 
+ * These functions put a Ruby face on top of the lower-level functions. With
+ * very few exceptions, they should not access the bitarray structs' members
+ * directly.
+ *
+ * "bitarray" refers to the C structure. "BitArray" refers to the Ruby class.
+ *
+ * All publicly-accessible functions (those with an rb_define_method call in
+ * Init_bitarray) should have RDoc comment headers.
+ *
+ * When in doubt, see how array.c does things.
+ */
+
+
+/* Our BitArray class. This is initialized in Init_bitarray, but we declare it
+ * here because a few functions need it.
+ */
+static VALUE rb_bitarray_class;
+
+/* Likewise for the CompressedBitArray, BitArray::BloomFilter and
+ * BitArray::Network classes.
+ */
+static VALUE rb_compressed_class;
+static VALUE rb_bloom_class;
+static VALUE rb_network_class;
+
+
+/* This gets called when a BitArray is garbage collected. It frees the memory
+ * used by the bitarray struct, or unmaps it if it's backed by a file.
+ */
+static void
+rb_bitarray_free(struct bitarray *ba)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (ba && ba->mapped) {
+        munmap(ba->array, ba->mapped);
+    }
+#endif
+    if (ba && ba->buffer) {
+        release_storage(ba->buffer);
+    }
+    if (ba && ba->rank_index) {
+        free_rank_index(ba->rank_index);
+    }
+    ruby_xfree(ba);
+}
+
+
+/* This function is called by BitArray.new to allocate a new BitArray.
+ * Initialization is done in a seperate function.
+ * 
+ * This function can be called directly with BitArray.allocate, but that is not
+ * very useful.
+ */
+static VALUE
+rb_bitarray_alloc(VALUE klass)
+{
+    struct bitarray *ba;
+    return Data_Make_Struct(rb_bitarray_class, struct bitarray, NULL,
+            rb_bitarray_free, ba);
+}
+
+
+/* Get the bitarray from a BitArray, raising a TypeError if it's something
+ * else.
+ */
+static struct bitarray *
+rb_bitarray_struct(VALUE obj)
+{
+    struct bitarray *ba;
+    if (!rb_obj_is_kind_of(obj, rb_bitarray_class)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected %s)",
+                rb_obj_classname(obj), rb_class2name(rb_bitarray_class));
+    }
+    Data_Get_Struct(obj, struct bitarray, ba);
+    return ba;
+}
+
+
+/* Initialization helper-function prototypes. These functions are defined after
+ * rb_bitarray_initialize.
+ */
+static VALUE rb_bitarray_from_string(VALUE self, VALUE string);
+static VALUE rb_bitarray_from_array(VALUE self, VALUE array);
+
+
+/* call-seq:
+ *      BitArray.new(size)
+ *      BitArray.new(string)
+ *      BitArray.new(array)
+ *
+ * When called with a size, creates a new BitArray of the specified size, with
+ * all bits cleared. When called with a string or an array, creates a new
+ * BitArray from the argument.
+ *
+ * If a string is given, it should consist of ones and zeroes. If there are
+ * any other characters in the string, the first invalid character and all
+ * following characters will be ignored.
+ *
+ *   b = BitArray.new("10101010")       => 10101010
  *   b = BitArray.new("1010abcd")       => 1010
  *   b = BitArray.new("abcd")           => 
  *
- * If an array is given, the BitArray is initialized from its elements using
- * the following rules:
+ * If an array is given, the BitArray is initialized from its elements using
+ * the following rules:
+ *
+ * 1. 0, false, or nil  => 0
+ * 2. anything else     => 1
+ *
+ * Note that the 0 is a number, not a string. "Anything else" means strings,
+ * symbols, non-zero numbers, subarrays, etc.
+ *
+ *   b = BitArray.new([0,0,0,1,1,0])            => 000110
+ *   b = BitArray.new([false, true, false])     => 010
+ *   b = BitArray.new([:a, :b, :c, [:d, :e]])   => 1111
+ */
+static VALUE
+rb_bitarray_initialize(VALUE self, VALUE arg)
+{
+    if (TYPE(arg) == T_FIXNUM || TYPE(arg) == T_BIGNUM) {
+        struct bitarray *ba;
+        Data_Get_Struct(self, struct bitarray, ba);
+
+        initialize_bitarray(ba, NUM2LONG(arg));
+    
+        return self;
+
+    } else if (TYPE(arg) == T_STRING) {
+        return rb_bitarray_from_string(self, arg);
+    } else if (TYPE(arg) == T_ARRAY) { 
+        return rb_bitarray_from_array(self, arg);
+    } else {
+        rb_raise(rb_eArgError, "must be size, string, or array");
+    }
+}
+
+
+/* Create a new BitArray from a string. Called by rb_bitarray_initialize. */
+static VALUE
+rb_bitarray_from_string(VALUE self, VALUE string)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    initialize_bitarray_chars(ba, RSTRING_PTR(string), RSTRING_LEN(string));
+
+    return self;
+}
+
+
+/* Create a new BitArray from an Array. Called by rb_bitarray_initialize */
+static VALUE
+rb_bitarray_from_array(VALUE self, VALUE array)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    initialize_bitarray_values(ba, RARRAY_CONST_PTR(array), RARRAY_LEN(array));
+
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.clone          -> a_bitarray
+ *      bitarray.dup            -> a_bitarray
+ *
+ * Produces a copy of _bitarray_.
+ */
+static VALUE
+rb_bitarray_initialize_copy(VALUE self, VALUE orig)
+{
+    struct bitarray *new_ba, *orig_ba;
+    Data_Get_Struct(self, struct bitarray, new_ba);
+    orig_ba = rb_bitarray_struct(orig);
+
+    initialize_bitarray_copy(new_ba, orig_ba);
+
+    return self;
+}
+
+
+/* Empty the BitArray given to a BitArray.with_scratch block. */
+static VALUE
+rb_bitarray_scratch_done(VALUE obj)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+    if (!ba->mapped && !ba->read_only && !ba->locks) {
+        empty_bitarray(ba);
+    }
+    return Qnil;
+}
+
+
+/* call-seq:
+ *      BitArray.with_scratch(size) { |bitarray| ... }  -> obj
+ *
+ * Yields a cleared BitArray of the given size, and returns the value of the
+ * block. When the block finishes, the BitArray's storage goes straight back to
+ * be used by the next BitArray of about the same size, rather than waiting
+ * for the garbage collector, and the BitArray is left empty. So the block
+ * mustn't keep hold of it. Copies made in the block are unaffected.
+ */
+static VALUE
+rb_bitarray_s_with_scratch(VALUE klass, VALUE size)
+{
+    long bits = NUM2LONG(size);
+    rb_need_block();
+
+    VALUE obj = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+    initialize_bitarray(ba, bits);
+
+    return rb_ensure(rb_yield, obj, rb_bitarray_scratch_done, obj);
+}
+
+
+/* call-seq:
+ *      bitarray == other_bitarray      -> true or false
+ *      bitarray.eql?(other_bitarray)   -> true or false
+ *
+ * Equality---Two BitArrays are equal if they are the same size and have the
+ * same bits set. Anything that isn't a BitArray isn't equal to one.
+ */
+static VALUE
+rb_bitarray_equal(VALUE x, VALUE y)
+{
+    if (x == y) {
+        return Qtrue;
+    }
+    if (!rb_obj_is_kind_of(y, rb_bitarray_class)) {
+        return Qfalse;
+    }
+
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    Data_Get_Struct(y, struct bitarray, y_ba);
+
+    return bitarray_equal(x_ba, y_ba) ? Qtrue : Qfalse;
+}
+
+
+/* call-seq:
+ *      bitarray.hash   -> integer
+ *
+ * Compute a hash code for the BitArray from its bits, so that equal BitArrays
+ * can be used interchangeably as Hash keys or Set members. The hash is kept
+ * until the BitArray is next changed.
+ */
+static VALUE
+rb_bitarray_hash(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return LONG2FIX((long)(bitarray_hash(ba) >> 2));
+}
+
+
+/* call-seq:
+ *      bitarray <=> other_bitarray     -> -1, 0, 1 or nil
+ *
+ * Comparison---Compare the BitArrays bit by bit from index 0, like comparing
+ * their to_a's. The first bit that differs decides, with a set bit being
+ * greater; if one is a prefix of the other, the shorter one is less. Returns
+ * nil if other_bitarray isn't a BitArray.
+ */
+static VALUE
+rb_bitarray_cmp(VALUE x, VALUE y)
+{
+    if (!rb_obj_is_kind_of(y, rb_bitarray_class)) {
+        return Qnil;
+    }
+
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    Data_Get_Struct(y, struct bitarray, y_ba);
+
+    return INT2FIX(bitarray_compare(x_ba, y_ba));
+}
+
+
+/* call-seq:
+ *      bitarray + other_bitarray       -> a_bitarray
+ *
+ * Concatenation---Return a new BitArray built by concatenating the two
+ * BitArrays.
+ */
+static VALUE
+rb_bitarray_concat(VALUE x, VALUE y)
+{
+    /* Get the bitarrays from x and y */
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    /* Create a new BitArray, and its bitarray structure*/
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_concat(z_ba, x_ba, y_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray & other_bitarray       -> a_bitarray
+ *
+ * Intersection---Return a new BitArray from the intersection of the two
+ * BitArrays. The new BitArray will have the same length as the shorter of the
+ * two originals.
+ */
+static VALUE
+rb_bitarray_intersect(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_intersect(z_ba, x_ba, y_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray | other_bitarray       -> a_bitarray
+ *
+ * Union---Return a new BitArray from the union of the two BitArrays. The new
+ * BitArray will have the same length as the longer of the two originals.
+ */
+static VALUE
+rb_bitarray_union(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_union(z_ba, x_ba, y_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray ^ other_bitarray       -> a_bitarray
+ *
+ * Exclusive Or---Return a new BitArray with the bits that are set in exactly
+ * one of the two BitArrays. The new BitArray will have the same length as the
+ * longer of the two originals.
+ */
+static VALUE
+rb_bitarray_xor(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_xor(z_ba, x_ba, y_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray - other_bitarray       -> a_bitarray
+ *
+ * Difference---Return a new BitArray with the bits that are set in
+ * _bitarray_ but not in _other_bitarray_. The new BitArray will have the same
+ * length as _bitarray_.
+ */
+static VALUE
+rb_bitarray_difference(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_copy(z_ba, x_ba);
+    bitarray_andnot(z_ba, y_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      ~bitarray       -> a_bitarray
+ *
+ * Complement---Return a new BitArray with every bit of _bitarray_ toggled.
+ */
+static VALUE
+rb_bitarray_complement(VALUE x)
+{
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_copy(z_ba, x_ba);
+    toggle_all_bits(z_ba);
+
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray.shift_left(n)      -> a_bitarray
+ *
+ * Returns a new BitArray with the bits of _bitarray_ moved _n_ places towards
+ * the start, and zeros shifted in at the end. A negative _n_ shifts the other
+ * way.
+ *
+ *   b = BitArray.new("11001")
+ *   b.shift_left(1)                    => 10010
+ */
+static VALUE
+rb_bitarray_shift_left(VALUE x, VALUE n)
+{
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_shift(z_ba, x_ba, NUM2LONG(n));
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray.shift_left!(n)     -> bitarray
+ *
+ * Shifts the bits of _bitarray_ _n_ places towards the start, like
+ * shift_left, but in place.
+ */
+static VALUE
+rb_bitarray_shift_left_bang(VALUE x, VALUE n)
+{
+    struct bitarray *ba, tmp;
+    Data_Get_Struct(x, struct bitarray, ba);
+    memset(&tmp, 0, sizeof(tmp));
+
+    long shift = NUM2LONG(n);
+    bitarray_changed(ba);
+    initialize_bitarray_shift(&tmp, ba, shift);
+    replace_bitarray(ba, &tmp);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.shift_right(n)     -> a_bitarray
+ *
+ * Returns a new BitArray with the bits of _bitarray_ moved _n_ places towards
+ * the end, and zeros shifted in at the start. A negative _n_ shifts the other
+ * way.
+ *
+ *   b = BitArray.new("11001")
+ *   b.shift_right(1)                   => 01100
+ */
+static VALUE
+rb_bitarray_shift_right(VALUE x, VALUE n)
+{
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    long shift = NUM2LONG(n);
+    initialize_bitarray_shift(z_ba, x_ba, shift == LONG_MIN ? LONG_MAX : -shift);
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray.shift_right!(n)    -> bitarray
+ *
+ * Shifts the bits of _bitarray_ _n_ places towards the end, like
+ * shift_right, but in place.
+ */
+static VALUE
+rb_bitarray_shift_right_bang(VALUE x, VALUE n)
+{
+    struct bitarray *ba, tmp;
+    Data_Get_Struct(x, struct bitarray, ba);
+    memset(&tmp, 0, sizeof(tmp));
+
+    long shift = NUM2LONG(n);
+    bitarray_changed(ba);
+    initialize_bitarray_shift(&tmp, ba, shift == LONG_MIN ? LONG_MAX : -shift);
+    replace_bitarray(ba, &tmp);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.rotate             -> a_bitarray
+ *      bitarray.rotate(n)          -> a_bitarray
+ *
+ * Returns a new BitArray by rotating _bitarray_ so that the bit at _n_ (1 by
+ * default) is the first one, like Array#rotate. A negative _n_ rotates the
+ * other way. Together with the bitwise operators, this makes each step of a
+ * one-dimensional cellular automaton a few whole-array operations:
+ *
+ *   b = BitArray.new("11001")
+ *   b.rotate                           => 10011
+ *   b.rotate(-1) ^ (b | b.rotate)      => 00111  (rule 30)
+ */
+static VALUE
+rb_bitarray_rotate(int argc, VALUE *argv, VALUE x)
+{
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    VALUE n;
+    rb_scan_args(argc, argv, "01", &n);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_rotate(z_ba, x_ba, NIL_P(n) ? 1 : NUM2LONG(n));
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray.rotate!            -> bitarray
+ *      bitarray.rotate!(n)         -> bitarray
+ *
+ * Rotates _bitarray_ so that the bit at _n_ (1 by default) is the first one,
+ * like rotate, but in place.
+ */
+static VALUE
+rb_bitarray_rotate_bang(int argc, VALUE *argv, VALUE x)
+{
+    struct bitarray *ba, tmp;
+    Data_Get_Struct(x, struct bitarray, ba);
+    memset(&tmp, 0, sizeof(tmp));
+
+    VALUE n;
+    rb_scan_args(argc, argv, "01", &n);
+    long shift = NIL_P(n) ? 1 : NUM2LONG(n);
+    bitarray_changed(ba);
+    initialize_bitarray_rotate(&tmp, ba, shift);
+    replace_bitarray(ba, &tmp);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.reverse            -> a_bitarray
+ *
+ * Returns a new BitArray with the bits of _bitarray_ in reverse order.
+ *
+ *   b = BitArray.new("11001")
+ *   b.reverse                          => 10011
+ */
+static VALUE
+rb_bitarray_reverse(VALUE x)
+{
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_reverse(z_ba, x_ba);
+    return z;
+}
+
+
+/* call-seq:
+ *      bitarray.reverse!           -> bitarray
+ *
+ * Reverses the order of the bits of _bitarray_ in place.
+ */
+static VALUE
+rb_bitarray_reverse_bang(VALUE x)
+{
+    struct bitarray *ba, tmp;
+    Data_Get_Struct(x, struct bitarray, ba);
+    memset(&tmp, 0, sizeof(tmp));
+
+    bitarray_changed(ba);
+    initialize_bitarray_reverse(&tmp, ba);
+    replace_bitarray(ba, &tmp);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.and!(other_bitarray)       -> bitarray
+ *
+ * In-place intersection---Clears every bit in _bitarray_ that is not set in
+ * _other_bitarray_. The size of _bitarray_ does not change; if
+ * _other_bitarray_ is shorter, the bits past its end are cleared.
+ */
+static VALUE
+rb_bitarray_and_bang(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    bitarray_and(x_ba, y_ba);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.or!(other_bitarray)        -> bitarray
+ *
+ * In-place union---Sets every bit in _bitarray_ that is set in
+ * _other_bitarray_. The size of _bitarray_ does not change; if
+ * _other_bitarray_ is longer, the bits past the end of _bitarray_ are
+ * ignored.
+ */
+static VALUE
+rb_bitarray_or_bang(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    bitarray_or(x_ba, y_ba);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.xor!(other_bitarray)       -> bitarray
+ *
+ * In-place exclusive or---Toggles every bit in _bitarray_ that is set in
+ * _other_bitarray_. The size of _bitarray_ does not change; if
+ * _other_bitarray_ is longer, the bits past the end of _bitarray_ are
+ * ignored.
+ */
+static VALUE
+rb_bitarray_xor_bang(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    bitarray_xor(x_ba, y_ba);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.andnot!(other_bitarray)    -> bitarray
+ *
+ * In-place difference---Clears every bit in _bitarray_ that is set in
+ * _other_bitarray_. The size of _bitarray_ does not change.
+ */
+static VALUE
+rb_bitarray_andnot_bang(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    bitarray_andnot(x_ba, y_ba);
+    return x;
+}
+
+
+/* call-seq:
+ *      bitarray.intersect_count(other_bitarray)    -> int
+ *
+ * Returns the number of bits set in both BitArrays. This is the same as
+ * <code>(bitarray & other_bitarray).total_set</code>, but doesn't create a
+ * new BitArray.
+ */
+static VALUE
+rb_bitarray_intersect_count(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    return LONG2NUM(count_combined(WORD_AND, x_ba, y_ba));
+}
+
+
+/* call-seq:
+ *      bitarray.union_count(other_bitarray)        -> int
+ *
+ * Returns the number of bits set in either BitArray, like
+ * <code>(bitarray | other_bitarray).total_set</code>.
+ */
+static VALUE
+rb_bitarray_union_count(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    return LONG2NUM(count_combined(WORD_OR, x_ba, y_ba));
+}
+
+
+/* call-seq:
+ *      bitarray.xor_count(other_bitarray)      -> int
+ *      bitarray.hamming(other_bitarray)        -> int
+ *
+ * Returns the number of bits set in exactly one of the BitArrays (the Hamming
+ * distance between them), like <code>(bitarray ^ other_bitarray).total_set
+ * </code>.
+ */
+static VALUE
+rb_bitarray_xor_count(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    return LONG2NUM(count_combined(WORD_XOR, x_ba, y_ba));
+}
+
+
+/* call-seq:
+ *      bitarray.jaccard(other_bitarray)        -> float
+ *
+ * Returns the Jaccard index of the two BitArrays: the number of bits set in
+ * both, divided by the number of bits set in either. If neither has any bits
+ * set, returns 1.0.
+ */
+static VALUE
+rb_bitarray_jaccard(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    long either;
+    long both = count_and_or(x_ba, y_ba, &either);
+    return DBL2NUM(either == 0 ? 1.0 : (double)both / either);
+}
+
+
+/* call-seq:
+ *      bitarray.intersects?(other_bitarray)    -> true or false
+ *
+ * Returns true if any bit is set in both BitArrays. Stops looking as soon as
+ * it finds one.
+ */
+static VALUE
+rb_bitarray_intersects_p(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    return bitarray_intersects(x_ba, y_ba) ? Qtrue : Qfalse;
+}
+
+
+/* call-seq:
+ *      bitarray.subset_of?(other_bitarray)     -> true or false
+ *
+ * Returns true if every bit set in _bitarray_ is also set in
+ * _other_bitarray_; that is, if <code>(bitarray - other_bitarray)</code> has
+ * no bits set. Stops looking as soon as it finds a bit that isn't.
+ */
+static VALUE
+rb_bitarray_subset_of_p(VALUE x, VALUE y)
+{
+    struct bitarray *x_ba, *y_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+    y_ba = rb_bitarray_struct(y);
+
+    return bitarray_subset(x_ba, y_ba) ? Qtrue : Qfalse;
+}
+
+
+/* Helper for the multi-way class methods. Checks that list is a non-empty
+ * Array of BitArrays, and combines them.
+ */
+static VALUE
+rb_bitarray_multi(enum word_op_type op, VALUE list, long threshold)
+{
+    long i, n;
+
+    /* A copy of the list keeps the BitArrays alive while we work on them,
+     * whatever happens to the original.
+     */
+    list = rb_ary_dup(rb_convert_type(list, T_ARRAY, "Array", "to_ary"));
+    n = RARRAY_LEN(list);
+    if (n == 0) {
+        rb_raise(rb_eArgError, "no BitArrays given");
+    }
+    if (op == WORD_THRESHOLD && threshold < 1) {
+        rb_raise(rb_eArgError, "threshold must be at least 1");
+    }
+
+    /* The temporary buffer is freed by the GC if anything below raises. */
+    VALUE tmp = 0;
+    struct bitarray **bas = ALLOCV_N(struct bitarray *, tmp, n);
+    for (i = 0; i < n; i++) {
+        bas[i] = rb_bitarray_struct(RARRAY_AREF(list, i));
+    }
+
+    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *z_ba;
+    Data_Get_Struct(z, struct bitarray, z_ba);
+
+    initialize_bitarray_multi(z_ba, op, bas, n, threshold);
+
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(list);
+    return z;
+}
+
+
+/* call-seq:
+ *      BitArray.and_all(bitarrays)     -> a_bitarray
+ *
+ * Returns the intersection of all of the BitArrays in the Array _bitarrays_,
+ * as long as the shortest of them. This is the same as <code>a & b & c ...
+ * </code>, but goes through all of the BitArrays together in one pass, and
+ * only creates one new BitArray.
+ */
+static VALUE
+rb_bitarray_s_and_all(VALUE klass, VALUE list)
+{
+    return rb_bitarray_multi(WORD_AND_ALL, list, 0);
+}
+
+
+/* call-seq:
+ *      BitArray.or_all(bitarrays)      -> a_bitarray
+ *
+ * Returns the union of all of the BitArrays in the Array _bitarrays_, as long
+ * as the longest of them, in one pass like BitArray.and_all.
+ */
+static VALUE
+rb_bitarray_s_or_all(VALUE klass, VALUE list)
+{
+    return rb_bitarray_multi(WORD_OR_ALL, list, 0);
+}
+
+
+/* call-seq:
+ *      BitArray.threshold(bitarrays, t)    -> a_bitarray
+ *
+ * Returns a BitArray with the bits that are set in at least _t_ of the
+ * BitArrays in the Array _bitarrays_, as long as the longest of them. With
+ * _t_ of 1 this is the union, and with <code>bitarrays.size</code> it's the
+ * intersection (but as long as the longest BitArray).
+ *
+ *      a = BitArray.new("1100")
+ *      b = BitArray.new("1010")
+ *      c = BitArray.new("1001")
+ *      BitArray.threshold([a, b, c], 2)        => 1000
+ */
+static VALUE
+rb_bitarray_s_threshold(VALUE klass, VALUE list, VALUE t)
+{
+    return rb_bitarray_multi(WORD_THRESHOLD, list, NUM2LONG(t));
+}
+
+
+/* call-seq:
+ *      BitArray.majority(bitarrays)    -> a_bitarray
+ *
+ * Returns a BitArray with the bits that are set in more than half of the
+ * BitArrays in _bitarrays_. See BitArray.threshold.
+ */
+static VALUE
+rb_bitarray_s_majority(VALUE klass, VALUE list)
+{
+    list = rb_convert_type(list, T_ARRAY, "Array", "to_ary");
+    return rb_bitarray_multi(WORD_THRESHOLD, list, RARRAY_LEN(list) / 2 + 1);
+}
+
+
+/* call-seq:
+ *      bitarray.size           -> int
+ *      bitarray.length         -> int
+ *
+ * Returns the number of bits in _bitarray_.
+ */
+static VALUE
+rb_bitarray_size(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return LONG2NUM(bitarray_size(ba));
+}
+
+
+/* call-seq:
+ *      bitarray.resize(size)       -> bitarray
+ *
+ * Changes the size of _bitarray_. If it grows, the new bits are set to 0; if
+ * it shrinks, bits past the new end are removed. Storage is allocated ahead of
+ * time as _bitarray_ grows, so adding bits one at a time is cheap.
+ *
+ * Mapped BitArrays (see BitArray.mmap) can't be resized.
+ */
+static VALUE
+rb_bitarray_resize(VALUE self, VALUE size)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    resize_bitarray(ba, NUM2LONG(size));
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.push(value, ...)   -> bitarray
+ *      bitarray << value           -> bitarray
+ *
+ * Appends the given bits to the end of _bitarray_. Each _value_ must be 0
+ * or 1.
+ *
+ *   b = BitArray.new("10")
+ *   b << 1                             => 101
+ *   b.push(0, 0, 1)                    => 101001
+ */
+static VALUE
+rb_bitarray_push(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    int i;
+    for (i = 0; i < argc; i++) {
+        push_bit(ba, NUM2INT(argv[i]));
+    }
+    return self;
+}
+
+
+static VALUE
+rb_bitarray_append(VALUE self, VALUE value)
+{
+    return rb_bitarray_push(1, &value, self);
+}
+
+
+/* call-seq:
+ *      bitarray.pop                -> int or nil
+ *
+ * Removes the last bit from _bitarray_ and returns it, or returns +nil+ if
+ * _bitarray_ is empty.
+ */
+static VALUE
+rb_bitarray_pop(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    if (ba->bits == 0) {
+        bitarray_changed(ba);
+        return Qnil;
+    }
+
+    int bit = get_bit(ba, ba->bits - 1);
+    resize_bitarray(ba, ba->bits - 1);
+    return INT2FIX(bit);
+}
+
+
+/* Range helper-function prototype. This is defined after
+ * rb_bitarray_subseq.
+ */
+static void rb_bitarray_range_args(struct bitarray *ba, int argc, VALUE *argv,
+        long *beg, long *len);
+
+
+/* call-seq:
+ *      bitarray.total_set              -> int
+ *      bitarray.total_set(beg, len)    -> int
+ *      bitarray.total_set(range)       -> int
+ *
+ * Return the number of set (1) bits in _bitarray_. If _beg_ and _len_ or a
+ * _range_ are given, only the bits in that part of _bitarray_ are counted.
+ * This is the same as <code>bitarray[range].total_set</code>, but doesn't
+ * create a new BitArray.
+ */
+static VALUE
+rb_bitarray_total_set(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    if (argc == 0) {
+        return LONG2NUM(total_set(ba));
+    }
+
+    long beg, len;
+    rb_bitarray_range_args(ba, argc, argv, &beg, &len);
+    return LONG2NUM(total_set_range(ba, beg, len));
+}
+
+
+/* call-seq:
+ *      bitarray.set_bit(index)       -> bitarray
+ *
+ * Sets the bit at _index_ to 1. Negative indices count backwards from the end
+ * of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
+ * +IndexError+ is raised.
+ */
+static VALUE
+rb_bitarray_set_bit(VALUE self, VALUE index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+    
+    set_bit(ba, NUM2LONG(index));
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.set_all_bits           -> bitarray
+ *
+ * Sets all bits to 1.
+ */
+static VALUE
+rb_bitarray_set_all_bits(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    set_all_bits(ba);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.set_range(beg, len)   -> bitarray
+ *      bitarray.set_range(range)      -> bitarray
+ *
+ * Sets the _len_ bits starting at _beg_, or the bits in _range_, to 1.
+ * Negative indices count backwards from the end of _bitarray_, and a range
+ * that runs past the end stops there.
+ */
+static VALUE
+rb_bitarray_set_range(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long beg, len;
+    rb_bitarray_range_args(ba, argc, argv, &beg, &len);
+    range_op(ba, WORD_ONES, beg, len);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.clear_bit(index)       -> bitarray
+ *
+ * Sets the bit at _index_ to 0. Negative indices count backwards from the end
+ * of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
+ * +IndexError+ is raised.
+ */
+static VALUE
+rb_bitarray_clear_bit(VALUE self, VALUE index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    clear_bit(ba, NUM2LONG(index));
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.clear_all_bits         -> bitarray
+ *
+ * Sets all bits to 0.
+ */
+static VALUE
+rb_bitarray_clear_all_bits(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    clear_all_bits(ba);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.clear_range(beg, len)   -> bitarray
+ *      bitarray.clear_range(range)      -> bitarray
+ *
+ * Clears the _len_ bits starting at _beg_, or the bits in _range_, to 0.
+ * Negative indices count backwards from the end of _bitarray_, and a range
+ * that runs past the end stops there.
+ */
+static VALUE
+rb_bitarray_clear_range(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long beg, len;
+    rb_bitarray_range_args(ba, argc, argv, &beg, &len);
+    range_op(ba, WORD_ZERO, beg, len);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.toggle_bit(index)       -> bitarray
+ *
+ * Toggles the bit at _index_ to 0. Negative indices count backwards from the
+ * end of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
+ * +IndexError+ is raised.
+ */
+static VALUE
+rb_bitarray_toggle_bit(VALUE self, VALUE index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    toggle_bit(ba, NUM2LONG(index));
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.toggle_all_bits         -> bitarray
+ *
+ * Toggle all bits.
+ */
+static VALUE
+rb_bitarray_toggle_all_bits(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    toggle_all_bits(ba);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.toggle_range(beg, len)   -> bitarray
+ *      bitarray.toggle_range(range)      -> bitarray
+ *
+ * Toggles the _len_ bits starting at _beg_, or the bits in _range_.
+ * Negative indices count backwards from the end of _bitarray_, and a range
+ * that runs past the end stops there.
+ */
+static VALUE
+rb_bitarray_toggle_range(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long beg, len;
+    rb_bitarray_range_args(ba, argc, argv, &beg, &len);
+    range_op(ba, WORD_NOT, beg, len);
+    return self;
+}
+
+
+/* Bit-reference helper-function prototypes. These are defined after
+ * rb_bitarray_bitref.
+ */
+static inline VALUE rb_bitarray_get_bit(VALUE self, long index);
+static VALUE rb_bitarray_subseq(VALUE self, long beg, long len);
+
+
+/* call-seq:
+ *      bitarray[index]         -> value
+ *      bitarray[beg, len]      -> a_bitarray
+ *      bitarray[range]         -> a_bitarray
+ *
+ * Bit Reference---Returns the bit at _index_, or returns a subarray starting
+ * at _beg_, and continuing for _len_ bits, or returns a subarray specified by
+ * _range_.  _Negative indices count backwards from the end of _bitarray_. If
+ * _index_ is greater than the capacity of _bitarray_, an +IndexError+ is
+ * raised.
+ */
+static VALUE
+rb_bitarray_bitref(int argc, VALUE *argv, VALUE self)
+{
+    /* We follow a form similar to rb_ary_aref in array.c */
+
+    /* Two arguments means we have a beginning and a  length */
+    if (argc == 2) {
+        long beg = NUM2LONG(argv[0]);
+        long len = NUM2LONG(argv[1]);
+        return rb_bitarray_subseq(self, beg, len);
+    } 
+    
+    /* Make sure we have either 1 or 2 arguments. */
+    if (argc != 1) {
+        rb_scan_args(argc, argv, "11", 0, 0);
+    }
+
+    /* If we have a single argument, it can be either an index, or a range. */
+    VALUE arg = argv[0];
+    
+    /* rb_ary_aref treats a fixnum argument specially, for a speedup in the
+     * most common case. We'll do the same.
+     */
+    if (FIXNUM_P(arg)) {
+        return rb_bitarray_get_bit(self, FIX2LONG(arg));
+    }
+
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+    /* Next we see if arg is a range. rb_range_beg_len is defined in range.c
+     * If arg is not a range, it returns Qfalse. If arg is a range, but it
+     * refers to invalid indices, it returns Qnil. Otherwise, it sets beg and
+     * end to the appropriate values.
+     */
+    long beg, len;
+    switch (rb_range_beg_len(arg, &beg, &len, ba->bits, 0)) {
+        case Qfalse:
+            break;
+        case Qnil:
+            return Qnil;
+        default:
+            return rb_bitarray_subseq(self, beg, len);
+    }
+    
+    return rb_bitarray_get_bit(self, NUM2LONG(arg));
+}
+
+
+/* Return an individual bit. */
+static inline VALUE
+rb_bitarray_get_bit(VALUE self, long index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return INT2NUM(get_bit(ba, index));
+}
+
+
+/* Create a new BitArray from a subsequence of x. */
+static VALUE
+rb_bitarray_subseq(VALUE x, long beg, long len)
+{
+
+    struct bitarray *x_ba;
+    Data_Get_Struct(x, struct bitarray, x_ba);
+
+    /* Quick exit - a negative length, or a beginning past the end of the
+     * array returns nil.
+     */
+    if (beg < 0) {
+        beg += bitarray_size(x_ba);
+    }
+    if (len < 0 || beg < 0 || beg > bitarray_size(x_ba)) {
+        return Qnil;
+    }
+
+    /* Make sure that we don't try getting more bits than x has. We handle this
+     * the same way as Array; if beg+len is past the end of x, shorten len.
+     */
+    if (bitarray_size(x_ba) <  len ||  bitarray_size(x_ba) < (beg + len)) {
+        len = bitarray_size(x_ba) - beg;
+    }
+
+    /* Create a new BitArray with a copy of the bits. */
+    VALUE y = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *y_ba;
+    Data_Get_Struct(y, struct bitarray, y_ba);
+
+    initialize_bitarray_subseq(y_ba, x_ba, beg, len);
+
+    return y;
+}
+
+
+/* Get a starting index and a length from method arguments, which can be
+ * either (beg, len) or (range). Negative indices count from the end of the
+ * array, and a length that runs past the end of the array is shortened, as
+ * with rb_bitarray_subseq. Raises an IndexError or RangeError if the
+ * arguments don't refer to part of the array.
+ */
+static void
+rb_bitarray_range_args(struct bitarray *ba, int argc, VALUE *argv,
+        long *beg, long *len)
+{
+    VALUE arg1, arg2;
+    rb_scan_args(argc, argv, "11", &arg1, &arg2);
+
+    if (argc == 1) {
+        switch (rb_range_beg_len(arg1, beg, len, bitarray_size(ba), 0)) {
+            case Qfalse:
+                rb_raise(rb_eTypeError, "expected a range");
+            case Qnil:
+                rb_raise(rb_eRangeError, "range out of bit array");
+            default:
+                return;
+        }
+    }
+
+    *beg = NUM2LONG(arg1);
+    *len = NUM2LONG(arg2);
+    if (*beg < 0) {
+        *beg += bitarray_size(ba);
+    }
+    if (*beg < 0 || *beg > bitarray_size(ba) || *len < 0) {
+        rb_raise(rb_eIndexError, "index %ld, length %ld out of bit array",
+                NUM2LONG(arg1), *len);
+    }
+    if (bitarray_size(ba) - *beg < *len) {
+        *len = bitarray_size(ba) - *beg;
+    }
+}
+
+
+/* call-seq:
+ *      bitarray.view(beg, len)     -> a_bitarray
+ *      bitarray.view(range)        -> a_bitarray
+ *
+ * Returns a new BitArray with the same bits as
+ * <code>bitarray[beg, len]</code>, but without copying them: like a clone,
+ * it shares _bitarray_'s storage until one of them is changed. _beg_ must be
+ * a multiple of 64, and so must the end of the view, unless it's the end of
+ * _bitarray_. Otherwise an +ArgumentError+ is raised.
+ *
+ * A view keeps all of _bitarray_'s storage in memory until it's changed. A
+ * view of a mapped BitArray is an ordinary copy.
+ */
+static VALUE
+rb_bitarray_view(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long beg, len;
+    rb_bitarray_range_args(ba, argc, argv, &beg, &len);
+    if (beg % WORD_BITS != 0 ||
+            ((beg + len) % WORD_BITS != 0 && beg + len != ba->bits)) {
+        rb_raise(rb_eArgError, "view must start and end on a word boundary");
+    }
+    if (!ba->buffer || ba->locks) {
+        return rb_bitarray_subseq(self, beg, len);
+    }
+
+    VALUE obj = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *view_ba;
+    Data_Get_Struct(obj, struct bitarray, view_ba);
+
+    share_storage(view_ba, ba, beg / WORD_BITS, len);
+    return obj;
+}
+
+
+/* call-seq:
+ *      bitarray[index] = value         -> value
+ *      bitarray[beg, len] = value      -> value
+ *      bitarray[range] = value         -> value
+ *
+ * Bit Assignment---Sets the bit at _index_, the _len_ bits starting at _beg_,
+ * or the bits in _range_. _value_ must be 0 or 1. Negative indices are
+ * allowed, and will count backwards from the end of _bitarray_.
+ *
+ * If _index_ is greater than the capacity of _bitarray_, an +IndexError+ is
+ * raised. A range that runs past the end of _bitarray_ stops there. If
+ * _value_ is something other than 0 or 1, an +ArgumentError+ is raised.
+ *
+ *   b = BitArray.new(10)
+ *   b[2..5] = 1
+ *   b[4, 3] = 0                        => 0011000000
+ */
+static VALUE
+rb_bitarray_assign_bit(int argc, VALUE *argv, VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    if (argc == 2 && (FIXNUM_P(argv[0]) ||
+                !rb_obj_is_kind_of(argv[0], rb_cRange))) {
+        assign_bit(ba, NUM2LONG(argv[0]), NUM2INT(argv[1]));
+        return argv[1];
+    }
+    if (argc < 2 || argc > 3) {
+        rb_scan_args(argc, argv, "21", 0, 0, 0);
+    }
+
+    long beg, len;
+    VALUE value = argv[argc - 1];
+    rb_bitarray_range_args(ba, argc - 1, argv, &beg, &len);
+    assign_range(ba, beg, len, NUM2INT(value));
+    return value;
+}
+
+
+/* Convert a list of indices for the batch methods into a C array, checking
+ * each one. The list is an Array of Integers, or a String of packed native
+ * 64-bit integers (as made by <code>Array#pack("q*")</code>). The C array is
+ * a temporary buffer held by *tmp, which the caller frees with ALLOCV_END.
+ *
+ * Converting an element can call its to_int, which could resize the
+ * bitarray, so the indices are only checked once they've all been converted.
+ */
+static long *
+rb_bitarray_index_list(struct bitarray *ba, VALUE list, long *n, VALUE *tmp)
+{
+    long i, *indices;
+    if (RB_TYPE_P(list, T_STRING)) {
+        if (RSTRING_LEN(list) % sizeof(int64_t) != 0) {
+            rb_raise(rb_eArgError,
+                    "packed index string must be a multiple of 8 bytes");
+        }
+        *n = RSTRING_LEN(list) / sizeof(int64_t);
+        indices = rb_alloc_tmp_buffer(tmp, *n * sizeof(long));
+        for (i = 0; i < *n; i++) {
+            int64_t index;
+            memcpy(&index, RSTRING_PTR(list) + i * sizeof(int64_t),
+                    sizeof(int64_t));
+            indices[i] = (long)index;
+        }
+    } else {
+        list = rb_convert_type(list, T_ARRAY, "Array", "to_ary");
+        *n = RARRAY_LEN(list);
+        indices = rb_alloc_tmp_buffer(tmp, *n * sizeof(long));
+        for (i = 0; i < *n && i < RARRAY_LEN(list); i++) {
+            indices[i] = NUM2LONG(RARRAY_AREF(list, i));
+        }
+        *n = i;
+    }
+    for (i = 0; i < *n; i++) {
+        indices[i] = check_index(ba, indices[i]);
+    }
+    return indices;
+}
+
+
+/* call-seq:
+ *      bitarray.set_bits(indices)      -> bitarray
+ *
+ * Sets the bits at all of the given indices to 1. _indices_ is an Array of
+ * Integers, or a String of native 64-bit integers packed with
+ * <code>Array#pack("q*")</code>. Negative indices count backwards from the end
+ * of _bitarray_. If any index is out of range, an +IndexError+ is raised and
+ * no bits are changed.
+ *
+ * This is the same as calling set_bit for each index, but much faster for
+ * long lists.
+ */
+static VALUE
+rb_bitarray_set_bits(VALUE self, VALUE list)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE tmp = 0;
+    long n;
+    long *indices = rb_bitarray_index_list(ba, list, &n, &tmp);
+    set_bit_list(ba, indices, n);
+    ALLOCV_END(tmp);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.clear_bits(indices)    -> bitarray
+ *
+ * Sets the bits at all of the given indices to 0. See set_bits.
+ */
+static VALUE
+rb_bitarray_clear_bits(VALUE self, VALUE list)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE tmp = 0;
+    long n;
+    long *indices = rb_bitarray_index_list(ba, list, &n, &tmp);
+    clear_bit_list(ba, indices, n);
+    ALLOCV_END(tmp);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.get_bits(indices)      -> an_array
+ *
+ * Returns an Array of the bits at the given indices. See set_bits.
+ *
+ *      BitArray.new("0110").get_bits([2, 0, -1])     => [1, 0, 0]
+ */
+static VALUE
+rb_bitarray_get_bits(VALUE self, VALUE list)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE tmp = 0, bits_tmp = 0;
+    long i, n;
+    long *indices = rb_bitarray_index_list(ba, list, &n, &tmp);
+    unsigned char *bits = ALLOCV_N(unsigned char, bits_tmp, n);
+    get_bit_list(ba, indices, n, bits);
+
+    VALUE array = rb_ary_new2(n);
+    for (i = 0; i < n; i++) {
+        rb_ary_push(array, INT2FIX(bits[i]));
+    }
+    ALLOCV_END(tmp);
+    ALLOCV_END(bits_tmp);
+    return array;
+}
+
+
+/* call-seq:
+ *      bitarray.all_set?(indices)      -> true or false
+ *
+ * Returns true if the bits at all of the given indices are set, stopping at
+ * the first one that isn't. See set_bits.
+ */
+static VALUE
+rb_bitarray_all_set_p(VALUE self, VALUE list)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE tmp = 0;
+    long n;
+    long *indices = rb_bitarray_index_list(ba, list, &n, &tmp);
+    long found = find_bit_in_list(ba, indices, n, 0);
+    ALLOCV_END(tmp);
+    return found < 0 ? Qtrue : Qfalse;
+}
+
+
+/* call-seq:
+ *      bitarray.any_set?(indices)      -> true or false
+ *
+ * Returns true if the bit at any of the given indices is set, stopping at the
+ * first one that is. See set_bits.
+ */
+static VALUE
+rb_bitarray_any_set_p(VALUE self, VALUE list)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE tmp = 0;
+    long n;
+    long *indices = rb_bitarray_index_list(ba, list, &n, &tmp);
+    long found = find_bit_in_list(ba, indices, n, 1);
+    ALLOCV_END(tmp);
+    return found >= 0 ? Qtrue : Qfalse;
+}
+
+
+/* call-seq:
+ *      bitarray.inspect        -> string
+ *      bitarray.to_s           -> string
+ *
+ * Create a printable version of _bitarray_.
+ */
+static VALUE
+rb_bitarray_inspect(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE str = rb_str_new(NULL, bitarray_size(ba));
+    bitarray_to_chars(ba, RSTRING_PTR(str));
+    return str;
+}
+
+
+/* call-seq:
+ *      bitarray.to_a           -> an_array
+ *
+ * Creates a Ruby Array from bitarray.
+ */
+static VALUE
+rb_bitarray_to_a(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    /* rb_ary_new2 preallocates the whole array, so pushing is cheap. */
+    VALUE array = rb_ary_new2(bitarray_size(ba));
+    bitarray_to_values(ba, array);
+    return array;
+}
+
+
+/* Get the size argument of one of the BitArray.from_* methods. If it's nil,
+ * the size is max_bits; otherwise it must not be more than max_bits.
+ */
+static long
+rb_bitarray_size_arg(VALUE size, long max_bits)
+{
+    long bits = (NIL_P(size) ? max_bits : NUM2LONG(size));
+    if (bits < 0 || bits > max_bits) {
+        rb_raise(rb_eArgError, "%ld bits requested from a string of %ld bits",
+                bits, max_bits);
+    }
+    return bits;
+}
+
+
+/* call-seq:
+ *      bitarray.to_bytes       -> string
+ *
+ * Returns the bits of _bitarray_ packed into a binary String, eight to a
+ * byte. Bit +i+ is stored in byte <code>i / 8</code>, as the bit with value
+ * <code>1 << (i % 8)</code>. Any unused bits in the last byte are 0.
+ *
+ *      BitArray.new("1101000001").to_bytes     => "\v\x02"
+ *
+ * See also BitArray.from_bytes.
+ */
+static VALUE
+rb_bitarray_to_bytes(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE str = rb_str_new(NULL, bitarray_bytes(ba));
+    bitarray_to_bytes(ba, (unsigned char *)RSTRING_PTR(str));
+    return str;
+}
+
+
+/* call-seq:
+ *      BitArray.from_bytes(string)         -> a_bitarray
+ *      BitArray.from_bytes(string, size)   -> a_bitarray
+ *
+ * Creates a new BitArray from a String of packed bits, in the format used by
+ * BitArray#to_bytes. If _size_ is given, the BitArray will have that many
+ * bits, and _string_ must be long enough to hold them; otherwise every bit of
+ * _string_ is used.
+ */
+static VALUE
+rb_bitarray_s_from_bytes(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE string, size;
+    rb_scan_args(argc, argv, "11", &string, &size);
+    StringValue(string);
+
+    long bits = rb_bitarray_size_arg(size, RSTRING_LEN(string) * CHAR_BIT);
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_bytes(ba, (unsigned char *)RSTRING_PTR(string), bits);
+    return obj;
+}
+
+
+/* call-seq:
+ *      BitArray.mmap(path)             -> a_bitarray
+ *      BitArray.mmap(path, mode)       -> a_bitarray
+ *
+ * Creates a BitArray backed by the file at _path_, which is mapped into
+ * memory rather than read. The file holds packed bits in the format used by
+ * BitArray#to_bytes, and every bit of it is used, so the new BitArray has
+ * eight bits for each byte of the file.
+ *
+ * _mode_ is either <code>"r"</code> (the default) or <code>"r+"</code>. A
+ * BitArray mapped with <code>"r"</code> is frozen. With <code>"r+"</code>,
+ * changes to the BitArray are written back to the file, and are visible to
+ * every process that has it mapped. Use #sync to make sure they have reached
+ * the disk.
+ *
+ * Because the pages are shared, mapping the same file in many processes costs
+ * no more memory than mapping it in one.
+ *
+ *      File.open("filter.bits", "wb") {|f| f.write(ba.to_bytes) }
+ *      shared = BitArray.mmap("filter.bits")
+ */
+static VALUE
+rb_bitarray_s_mmap(int argc, VALUE *argv, VALUE klass)
+{
+#if defined(HAVE_SYS_MMAN_H) && !defined(WORDS_BIGENDIAN)
+    VALUE path, mode;
+    rb_scan_args(argc, argv, "11", &path, &mode);
+    FilePathValue(path);
+
+    int writable;
+    const char *mode_str = (NIL_P(mode) ? "r" : StringValueCStr(mode));
+    if (strcmp(mode_str, "r") == 0) {
+        writable = 0;
+    } else if (strcmp(mode_str, "r+") == 0) {
+        writable = 1;
+    } else {
+        rb_raise(rb_eArgError, "invalid mmap mode %s", mode_str);
+    }
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    int fd = open(RSTRING_PTR(path), (writable ? O_RDWR : O_RDONLY));
+    if (fd < 0) {
+        rb_sys_fail(RSTRING_PTR(path));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        rb_sys_fail(RSTRING_PTR(path));
+    }
+    if ((uint64_t)st.st_size > (uint64_t)LONG_MAX / CHAR_BIT) {
+        close(fd);
+        rb_raise(rb_eArgError, "%s is too large", RSTRING_PTR(path));
+    }
+
+    /* An empty file can't be mapped, but it's a perfectly good empty
+     * BitArray.
+     */
+    void *p = NULL;
+    if (st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                MAP_SHARED, fd, 0);
+    }
+    int e = errno;
+    close(fd);
+    if (p == MAP_FAILED) {
+        errno = e;
+        rb_sys_fail(RSTRING_PTR(path));
+    }
+
+    initialize_bitarray_mapped(ba, p, st.st_size, writable);
+    if (!writable) {
+        OBJ_FREEZE(obj);
+    }
+
+    return obj;
+#else
+    rb_notimplement();
+    return Qnil;
+#endif
+}
+
+
+/* call-seq:
+ *      bitarray.sync       -> bitarray
+ *
+ * If _bitarray_ was created with BitArray.mmap, waits until any changes have
+ * been written to the file. Otherwise, does nothing.
+ */
+static VALUE
+rb_bitarray_sync(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    sync_bitarray(ba);
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.to_hex     -> string
+ *
+ * Returns the bits of _bitarray_ as a String of hex digits, two for each
+ * byte of BitArray#to_bytes. This is the same as
+ * <code>bitarray.to_bytes.unpack("H*").first</code>.
+ *
+ *      BitArray.new("1101000001").to_hex       => "0b02"
+ */
+static VALUE
+rb_bitarray_to_hex(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE str = rb_usascii_str_new(NULL, 2 * bitarray_bytes(ba));
+    bitarray_to_hex(ba, RSTRING_PTR(str));
+    return str;
+}
+
+
+/* call-seq:
+ *      BitArray.from_hex(string)           -> a_bitarray
+ *      BitArray.from_hex(string, size)     -> a_bitarray
+ *
+ * Creates a new BitArray from a String of hex digits, in the format used by
+ * BitArray#to_hex. If _size_ is given, the BitArray will have that many bits;
+ * otherwise it has four for each digit. _string_ must have an even number of
+ * digits.
+ */
+static VALUE
+rb_bitarray_s_from_hex(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE string, size;
+    rb_scan_args(argc, argv, "11", &string, &size);
+    StringValue(string);
+
+    long len = RSTRING_LEN(string);
+    if (len % 2 != 0) {
+        rb_raise(rb_eArgError, "hex string has an odd number of digits");
+    }
+    long bits = rb_bitarray_size_arg(size, len / 2 * CHAR_BIT);
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_hex(ba, RSTRING_PTR(string), len, bits);
+    return obj;
+}
+
+
+/* call-seq:
+ *      bitarray.to_base64      -> string
+ *
+ * Returns the bytes of BitArray#to_bytes encoded as strict Base64 (as with
+ * <code>pack("m0")</code>).
+ */
+static VALUE
+rb_bitarray_to_base64(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE str = rb_usascii_str_new(NULL, base64_size(bitarray_bytes(ba)));
+    bitarray_to_base64(ba, RSTRING_PTR(str));
+    return str;
+}
+
+
+/* call-seq:
+ *      BitArray.from_base64(string)        -> a_bitarray
+ *      BitArray.from_base64(string, size)  -> a_bitarray
+ *
+ * Creates a new BitArray from a strict Base64 String, in the format used by
+ * BitArray#to_base64. If _size_ is given, the BitArray will have that many
+ * bits; otherwise it has eight for each decoded byte.
+ */
+static VALUE
+rb_bitarray_s_from_base64(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE string, size;
+    rb_scan_args(argc, argv, "11", &string, &size);
+    StringValue(string);
+
+    long len = RSTRING_LEN(string);
+    long decoded = base64_decoded_size(RSTRING_PTR(string), len);
+    if (decoded < 0) {
+        rb_raise(rb_eArgError, "invalid base64 string");
+    }
+    long bits = rb_bitarray_size_arg(size, decoded * CHAR_BIT);
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_base64(ba, RSTRING_PTR(string), len, bits);
+    return obj;
+}
+
+
+/* call-seq:
+ *      bitarray.to_ewah        -> string
+ *
+ * Returns a binary String holding _bitarray_ compressed with EWAH, which
+ * replaces runs of 64 zeros or 64 ones with a count. BitArrays that are mostly
+ * long runs of either value compress very well. BitArray.ewah_and,
+ * BitArray.ewah_or and BitArray.ewah_total_set work on the compressed form
+ * directly, and BitArray.from_ewah turns it back into a BitArray.
+ */
+static VALUE
+rb_bitarray_to_ewah(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return bitarray_to_ewah(ba);
+}
+
+
+/* call-seq:
+ *      BitArray.from_ewah(string)      -> a_bitarray
+ *
+ * Creates a new BitArray from a String made by BitArray#to_ewah,
+ * BitArray.ewah_and or BitArray.ewah_or. Raises an ArgumentError if the string
+ * isn't a valid EWAH stream.
+ */
+static VALUE
+rb_bitarray_s_from_ewah(VALUE klass, VALUE string)
+{
+    struct ewah_reader r;
+    StringValue(string);
+    long bits = ewah_reader_init(&r, string);
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_ewah(ba, &r, bits);
+    RB_GC_GUARD(string);
+    return obj;
+}
+
+
+/* Helper for ewah_and and ewah_or. */
+static VALUE
+rb_bitarray_ewah_combine(enum word_op_type op, VALUE x, VALUE y)
+{
+    struct ewah_reader x_r, y_r;
+    struct ewah_writer w;
+    StringValue(x);
+    StringValue(y);
+    long x_bits = ewah_reader_init(&x_r, x);
+    long y_bits = ewah_reader_init(&y_r, y);
+
+    if (op == WORD_AND) {
+        ewah_writer_init(&w, (x_bits < y_bits ? x_bits : y_bits));
+    } else {
+        ewah_writer_init(&w, (x_bits > y_bits ? x_bits : y_bits));
+    }
+    ewah_combine(op, &w, &x_r, &y_r);
+
+    RB_GC_GUARD(x);
+    RB_GC_GUARD(y);
+    return ewah_writer_finish(&w);
+}
+
+
+/* call-seq:
+ *      BitArray.ewah_and(string, other_string)     -> string
+ *
+ * Returns the intersection of two EWAH-compressed BitArrays (see
+ * BitArray#to_ewah), also compressed. It's the same as
+ * <code>(BitArray.from_ewah(string) & BitArray.from_ewah(other)).to_ewah</code>,
+ * but works a run or a block of literal words at a time, without
+ * decompressing anything.
+ */
+static VALUE
+rb_bitarray_s_ewah_and(VALUE klass, VALUE x, VALUE y)
+{
+    return rb_bitarray_ewah_combine(WORD_AND, x, y);
+}
+
+
+/* call-seq:
+ *      BitArray.ewah_or(string, other_string)      -> string
+ *
+ * Returns the union of two EWAH-compressed BitArrays, also compressed, like
+ * BitArray.ewah_and.
+ */
+static VALUE
+rb_bitarray_s_ewah_or(VALUE klass, VALUE x, VALUE y)
+{
+    return rb_bitarray_ewah_combine(WORD_OR, x, y);
+}
+
+
+/* call-seq:
+ *      BitArray.ewah_total_set(string)     -> int
+ *
+ * Returns the number of set bits in an EWAH-compressed BitArray, without
+ * decompressing it.
+ */
+static VALUE
+rb_bitarray_s_ewah_total_set(VALUE klass, VALUE string)
+{
+    struct ewah_reader r;
+    StringValue(string);
+    ewah_reader_init(&r, string);
+
+    long count = ewah_total_set(&r);
+    RB_GC_GUARD(string);
+    return LONG2NUM(count);
+}
+
+
+/* Marshal support. A dumped BitArray is its size as a little-endian 64-bit
+ * number, followed by the output of to_bytes.
+ */
+#define DUMP_HEADER_BYTES 8
+
+
+/* :nodoc: */
+static VALUE
+rb_bitarray_dump(VALUE self, VALUE level)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE str = rb_str_new(NULL, DUMP_HEADER_BYTES + bitarray_bytes(ba));
+    unsigned char *p = (unsigned char *)RSTRING_PTR(str);
+    int i;
+    for (i = 0; i < DUMP_HEADER_BYTES; i++) {
+        p[i] = (unsigned char)((uint64_t)bitarray_size(ba) >> (i * CHAR_BIT));
+    }
+    bitarray_to_bytes(ba, p + DUMP_HEADER_BYTES);
+    return str;
+}
+
+
+/* :nodoc: */
+static VALUE
+rb_bitarray_s_load(VALUE klass, VALUE str)
+{
+    StringValue(str);
+    if (RSTRING_LEN(str) < DUMP_HEADER_BYTES) {
+        rb_raise(rb_eTypeError, "marshaled BitArray is too short");
+    }
+
+    const unsigned char *p = (const unsigned char *)RSTRING_PTR(str);
+    uint64_t bits = 0;
+    int i;
+    for (i = 0; i < DUMP_HEADER_BYTES; i++) {
+        bits |= (uint64_t)p[i] << (i * CHAR_BIT);
+    }
+    if (bits > (uint64_t)(RSTRING_LEN(str) - DUMP_HEADER_BYTES) * CHAR_BIT) {
+        rb_raise(rb_eTypeError, "marshaled BitArray is too short");
+    }
+
+    VALUE obj = rb_bitarray_alloc(klass);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_bytes(ba, p + DUMP_HEADER_BYTES, (long)bits);
+    return obj;
+}
+
+
+/* call-seq:
+ *      bitarray.each {|bit| block }        -> bitarray
+ *
+ * Calls +block+ once for each bit in _bitarray_, passing that bit as a
+ * parameter.
+ *
+ *      ba = BitArray.new(10)
+ *      ba.each {|bit| print bit, " " }
+ *
+ * produces:
+ *
+ *      0 0 0 0 0 0 0 0 0 0
+ */
+static VALUE
+rb_bitarray_each(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long i;
+
+    RETURN_ENUMERATOR(self, 0, 0);
+    for (i = 0; i < bitarray_size(ba); i++) {
+        int bit_value = get_bit(ba, i);
+        rb_yield(INT2NUM(bit_value));
+    }
+    return self;
+}
+
+
+/* Convert the result of one of the bit-searching functions to a Ruby
+ * value.
+ */
+#define index_or_nil(index) ((index) < 0 ? Qnil : LONG2NUM(index))
+
+
+/* call-seq:
+ *      bitarray.each_set_bit {|index| block }      -> bitarray
+ *
+ * Calls +block+ once for each set bit in _bitarray_, passing the index of
+ * that bit as a parameter. Runs of clear bits are skipped a word at a time,
+ * so this is much faster than +each+ for sparse BitArrays.
+ *
+ *      ba = BitArray.new("0100100001")
+ *      ba.each_set_bit {|i| print i, " " }
+ *
+ * produces:
+ *
+ *      1 4 9
+ */
+static VALUE
+rb_bitarray_each_set_bit(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    RETURN_ENUMERATOR(self, 0, 0);
+    long i;
+    for (i = next_set_bit(ba, 0); i >= 0; i = next_set_bit(ba, i + 1)) {
+        rb_yield(LONG2NUM(i));
+    }
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.each_clear_bit {|index| block }    -> bitarray
+ *
+ * Calls +block+ once for each clear bit in _bitarray_, passing the index of
+ * that bit as a parameter.
+ */
+static VALUE
+rb_bitarray_each_clear_bit(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    RETURN_ENUMERATOR(self, 0, 0);
+    long i;
+    for (i = next_clear_bit(ba, 0); i >= 0; i = next_clear_bit(ba, i + 1)) {
+        rb_yield(LONG2NUM(i));
+    }
+    return self;
+}
+
+
+/* call-seq:
+ *      bitarray.first_set      -> int or nil
+ *
+ * Returns the index of the first set bit in _bitarray_, or +nil+ if no bits
+ * are set.
+ */
+static VALUE
+rb_bitarray_first_set(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return index_or_nil(next_set_bit(ba, 0));
+}
+
+
+/* call-seq:
+ *      bitarray.next_set(index)        -> int or nil
+ *
+ * Returns the index of the first set bit at or after _index_, or +nil+ if
+ * there isn't one. Negative indices count backwards from the end of
+ * _bitarray_.
+ */
+static VALUE
+rb_bitarray_next_set(VALUE self, VALUE index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long from = NUM2LONG(index);
+    if (from < 0) {
+        from += bitarray_size(ba);
+    }
+    return index_or_nil(next_set_bit(ba, from));
+}
+
+
+/* call-seq:
+ *      bitarray.last_set       -> int or nil
+ *
+ * Returns the index of the last set bit in _bitarray_, or +nil+ if no bits
+ * are set.
+ */
+static VALUE
+rb_bitarray_last_set(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return index_or_nil(last_set_bit(ba));
+}
+
+
+/* call-seq:
+ *      bitarray.rank(index)        -> int
+ *
+ * Returns the number of set bits before _index_; that is, in
+ * <code>bitarray[0, index]</code>. _index_ may be anywhere from 0 to the size
+ * of _bitarray_. Negative indices count backwards from the end of
+ * _bitarray_.
+ *
+ * The first call builds an index of bit counts, which takes about 3% as
+ * much memory as the bits themselves. After that, each call takes
+ * constant time until _bitarray_ is changed.
+ */
+static VALUE
+rb_bitarray_rank(VALUE self, VALUE index)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    long i = NUM2LONG(index);
+    if (i < 0) {
+        i += bitarray_size(ba);
+    }
+    if (i < 0 || i > bitarray_size(ba)) {
+        rb_raise(rb_eIndexError, "index %ld out of bit array", NUM2LONG(index));
+    }
+
+    return LONG2NUM(rank(ba, i));
+}
+
+
+/* call-seq:
+ *      bitarray.select(k)                  -> int or nil
+ *      bitarray.select {|bit| block }      -> an_array
+ *
+ * With an argument, returns the index of the set bit with rank _k_ (so
+ * <code>select(0)</code> is the first set bit), or +nil+ if there are not
+ * that many set bits. For any set bit at index +i+,
+ * <code>select(rank(i)) == i</code>. This uses the same index as +rank+.
+ *
+ * With a block and no arguments, behaves like Enumerable#select.
+ *
+ *      ba = BitArray.new("0110001")
+ *      ba.select(2)                        => 6
+ *      ba.select {|bit| bit == 1 }         => [1, 1, 1]
+ */
+static VALUE
+rb_bitarray_select(int argc, VALUE *argv, VALUE self)
+{
+    if (argc == 0) {
+        return rb_call_super(argc, argv);
+    }
+
+    VALUE k;
+    rb_scan_args(argc, argv, "1", &k);
+
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    return index_or_nil(select_bit(ba, NUM2LONG(k)));
+}
+
+
+/* call-seq:
+ *      bitarray.to_indices     -> an_array
+ *
+ * Returns an Array of the indices of the set bits in _bitarray_, in
+ * ascending order.
+ *
+ *      BitArray.new("0100100001").to_indices   => [1, 4, 9]
+ */
+static VALUE
+rb_bitarray_to_indices(VALUE self)
+{
+    struct bitarray *ba;
+    Data_Get_Struct(self, struct bitarray, ba);
+
+    VALUE indices = rb_ary_new2(total_set(ba));
+    long i;
+    for (i = next_set_bit(ba, 0); i >= 0; i = next_set_bit(ba, i + 1)) {
+        rb_ary_push(indices, LONG2NUM(i));
+    }
+    return indices;
+}
+
+
+/* call-seq:
+ *      BitArray.parallelism        -> int
+ *
+ * Returns the number of threads used for operations on very large BitArrays.
+ * See BitArray.parallelism=.
+ */
+static VALUE
+rb_bitarray_s_parallelism(VALUE klass)
+{
+    return INT2NUM(parallelism);
+}
+
+
+/* call-seq:
+ *      BitArray.parallelism = n    -> n
+ *
+ * Sets the number of threads used for operations on very large BitArrays
+ * (a few megabytes or more). Each operation is split into chunks, which are
+ * shared out between the calling thread and n - 1 worker threads. The
+ * default is 1, which means everything runs in the calling thread.
+ *
+ * The worker threads are shared by the whole process, and only work on one
+ * operation at a time; if they are busy, other operations run in their
+ * calling threads as usual.
+ */
+static VALUE
+rb_bitarray_s_set_parallelism(VALUE klass, VALUE n)
+{
+    int threads = NUM2INT(n);
+    if (threads < 1 || threads > PARALLELISM_MAX) {
+        rb_raise(rb_eArgError, "parallelism must be between 1 and %d",
+                PARALLELISM_MAX);
+    }
+
+    set_parallelism(threads);
+    return n;
+}
+
+
+/* Document-class: CompressedBitArray
+ *
+ * A compressed array of bits, for very large arrays with few bits set, or
+ * with the set bits in long runs. It is split into chunks of 65536 bits, and
+ * stores each chunk that has any bits set as a sorted list of offsets, a
+ * plain bitmap, or a list of runs, whichever is smallest. Chunks with no bits
+ * set take no space at all.
+ *
+ * CompressedBitArray has the core of the BitArray interface: [], []=,
+ * set_bit, clear_bit, total_set, &, |, each, each_set_bit and to_indices.
+ * Use CompressedBitArray.new(bitarray) and to_bitarray to convert between the
+ * two.
+ */
+
+
+/* This gets called when a CompressedBitArray is garbage collected. */
+static void
+rb_compressed_free(struct compressed_bitarray *cb)
+{
+    if (cb) {
+        free_compressed_bitarray(cb);
+    }
+    ruby_xfree(cb);
+}
+
+
+/* Allocate a new CompressedBitArray. */
+static VALUE
+rb_compressed_alloc(VALUE klass)
+{
+    struct compressed_bitarray *cb;
+    return Data_Make_Struct(klass, struct compressed_bitarray, NULL,
+            rb_compressed_free, cb);
+}
+
+
+/* Get the compressed bitarray from a CompressedBitArray, raising a TypeError
+ * if it's something else.
+ */
+static struct compressed_bitarray *
+rb_compressed_struct(VALUE obj)
+{
+    struct compressed_bitarray *cb;
+    if (!rb_obj_is_kind_of(obj, rb_compressed_class)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected %s)",
+                rb_obj_classname(obj), rb_class2name(rb_compressed_class));
+    }
+    Data_Get_Struct(obj, struct compressed_bitarray, cb);
+    return cb;
+}
+
+
+/* call-seq:
+ *      CompressedBitArray.new(size)
+ *      CompressedBitArray.new(bitarray)
+ *
+ * When called with a size, creates a new CompressedBitArray of the specified
+ * size, with all bits cleared. When called with a BitArray, creates a new
+ * CompressedBitArray with the same bits.
+ */
+static VALUE
+rb_compressed_initialize(VALUE self, VALUE arg)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+    free_compressed_bitarray(cb);
+
+    if (rb_obj_is_kind_of(arg, rb_bitarray_class)) {
+        struct bitarray *ba;
+        Data_Get_Struct(arg, struct bitarray, ba);
+        initialize_compressed_bitarray(cb, ba);
+    } else {
+        long size = NUM2LONG(arg);
+        cb->bits = (size <= 0 ? 0 : size);
+    }
+    return self;
+}
+
+
+/* call-seq:
+ *      compressed.clone        -> a_compressed_bitarray
+ *      compressed.dup          -> a_compressed_bitarray
+ *
+ * Produces a copy of _compressed_.
+ */
+static VALUE
+rb_compressed_initialize_copy(VALUE self, VALUE orig)
+{
+    struct compressed_bitarray *new_cb, *orig_cb;
+    Data_Get_Struct(self, struct compressed_bitarray, new_cb);
+    orig_cb = rb_compressed_struct(orig);
+
+    free_compressed_bitarray(new_cb);
+    initialize_compressed_copy(new_cb, orig_cb);
+    return self;
+}
+
+
+/* call-seq:
+ *      compressed.size         -> int
+ *      compressed.length       -> int
  *
- * 1. 0, false, or nil  => 0
- * 2. anything else     => 1
+ * Returns the number of bits in _compressed_.
+ */
+static VALUE
+rb_compressed_size(VALUE self)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+
+    return LONG2NUM(cb->bits);
+}
+
+
+/* call-seq:
+ *      compressed.total_set    -> int
  *
- * Note that the 0 is a number, not a string. "Anything else" means strings,
- * symbols, non-zero numbers, subarrays, etc.
+ * Returns the number of set (1) bits in _compressed_. Each container keeps
+ * its own count, so this doesn't look at the bits.
+ */
+static VALUE
+rb_compressed_total_set(VALUE self)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+
+    return LONG2NUM(compressed_total_set(cb));
+}
+
+
+/* call-seq:
+ *      compressed.set_bit(index)       -> compressed
  *
- *   b = BitArray.new([0,0,0,1,1,0])            => 000110
- *   b = BitArray.new([false, true, false])     => 010
- *   b = BitArray.new([:a, :b, :c, [:d, :e]])   => 1111
+ * Sets the bit at _index_ to 1. Negative indices count backwards from the end
+ * of _compressed_. If _index_ is out of range, an +IndexError+ is raised.
  */
 static VALUE
-rb_bitarray_initialize(VALUE self, VALUE arg)
+rb_compressed_set_bit(VALUE self, VALUE index)
 {
-    if (TYPE(arg) == T_FIXNUM || TYPE(arg) == T_BIGNUM) {
-        struct bitarray *ba;
-        Data_Get_Struct(self, struct bitarray, ba);
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
 
-        initialize_bitarray(ba, NUM2LONG(arg));
-    
-        return self;
+    compressed_set_bit(cb, NUM2LONG(index));
+    return self;
+}
 
-    } else if (TYPE(arg) == T_STRING) {
-        return rb_bitarray_from_string(self, arg);
-    } else if (TYPE(arg) == T_ARRAY) { 
-        return rb_bitarray_from_array(self, arg);
-    } else {
-        rb_raise(rb_eArgError, "must be size, string, or array");
-    }
+
+/* call-seq:
+ *      compressed.clear_bit(index)     -> compressed
+ *
+ * Sets the bit at _index_ to 0. Negative indices count backwards from the end
+ * of _compressed_. If _index_ is out of range, an +IndexError+ is raised.
+ */
+static VALUE
+rb_compressed_clear_bit(VALUE self, VALUE index)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+
+    compressed_clear_bit(cb, NUM2LONG(index));
+    return self;
 }
 
 
-/* Create a new BitArray from a string. Called by rb_bitarray_initialize. */
+/* call-seq:
+ *      compressed[index]           -> value
+ *
+ * Bit Reference---Returns the bit at _index_. Negative indices count
+ * backwards from the end of _compressed_. If _index_ is out of range, an
+ * +IndexError+ is raised.
+ */
 static VALUE
-rb_bitarray_from_string(VALUE self, VALUE string)
+rb_compressed_bitref(VALUE self, VALUE index)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
 
-    /* Extract a C-string from arg. */
-    long str_len = RSTRING_LEN(string) + 1;
-    char cstr[str_len];
-    strncpy(cstr, StringValueCStr(string), str_len);
+    return INT2FIX(compressed_get_bit(cb, NUM2LONG(index)));
+}
 
-    /* If the string doesn't begin with a '1' or '0', return an empty
-     * BitArray.
-     */
-    if (cstr[0] != '0' && cstr[0] != '1') {
-        initialize_bitarray(ba, 0);
-        return self;
-    }
 
-    /* Otherwise, loop through the string and truncate it at the first invalid
-     * character.
-     */
-    long i;
-    for (i = 0; i < str_len; i++) {
-        if (cstr[i] != '0' && cstr[i] != '1') {
-            cstr[i] = '\0';
-            break;
-        }
+/* call-seq:
+ *      compressed[index] = value   -> value
+ *
+ * Bit Assignment---Sets the bit at _index_. _value_ must be 0 or 1.
+ */
+static VALUE
+rb_compressed_assign_bit(VALUE self, VALUE index, VALUE value)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+
+    int bit = NUM2INT(value);
+    if (bit == 0) {
+        compressed_clear_bit(cb, NUM2LONG(index));
+    } else if (bit == 1) {
+        compressed_set_bit(cb, NUM2LONG(index));
+    } else {
+        rb_raise(rb_eArgError, "bit value %d out of range", bit);
     }
+    return value;
+}
 
-    /* Setup the BitArray structure. */
-    initialize_bitarray(ba, strlen(cstr));
 
-    /* Initialize the bit array with the string. */
-    for (i = 0; i < ba->bits; i++) {
-        if (cstr[i] == '0') {
-            clear_bit(ba, i);
-        } else {
-            set_bit(ba, i);
-        }
-    }
+/* call-seq:
+ *      compressed & other      -> a_compressed_bitarray
+ *
+ * Intersection---Return a new CompressedBitArray from the intersection of the
+ * two CompressedBitArrays. The new one will have the same length as the
+ * shorter of the two originals.
+ */
+static VALUE
+rb_compressed_intersect(VALUE x, VALUE y)
+{
+    struct compressed_bitarray *x_cb, *y_cb, *z_cb;
+    Data_Get_Struct(x, struct compressed_bitarray, x_cb);
+    y_cb = rb_compressed_struct(y);
 
-    return self;
+    VALUE z = rb_compressed_alloc(rb_compressed_class);
+    Data_Get_Struct(z, struct compressed_bitarray, z_cb);
+
+    initialize_compressed_intersect(z_cb, x_cb, y_cb);
+    return z;
 }
 
 
-/* Create a new BitArray from an Array. Called by rb_bitarray_initialize */
+/* call-seq:
+ *      compressed | other      -> a_compressed_bitarray
+ *
+ * Union---Return a new CompressedBitArray from the union of the two
+ * CompressedBitArrays. The new one will have the same length as the longer of
+ * the two originals.
+ */
 static VALUE
-rb_bitarray_from_array(VALUE self, VALUE array)
+rb_compressed_union(VALUE x, VALUE y)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct compressed_bitarray *x_cb, *y_cb, *z_cb;
+    Data_Get_Struct(x, struct compressed_bitarray, x_cb);
+    y_cb = rb_compressed_struct(y);
+
+    VALUE z = rb_compressed_alloc(rb_compressed_class);
+    Data_Get_Struct(z, struct compressed_bitarray, z_cb);
+
+    initialize_compressed_union(z_cb, x_cb, y_cb);
+    return z;
+}
+
 
-    long size = RARRAY_LEN(array);
-    initialize_bitarray(ba, size);
+/* call-seq:
+ *      compressed.each {|bit| block }      -> compressed
+ *
+ * Calls <code>block</code> once for each bit in _compressed_, passing that
+ * bit as a parameter, like BitArray#each. Use each_set_bit to visit only the
+ * set bits.
+ */
+static VALUE
+rb_compressed_each(VALUE self)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
 
-    VALUE e;
     long i;
-    for (i = 0; i < size; i++) {
-        e = rb_ary_entry(array, i);
 
-        switch (TYPE(e)) {
-            case T_FIXNUM:      /* fixnums and bignums treated the same. */
-            case T_BIGNUM:
-                NUM2LONG(e) == 0l ? clear_bit(ba, i) : set_bit(ba, i);
-                break;
-            case T_FALSE:       /* false and nil treated the same. */
-            case T_NIL:
-                clear_bit(ba, i);
-                break;
-            default:
-                set_bit(ba, i);
-        }
+    RETURN_ENUMERATOR(self, 0, 0);
+    for (i = 0; i < cb->bits; i++) {
+        rb_yield(INT2FIX(compressed_get_bit(cb, i)));
     }
-
     return self;
 }
 
 
 /* call-seq:
- *      bitarray.clone          -> a_bitarray
- *      bitarray.dup            -> a_bitarray
+ *      compressed.each_set_bit {|index| block }    -> compressed
  *
- * Produces a copy of _bitarray_.
+ * Calls +block+ once for each set bit in _compressed_, passing the index of
+ * that bit, in ascending order.
  */
 static VALUE
-rb_bitarray_initialize_copy(VALUE self, VALUE orig)
+rb_compressed_each_set_bit(VALUE self)
 {
-    struct bitarray *new_ba, *orig_ba;
-    Data_Get_Struct(self, struct bitarray, new_ba);
-    Data_Get_Struct(orig, struct bitarray, orig_ba);
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
 
-    initialize_bitarray_copy(new_ba, orig_ba);
+    long i;
 
+    RETURN_ENUMERATOR(self, 0, 0);
+    for (i = compressed_next_set_bit(cb, 0); i >= 0;
+            i = compressed_next_set_bit(cb, i + 1)) {
+        rb_yield(LONG2NUM(i));
+    }
     return self;
 }
 
 
 /* call-seq:
- *      bitarray + other_bitarray       -> a_bitarray
+ *      compressed.to_indices   -> an_array
  *
- * Concatenation---Return a new BitArray built by concatenating the two
- * BitArrays.
+ * Returns an Array of the indices of the set bits in _compressed_, in
+ * ascending order.
  */
 static VALUE
-rb_bitarray_concat(VALUE x, VALUE y)
+rb_compressed_to_indices(VALUE self)
 {
-    /* Get the bitarrays from x and y */
-    struct bitarray *x_ba, *y_ba;
-    Data_Get_Struct(x, struct bitarray, x_ba);
-    Data_Get_Struct(y, struct bitarray, y_ba);
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
 
-    /* Create a new BitArray, and its bitarray structure*/
-    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
-    struct bitarray *z_ba;
-    Data_Get_Struct(z, struct bitarray, z_ba);
+    VALUE indices = rb_ary_new2(compressed_total_set(cb));
+    long i;
+    for (i = compressed_next_set_bit(cb, 0); i >= 0;
+            i = compressed_next_set_bit(cb, i + 1)) {
+        rb_ary_push(indices, LONG2NUM(i));
+    }
+    return indices;
+}
 
-    initialize_bitarray_concat(z_ba, x_ba, y_ba);
 
-    return z;
+/* call-seq:
+ *      compressed.to_bitarray  -> a_bitarray
+ *
+ * Returns a BitArray with the same bits as _compressed_.
+ */
+static VALUE
+rb_compressed_to_bitarray(VALUE self)
+{
+    struct compressed_bitarray *cb;
+    Data_Get_Struct(self, struct compressed_bitarray, cb);
+
+    VALUE obj = rb_bitarray_alloc(rb_bitarray_class);
+    struct bitarray *ba;
+    Data_Get_Struct(obj, struct bitarray, ba);
+
+    initialize_bitarray_compressed(ba, cb);
+    return obj;
+}
+
+
+/* Document-class: BitArray::BloomFilter
+ *
+ * A Bloom filter, stored in a BitArray. Keys can be added to it, and then
+ * tested for membership: include? is always true for a key that was added,
+ * and false for all but a small fraction of other keys (the false positive
+ * rate).
+ *
+ * Strings are hashed by their bytes, Integers that fit in a signed 64-bit
+ * word by their value, and anything else by its to_s, so filters can be saved
+ * (with their bitmap) and loaded in another process, even on another
+ * platform.
+ */
+
+
+/* Mark the bitmap of a BloomFilter, so it isn't garbage collected. */
+static void
+rb_bloom_mark(struct bloom_filter *bf)
+{
+    rb_gc_mark(bf->bitmap);
+}
+
+
+/* Allocate a new BloomFilter. */
+static VALUE
+rb_bloom_alloc(VALUE klass)
+{
+    struct bloom_filter *bf;
+    VALUE obj = Data_Make_Struct(klass, struct bloom_filter, rb_bloom_mark,
+            RUBY_DEFAULT_FREE, bf);
+    bf->bitmap = Qnil;
+    return obj;
+}
+
+
+/* Get the bloom filter from a BloomFilter, raising a TypeError if it's
+ * something else.
+ */
+static struct bloom_filter *
+rb_bloom_struct(VALUE obj)
+{
+    struct bloom_filter *bf;
+    if (!rb_obj_is_kind_of(obj, rb_bloom_class)) {
+        rb_raise(rb_eTypeError, "wrong argument type %s (expected %s)",
+                rb_obj_classname(obj), rb_class2name(rb_bloom_class));
+    }
+    Data_Get_Struct(obj, struct bloom_filter, bf);
+    return bf;
+}
+
+
+/* Get the bitarray of a bloom filter, and check that it's still the right
+ * shape, since it can be resized through the bitmap.
+ */
+static struct bitarray *
+rb_bloom_bitarray(struct bloom_filter *bf)
+{
+    struct bitarray *ba;
+    if (NIL_P(bf->bitmap)) {
+        rb_raise(rb_eArgError, "uninitialized BloomFilter");
+    }
+    Data_Get_Struct(bf->bitmap, struct bitarray, ba);
+    if (ba->bits == 0 ||
+            (bf->blocked && ba->bits % BLOOM_BLOCK_BITS != 0)) {
+        rb_raise(rb_eArgError, "bitmap size %ld is not valid for this filter",
+                ba->bits);
+    }
+    return ba;
+}
+
+
+/* Hash a key. */
+static void
+rb_bloom_hash(struct bloom_hash *h, VALUE key)
+{
+    unsigned char bytes[8];
+    if (FIXNUM_P(key)) {
+        store_le64(bytes, (uint64_t)FIX2LONG(key));
+        bloom_hash_key(h, bytes, 8);
+        return;
+    }
+    /* Whether an Integer is a Fixnum depends on the platform, so Bignums that
+     * fit in a signed 64-bit word are hashed by value too. rb_integer_pack only
+     * reports an overflow if the magnitude doesn't fit in 64 bits, so we also
+     * check that the sign bit it packed is the right one.
+     */
+    if (RB_TYPE_P(key, T_BIGNUM)) {
+        int sign = rb_integer_pack(key, bytes, 1, 8, 0,
+                INTEGER_PACK_LITTLE_ENDIAN | INTEGER_PACK_2COMP);
+        if ((sign == -1 || sign == 1) && (sign < 0) == (bytes[7] >> 7)) {
+            bloom_hash_key(h, bytes, 8);
+            return;
+        }
+    }
+    if (!RB_TYPE_P(key, T_STRING)) {
+        key = rb_obj_as_string(key);
+    }
+    bloom_hash_key(h, (const unsigned char *)RSTRING_PTR(key),
+            RSTRING_LEN(key));
+}
+
+
+/* Add or look up the keys in an Array, a batch at a time. Hashing a whole
+ * batch first lets us prefetch the words each key needs, so the cache misses
+ * of several keys overlap. Returns 0 if a lookup finds a key that isn't in the
+ * filter, and 1 otherwise.
+ */
+static int
+rb_bloom_batch(struct bloom_filter *bf, VALUE keys, int add)
+{
+    struct bloom_hash h[BLOOM_BATCH];
+    struct bitarray *ba;
+    long i, j, n;
+
+    /* Hashing can call to_s, which could change the Array, so we work from a
+     * copy of it.
+     */
+    Check_Type(keys, T_ARRAY);
+    keys = rb_ary_dup(keys);
+    for (i = 0; i < RARRAY_LEN(keys); i += n) {
+        n = RARRAY_LEN(keys) - i;
+        if (n > BLOOM_BATCH) {
+            n = BLOOM_BATCH;
+        }
+        for (j = 0; j < n; j++) {
+            rb_bloom_hash(&h[j], RARRAY_AREF(keys, i + j));
+        }
+
+        /* Hashing can call to_s, which could change the bitmap. */
+        ba = rb_bloom_bitarray(bf);
+        if (add) {
+            bitarray_changed(ba);
+        }
+        for (j = 0; j < n; j++) {
+            long bit = bloom_bit(&h[j], 0, ba->bits,
+                    bloom_block(&h[j], ba->bits, bf->blocked));
+            if (add) {
+                prefetch_word(ba, bit, 1);
+            } else {
+                prefetch_word(ba, bit, 0);
+            }
+        }
+        for (j = 0; j < n; j++) {
+            if (add) {
+                bloom_add(ba, &h[j], bf->hashes, bf->blocked);
+            } else if (!bloom_check(ba, &h[j], bf->hashes, bf->blocked)) {
+                return 0;
+            }
+        }
+    }
+    RB_GC_GUARD(keys);
+    return 1;
 }
 
 
 /* call-seq:
- *      bitarray & other_bitarray       -> a_bitarray
+ *      BitArray::BloomFilter.new(size, hashes, blocked = false)
+ *      BitArray::BloomFilter.new(bitarray, hashes, blocked = false)
  *
- * Intersection---Return a new BitArray from the intersection of the two
- * BitArrays. The new BitArray will have the same length as the shorter of the
- * two originals.
+ * Creates a new, empty Bloom filter of _size_ bits, that sets _hashes_ bits
+ * for each key. If _blocked_ is true, all of a key's bits are in the same
+ * 512-bit block, and _size_ is rounded up to a multiple of 512.
+ *
+ * When called with a BitArray, creates a Bloom filter that uses it as its
+ * bitmap, such as one saved from another filter with the same _hashes_ and
+ * _blocked_.
  */
 static VALUE
-rb_bitarray_intersect(VALUE x, VALUE y)
+rb_bloom_initialize(int argc, VALUE *argv, VALUE self)
 {
-    struct bitarray *x_ba, *y_ba;
-    Data_Get_Struct(x, struct bitarray, x_ba);
-    Data_Get_Struct(y, struct bitarray, y_ba);
+    struct bloom_filter *bf;
+    VALUE arg, hashes, blocked;
+    Data_Get_Struct(self, struct bloom_filter, bf);
+    rb_scan_args(argc, argv, "21", &arg, &hashes, &blocked);
+
+    bf->hashes = NUM2INT(hashes);
+    if (bf->hashes < 1 || bf->hashes > BLOOM_HASHES_MAX) {
+        rb_raise(rb_eArgError, "number of hashes must be between 1 and %d",
+                BLOOM_HASHES_MAX);
+    }
+    bf->blocked = RTEST(blocked);
 
-    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
-    struct bitarray *z_ba;
-    Data_Get_Struct(z, struct bitarray, z_ba);
+    if (rb_obj_is_kind_of(arg, rb_bitarray_class)) {
+        bf->bitmap = arg;
+    } else {
+        long size = NUM2LONG(arg);
+        if (size <= 0) {
+            rb_raise(rb_eArgError, "size must be positive");
+        }
+        if (bf->blocked && size % BLOOM_BLOCK_BITS != 0) {
+            size += BLOOM_BLOCK_BITS - size % BLOOM_BLOCK_BITS;
+        }
+        bf->bitmap = rb_bitarray_alloc(rb_bitarray_class);
+        struct bitarray *ba;
+        Data_Get_Struct(bf->bitmap, struct bitarray, ba);
+        initialize_bitarray(ba, size);
+    }
+    rb_bloom_bitarray(bf);
+    return self;
+}
 
-    initialize_bitarray_intersect(z_ba, x_ba, y_ba);
 
-    return z;
+/* call-seq:
+ *      BitArray::BloomFilter.with_capacity(count, fpp, blocked = false)
+ *
+ * Creates a new, empty Bloom filter with the size and number of hashes that
+ * give a false positive rate of _fpp_ (a number between 0 and 1) once _count_
+ * keys have been added.
+ *
+ *   f = BitArray::BloomFilter.with_capacity(1_000_000, 0.01)
+ *   f.size      => 9585059
+ *   f.hashes    => 7
+ */
+static VALUE
+rb_bloom_s_with_capacity(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE count, fpp, blocked, args[3];
+    rb_scan_args(argc, argv, "21", &count, &fpp, &blocked);
+
+    double n = (double)NUM2LONG(count);
+    double p = NUM2DBL(fpp);
+    if (n < 1) {
+        rb_raise(rb_eArgError, "count must be positive");
+    }
+    if (!(p > 0 && p < 1)) {
+        rb_raise(rb_eArgError, "fpp must be between 0 and 1");
+    }
+
+    /* The optimal size is -n ln(p) / ln(2)^2, and the optimal number of
+     * hashes is (size / n) ln(2).
+     */
+    double size = ceil(-n * log(p) / (M_LN2 * M_LN2));
+    double hashes = round(size / n * M_LN2);
+    if (size > LONG_MAX - BLOOM_BLOCK_BITS) {
+        rb_raise(rb_eArgError, "filter would be too large");
+    }
+    if (hashes < 1) {
+        hashes = 1;
+    } else if (hashes > BLOOM_HASHES_MAX) {
+        hashes = BLOOM_HASHES_MAX;
+    }
+
+    args[0] = LONG2NUM((long)size);
+    args[1] = INT2NUM((int)hashes);
+    args[2] = blocked;
+    return rb_class_new_instance(3, args, klass);
 }
 
 
 /* call-seq:
- *      bitarray | other_bitarray       -> a_bitarray
+ *      filter.clone        -> a_bloom_filter
+ *      filter.dup          -> a_bloom_filter
  *
- * Union---Return a new BitArray from the union of the two BitArrays. The new
- * BitArray will have the same length as the longer of the two originals.
+ * Produces a copy of _filter_, with a copy of its bitmap.
  */
 static VALUE
-rb_bitarray_union(VALUE x, VALUE y)
+rb_bloom_initialize_copy(VALUE self, VALUE orig)
 {
-    struct bitarray *x_ba, *y_ba;
-    Data_Get_Struct(x, struct bitarray, x_ba);
-    Data_Get_Struct(y, struct bitarray, y_ba);
-
-    VALUE z = rb_bitarray_alloc(rb_bitarray_class);
-    struct bitarray *z_ba;
-    Data_Get_Struct(z, struct bitarray, z_ba);
-
-    initialize_bitarray_union(z_ba, x_ba, y_ba);
+    struct bloom_filter *new_bf, *orig_bf;
+    Data_Get_Struct(self, struct bloom_filter, new_bf);
+    orig_bf = rb_bloom_struct(orig);
 
-    return z;
+    new_bf->hashes = orig_bf->hashes;
+    new_bf->blocked = orig_bf->blocked;
+    new_bf->bitmap = rb_obj_dup(orig_bf->bitmap);
+    return self;
 }
 
 
 /* call-seq:
- *      bitarray.size           -> int
- *      bitarray.length         -> int
+ *      filter.add(key)     -> filter
+ *      filter << key       -> filter
  *
- * Returns the number of bits in _bitarray_.
+ * Adds _key_ to _filter_.
  */
 static VALUE
-rb_bitarray_size(VALUE self)
+rb_bloom_add(VALUE self, VALUE key)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-
-    return LONG2NUM(bitarray_size(ba));
+    struct bloom_filter *bf;
+    struct bloom_hash h;
+    Data_Get_Struct(self, struct bloom_filter, bf);
+
+    rb_bloom_hash(&h, key);
+    struct bitarray *ba = rb_bloom_bitarray(bf);
+    bitarray_changed(ba);
+    bloom_add(ba, &h, bf->hashes, bf->blocked);
+    return self;
 }
 
 
 /* call-seq:
- *      bitarray.total_set      -> int
+ *      filter.include?(key)    -> true or false
  *
- * Return the number of set (1) bits in _bitarray_.
+ * Returns true if _key_ might have been added to _filter_, and false if it
+ * definitely hasn't.
  */
 static VALUE
-rb_bitarray_total_set(VALUE self)
+rb_bloom_include_p(VALUE self, VALUE key)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct bloom_filter *bf;
+    struct bloom_hash h;
+    Data_Get_Struct(self, struct bloom_filter, bf);
 
-    return LONG2NUM(total_set(ba));
+    rb_bloom_hash(&h, key);
+    struct bitarray *ba = rb_bloom_bitarray(bf);
+    return bloom_check(ba, &h, bf->hashes, bf->blocked) ? Qtrue : Qfalse;
 }
 
 
 /* call-seq:
- *      bitarray.set_bit(index)       -> bitarray
+ *      filter.add_all(keys)    -> filter
  *
- * Sets the bit at _index_ to 1. Negative indices count backwards from the end
- * of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
- * +IndexError+ is raised.
+ * Adds each key in the Array _keys_ to _filter_. This is faster than calling
+ * add for each one.
  */
 static VALUE
-rb_bitarray_set_bit(VALUE self, VALUE index)
+rb_bloom_add_all(VALUE self, VALUE keys)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-    
-    set_bit(ba, NUM2LONG(index));
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
+
+    rb_bloom_batch(bf, keys, 1);
     return self;
 }
 
 
 /* call-seq:
- *      bitarray.set_all_bits           -> bitarray
+ *      filter.include_all?(keys)   -> true or false
  *
- * Sets all bits to 1.
+ * Returns true if every key in the Array _keys_ might have been added to
+ * _filter_. This is faster than calling include? for each one.
  */
 static VALUE
-rb_bitarray_set_all_bits(VALUE self)
+rb_bloom_include_all_p(VALUE self, VALUE keys)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
 
-    set_all_bits(ba);
-    return self;
+    return rb_bloom_batch(bf, keys, 0) ? Qtrue : Qfalse;
+}
+
+
+/* Check that two bloom filters have the same size and hash functions, so they
+ * can be merged.
+ */
+static void
+rb_bloom_check_compatible(struct bloom_filter *x_bf, struct bloom_filter *y_bf)
+{
+    if (rb_bloom_bitarray(x_bf)->bits != rb_bloom_bitarray(y_bf)->bits ||
+            x_bf->hashes != y_bf->hashes || x_bf->blocked != y_bf->blocked) {
+        rb_raise(rb_eArgError, "can't merge Bloom filters with different "
+                "sizes, hashes or layouts");
+    }
 }
 
 
 /* call-seq:
- *      bitarray.clear_bit(index)       -> bitarray
+ *      filter.merge!(other_filter)     -> filter
  *
- * Sets the bit at _index_ to 0. Negative indices count backwards from the end
- * of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
- * +IndexError+ is raised.
+ * Adds all the keys in _other_filter_ to _filter_, by taking the union of
+ * their bitmaps. The two filters must have the same size, hashes and layout.
  */
 static VALUE
-rb_bitarray_clear_bit(VALUE self, VALUE index)
+rb_bloom_merge_bang(VALUE self, VALUE other)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct bloom_filter *x_bf, *y_bf;
+    Data_Get_Struct(self, struct bloom_filter, x_bf);
+    y_bf = rb_bloom_struct(other);
 
-    clear_bit(ba, NUM2LONG(index));
+    rb_bloom_check_compatible(x_bf, y_bf);
+    bitarray_or(rb_bloom_bitarray(x_bf), rb_bloom_bitarray(y_bf));
     return self;
 }
 
 
 /* call-seq:
- *      bitarray.clear_all_bits         -> bitarray
+ *      filter | other_filter   -> a_bloom_filter
  *
- * Sets all bits to 0.
+ * Returns a new Bloom filter with the keys of both filters. The two filters
+ * must have the same size, hashes and layout.
  */
 static VALUE
-rb_bitarray_clear_all_bits(VALUE self)
+rb_bloom_union(VALUE self, VALUE other)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-
-    clear_all_bits(ba);
-    return self;
+    rb_bloom_check_compatible(rb_bloom_struct(self), rb_bloom_struct(other));
+    return rb_bloom_merge_bang(rb_obj_dup(self), other);
 }
 
 
 /* call-seq:
- *      bitarray.toggle_bit(index)       -> bitarray
+ *      filter.bitmap       -> a_bitarray
  *
- * Toggles the bit at _index_ to 0. Negative indices count backwards from the
- * end of _bitarray_. If _index_ is greater than the capacity of _bitarray_, an
- * +IndexError+ is raised.
+ * Returns the BitArray that stores _filter_'s bits. Changes to it change
+ * _filter_.
  */
 static VALUE
-rb_bitarray_toggle_bit(VALUE self, VALUE index)
+rb_bloom_bitmap(VALUE self)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
 
-    toggle_bit(ba, NUM2LONG(index));
-    return self;
+    return bf->bitmap;
 }
 
 
 /* call-seq:
- *      bitarray.toggle_all_bits         -> bitarray
+ *      filter.size         -> int
  *
- * Toggle all bits.
+ * Returns the number of bits in _filter_.
  */
 static VALUE
-rb_bitarray_toggle_all_bits(VALUE self)
+rb_bloom_size(VALUE self)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
 
-    toggle_all_bits(ba);
-    return self;
+    return LONG2NUM(rb_bloom_bitarray(bf)->bits);
 }
 
 
-/* Bit-reference helper-function prototypes. These are defined after
- * rb_bitarray_bitref.
+/* call-seq:
+ *      filter.hashes       -> int
+ *
+ * Returns the number of bits _filter_ sets for each key.
  */
-static inline VALUE rb_bitarray_get_bit(VALUE self, long index);
-static VALUE rb_bitarray_subseq(VALUE self, long beg, long len);
+static VALUE
+rb_bloom_hashes(VALUE self)
+{
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
+
+    return INT2NUM(bf->hashes);
+}
 
 
 /* call-seq:
- *      bitarray[index]         -> value
- *      bitarray[beg, len]      -> a_bitarray
- *      bitarray[range]         -> a_bitarray
+ *      filter.blocked?     -> true or false
  *
- * Bit Reference---Returns the bit at _index_, or returns a subarray starting
- * at _beg_, and continuing for _len_ bits, or returns a subarray specified by
- * _range_.  _Negative indices count backwards from the end of _bitarray_. If
- * _index_ is greater than the capacity of _bitarray_, an +IndexError+ is
- * raised.
+ * Returns true if _filter_ keeps each key's bits in a single 512-bit block.
  */
 static VALUE
-rb_bitarray_bitref(int argc, VALUE *argv, VALUE self)
+rb_bloom_blocked_p(VALUE self)
 {
-    /* We follow a form similar to rb_ary_aref in array.c */
+    struct bloom_filter *bf;
+    Data_Get_Struct(self, struct bloom_filter, bf);
 
-    /* Two arguments means we have a beginning and a  length */
-    if (argc == 2) {
-        long beg = NUM2LONG(argv[0]);
-        long len = NUM2LONG(argv[1]);
-        return rb_bitarray_subseq(self, beg, len);
-    } 
-    
-    /* Make sure we have either 1 or 2 arguments. */
-    if (argc != 1) {
-        rb_scan_args(argc, argv, "11", 0, 0);
-    }
+    return bf->blocked ? Qtrue : Qfalse;
+}
 
-    /* If we have a single argument, it can be either an index, or a range. */
-    VALUE arg = argv[0];
-    
-    /* rb_ary_aref treats a fixnum argument specially, for a speedup in the
-     * most common case. We'll do the same.
-     */
-    if (FIXNUM_P(arg)) {
-        return rb_bitarray_get_bit(self, FIX2LONG(arg));
-    }
 
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-    /* Next we see if arg is a range. rb_range_beg_len is defined in range.c
-     * If arg is not a range, it returns Qfalse. If arg is a range, but it
-     * refers to invalid indices, it returns Qnil. Otherwise, it sets beg and
-     * end to the appropriate values.
-     */
-    long beg, len;
-    switch (rb_range_beg_len(arg, &beg, &len, ba->bits, 0)) {
-        case Qfalse:
-            break;
-        case Qnil:
-            return Qnil;
-        default:
-            return rb_bitarray_subseq(self, beg, len);
-    }
-    
-    return rb_bitarray_get_bit(self, NUM2LONG(arg));
-}
+/* Document-class: BitArray::Network
+ *
+ * A boolean network. Output bit i of a network is a boolean function of two
+ * input bits, a[i] and b[i], and the network computes every output in one
+ * call, 64 outputs at a time. Running a network step by step on its own
+ * output makes a random boolean network, or a cellular automaton with any
+ * wiring.
+ *
+ * The function of each output can be :and, :or, :xor, :nand, :nor or :xnor,
+ * or any other function of two inputs given as a 4-bit truth table: bit k of
+ * the table is the output when the inputs are (k >> 1, k & 1). So :and is 8,
+ * and 12 copies the first input.
+ */
 
 
-/* Return an individual bit. */
-static inline VALUE
-rb_bitarray_get_bit(VALUE self, long index)
+/* Mark the scratch BitArray of a Network. */
+static void
+rb_network_mark(struct network *net)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    rb_gc_mark(net->scratch);
+}
 
-    return INT2NUM(get_bit(ba, index));
+
+/* This gets called when a Network is garbage collected. */
+static void
+rb_network_free(struct network *net)
+{
+    if (net) {
+        free_network(net);
+    }
+    ruby_xfree(net);
 }
 
 
-/* Create a new BitArray from a subsequence of x. */
+/* Allocate a new Network. */
 static VALUE
-rb_bitarray_subseq(VALUE x, long beg, long len)
+rb_network_alloc(VALUE klass)
 {
+    struct network *net;
+    VALUE obj = Data_Make_Struct(klass, struct network, rb_network_mark,
+            rb_network_free, net);
+    net->scratch = Qnil;
+    net->max_input = -1;
+    return obj;
+}
 
-    struct bitarray *x_ba;
-    Data_Get_Struct(x, struct bitarray, x_ba);
 
-    /* Quick exit - a negative length, or a beginning past the end of the
-     * array returns nil.
-     */
-    if (beg < 0) {
-        beg += bitarray_size(x_ba);
-    }
-    if (len < 0 || beg > bitarray_size(x_ba)) {
-        return Qnil;
+/* Convert an op for a Network into a truth table. */
+static int
+rb_network_op(VALUE op)
+{
+    if (SYMBOL_P(op)) {
+        ID id = SYM2ID(op);
+        if (id == rb_intern("and")) return 8;
+        if (id == rb_intern("or")) return 14;
+        if (id == rb_intern("xor")) return 6;
+        if (id == rb_intern("nand")) return 7;
+        if (id == rb_intern("nor")) return 1;
+        if (id == rb_intern("xnor")) return 9;
+    } else if (FIXNUM_P(op) && FIX2LONG(op) >= 0 && FIX2LONG(op) <= 15) {
+        return (int)FIX2LONG(op);
     }
+    rb_raise(rb_eArgError, "unknown operation %s",
+            RSTRING_PTR(rb_inspect(op)));
+    return 0;
+}
 
-    /* Make sure that we don't try getting more bits than x has. We handle this
-     * the same way as Array; if beg+len is past the end of x, shorten len.
-     */
-    if (bitarray_size(x_ba) <  len ||  bitarray_size(x_ba) < (beg + len)) {
-        len = bitarray_size(x_ba) - beg;
-    }
 
-    /* Create a new BitArray of the appropriate size. */
-    VALUE y = rb_bitarray_alloc(rb_bitarray_class);
-    rb_bitarray_initialize(y, LONG2NUM(len));
-    /* If our length is 0, we can just return now. */
-    if (len == 0) {
-        return y;
+/* call-seq:
+ *      BitArray::Network.new(a, b, ops)
+ *
+ * Creates a network with one output for each element of the Arrays _a_ and
+ * _b_, which give the indices of the two input bits of each output. _ops_ is
+ * an Array with the function of each output, or a single function for all of
+ * them. Input indices must not be negative.
+ *
+ *   net = BitArray::Network.new([1, 2, 0], [2, 0, 1], [:and, :or, :xor])
+ *   net.call(BitArray.new("110"))      => 010
+ */
+static VALUE
+rb_network_initialize(VALUE self, VALUE a, VALUE b, VALUE ops)
+{
+    struct network *net;
+    Data_Get_Struct(self, struct network, net);
+    free_network(net);
+
+    /* Copies of the Arrays can't change size under us. */
+    Check_Type(a, T_ARRAY);
+    Check_Type(b, T_ARRAY);
+    a = rb_ary_dup(a);
+    b = rb_ary_dup(b);
+    if (RB_TYPE_P(ops, T_ARRAY)) {
+        ops = rb_ary_dup(ops);
+    }
+    long i, n = RARRAY_LEN(a);
+    if (RARRAY_LEN(b) != n ||
+            (RB_TYPE_P(ops, T_ARRAY) && RARRAY_LEN(ops) != n)) {
+        rb_raise(rb_eArgError, "inputs and operations must be the same size");
     }
-    struct bitarray *y_ba;
-    Data_Get_Struct(y, struct bitarray, y_ba);
 
-    /* For each set bit in x[beg..len], set the corresponding bit in y. */
-    long x_index, y_index;
-    for (x_index = beg, y_index = 0;
-            x_index < beg + len;
-            x_index++, y_index++)
-    {
-        if (get_bit(x_ba, x_index) == 1) {
-            set_bit(y_ba, y_index);
+    net->a = ruby_xmalloc2(n, sizeof(long));
+    net->b = ruby_xmalloc2(n, sizeof(long));
+    net->tables = ruby_xcalloc(4 * word_array_size(n), WORD_BYTES);
+    net->scratch = Qnil;
+    int table = RB_TYPE_P(ops, T_ARRAY) ? 0 : rb_network_op(ops);
+    long max_input = -1;
+    for (i = 0; i < n; i++) {
+        net->a[i] = NUM2LONG(RARRAY_AREF(a, i));
+        net->b[i] = NUM2LONG(RARRAY_AREF(b, i));
+        if (net->a[i] < 0 || net->b[i] < 0) {
+            rb_raise(rb_eIndexError, "negative input index for output %ld", i);
+        }
+        if (net->a[i] > max_input) max_input = net->a[i];
+        if (net->b[i] > max_input) max_input = net->b[i];
+        if (RB_TYPE_P(ops, T_ARRAY)) {
+            table = rb_network_op(RARRAY_AREF(ops, i));
         }
+        set_network_op(net, i, table);
     }
 
-    return y;
+    net->size = n;
+    net->max_input = max_input;
+    return self;
 }
 
 
 /* call-seq:
- *      bitarray[index] = value     -> value
+ *      network.size        -> int
  *
- * Bit Assignment---Sets the bit at _index_. _value_ must be 0 or 1. Negative
- * indices are allowed, and will count backwards from the end of _bitarray_.
- *
- * If _index_ is greater than the capacity of _bitarray_, an +IndexError+ is
- * raised. If _value_ is something other than 0 or 1, a +RuntimeError+ is
- * raised.
+ * Returns the number of outputs of _network_.
  */
 static VALUE
-rb_bitarray_assign_bit(VALUE self, VALUE index, VALUE value)
+rb_network_size(VALUE self)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
+    struct network *net;
+    Data_Get_Struct(self, struct network, net);
 
-    assign_bit(ba, NUM2LONG(index), NUM2INT(value));
-    return value; 
+    return LONG2NUM(net->size);
 }
 
 
-/* call-seq:
- *      bitarray.inspect        -> string
- *      bitarray.to_s           -> string
- *
- * Create a printable version of _bitarray_.
- */
-static VALUE
-rb_bitarray_inspect(VALUE self)
+/* Check that a BitArray has enough bits to be the input of a network. */
+static void
+rb_network_check_input(struct network *net, struct bitarray *ba)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-
-    long cstr_size = bitarray_size(ba) + 1;
-    char cstr[cstr_size];
-    
-    long i;
-    for (i = 0; i < bitarray_size(ba); i++) {
-        cstr[i] = get_bit(ba, i) + '0';
+    if (ba->bits <= net->max_input) {
+        rb_raise(rb_eIndexError, "network reads input bit %ld, but input has "
+                "%ld bits", net->max_input, ba->bits);
     }
-    cstr[cstr_size - 1] = '\0';
+}
 
-    VALUE str = rb_str_new2(cstr);
-    return str;
+
+/* Check that a BitArray can be the state of a network for step!. */
+static void
+rb_network_check_state(struct network *net, struct bitarray *ba)
+{
+    if (ba->bits != net->size) {
+        rb_raise(rb_eArgError, "state must have %ld bits, not %ld",
+                net->size, ba->bits);
+    }
+    rb_network_check_input(net, ba);
 }
 
 
 /* call-seq:
- *      bitarray.to_a           -> an_array
+ *      network.call(input)             -> a_bitarray
+ *      network.call(input, output)     -> output
  *
- * Creates a Ruby Array from bitarray.
+ * Computes the outputs of _network_ from the BitArray _input_. If an _output_
+ * BitArray is given, the outputs are stored in it instead of a new BitArray.
+ * _output_ must be the size of _network_, and can't be _input_.
  */
 static VALUE
-rb_bitarray_to_a(VALUE self)
+rb_network_call(int argc, VALUE *argv, VALUE self)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-
-    long array_size = bitarray_size(ba);
-    VALUE c_array[array_size];
-    
-    int i;
-    for (i = 0; i < array_size; i++) {
-        c_array[i] = INT2FIX(get_bit(ba, i));
+    struct network *net;
+    Data_Get_Struct(self, struct network, net);
+
+    VALUE input, output;
+    rb_scan_args(argc, argv, "11", &input, &output);
+    struct bitarray *in_ba = rb_bitarray_struct(input);
+
+    struct bitarray *out_ba;
+    if (NIL_P(output)) {
+        output = rb_bitarray_alloc(rb_bitarray_class);
+        Data_Get_Struct(output, struct bitarray, out_ba);
+        allocate_bitarray(out_ba, net->size, 0);
+    } else {
+        out_ba = rb_bitarray_struct(output);
+        if (out_ba->bits != net->size) {
+            rb_raise(rb_eArgError, "output must have %ld bits, not %ld",
+                    net->size, out_ba->bits);
+        }
+        if (output == input) {
+            rb_raise(rb_eArgError, "output can't be the input; use step!");
+        }
+        bitarray_changed(out_ba);
     }
 
-    return rb_ary_new4(array_size, c_array);
+    /* Unsharing the output can let other threads run, so the input is only
+     * checked once nothing else can change it before the step.
+     */
+    rb_network_check_input(net, in_ba);
+    network_step(net, in_ba, out_ba);
+    return output;
 }
 
 
 /* call-seq:
- *      bitarray.each {|bit| block }        -> bitarray
- *
- * Calls +block+ once for each bit in _bitarray_, passing that bit as a
- * parameter.
+ *      network.step!(state)            -> state
+ *      network.step!(state, steps)     -> state
  *
- *      ba = BitArray.new(10)
- *      ba.each {|bit| print bit, " " }
- *
- * produces:
- *
- *      0 0 0 0 0 0 0 0 0 0
+ * Replaces the BitArray _state_ with the outputs of _network_ for it, _steps_
+ * times (once by default). _state_ must be the size of _network_. Nothing is
+ * allocated for each step, so this is the fastest way to run a network.
  */
 static VALUE
-rb_bitarray_each(VALUE self)
+rb_network_step_bang(int argc, VALUE *argv, VALUE self)
 {
-    struct bitarray *ba;
-    Data_Get_Struct(self, struct bitarray, ba);
-
-    long i;
+    struct network *net;
+    Data_Get_Struct(self, struct network, net);
+
+    VALUE state, steps;
+    rb_scan_args(argc, argv, "11", &state, &steps);
+    long i, n = NIL_P(steps) ? 1 : NUM2LONG(steps);
+    struct bitarray *ba = rb_bitarray_struct(state);
+    rb_network_check_state(net, ba);
+    if (n < 0) {
+        rb_raise(rb_eArgError, "negative number of steps");
+    }
 
-    RETURN_ENUMERATOR(self, 0, 0);
-    for (i = 0; i < bitarray_size(ba); i++) {
-        int bit_value = get_bit(ba, i);
-        rb_yield(INT2NUM(bit_value));
+    struct bitarray *scratch_ba;
+    if (NIL_P(net->scratch)) {
+        net->scratch = rb_bitarray_alloc(rb_bitarray_class);
+        Data_Get_Struct(net->scratch, struct bitarray, scratch_ba);
+        allocate_bitarray(scratch_ba, net->size, 0);
     }
-    return self;
+    VALUE scratch = net->scratch;
+    Data_Get_Struct(scratch, struct bitarray, scratch_ba);
+
+    for (i = 0; i < n; i++) {
+        /* If another thread is stepping with the scratch bitarray, it's
+         * locked, and we use one of our own instead.
+         */
+        if (scratch_ba->locks) {
+            scratch = rb_bitarray_alloc(rb_bitarray_class);
+            Data_Get_Struct(scratch, struct bitarray, scratch_ba);
+            allocate_bitarray(scratch_ba, net->size, 0);
+        }
+        bitarray_changed(scratch_ba);
+        bitarray_changed(ba);
+        /* Other threads may have run since the last check, so the state could
+         * have been resized.
+         */
+        rb_network_check_state(net, ba);
+        network_step(net, ba, scratch_ba);
+        if (ba->mapped) {
+            word_op(WORD_COPY, ba->array, scratch_ba->array, NULL,
+                    ba->array_size, ba, scratch_ba);
+        } else {
+            swap_storage(ba, scratch_ba);
+        }
+        rb_thread_check_ints();
+    }
+    RB_GC_GUARD(scratch);
+    return state;
 }
 
 
 /* Document-class: BitArray
  *
  * An array of bits. Usage is similar to the standard Array class, but the only
- * allowed elements are 1 and 0. BitArrays are not resizable.
+ * allowed elements are 1 and 0. BitArrays can grow and shrink with push, pop
+ * and resize, but not by assigning past the end. Copies made with clone, dup
+ * and view share their storage with the original until one of them changes.
+ *
+ * Operations on whole BitArrays of a megabyte or more (counting, the bitwise
+ * operators, slicing and so on) let other threads run while they work. While
+ * that's happening, the BitArrays involved can't be changed by any other
+ * thread; trying to raises a ThreadError. They can still be read, but a read
+ * of a BitArray that is being changed may see only part of the change.
  */
 void
 Init_bitarray()
 {
+    init_popcount();
+    init_select();
+    init_bit_chars();
+
     rb_bitarray_class = rb_define_class("BitArray", rb_cObject);
     rb_define_alloc_func(rb_bitarray_class, rb_bitarray_alloc);
     rb_define_method(rb_bitarray_class, "initialize",
             rb_bitarray_initialize, 1);
     rb_define_method(rb_bitarray_class, "initialize_copy",
             rb_bitarray_initialize_copy, 1);
+    rb_define_singleton_method(rb_bitarray_class, "with_scratch",
+            rb_bitarray_s_with_scratch, 1);
+    rb_define_method(rb_bitarray_class, "==", rb_bitarray_equal, 1);
+    rb_define_method(rb_bitarray_class, "eql?", rb_bitarray_equal, 1);
+    rb_define_method(rb_bitarray_class, "hash", rb_bitarray_hash, 0);
+    rb_define_method(rb_bitarray_class, "<=>", rb_bitarray_cmp, 1);
     rb_define_method(rb_bitarray_class, "+", rb_bitarray_concat, 1);
     rb_define_method(rb_bitarray_class, "&", rb_bitarray_intersect, 1);
     rb_define_method(rb_bitarray_class, "|", rb_bitarray_union, 1);
+    rb_define_method(rb_bitarray_class, "^", rb_bitarray_xor, 1);
+    rb_define_method(rb_bitarray_class, "-", rb_bitarray_difference, 1);
+    rb_define_method(rb_bitarray_class, "~", rb_bitarray_complement, 0);
+    rb_define_method(rb_bitarray_class, "shift_left",
+            rb_bitarray_shift_left, 1);
+    rb_define_method(rb_bitarray_class, "shift_left!",
+            rb_bitarray_shift_left_bang, 1);
+    rb_define_method(rb_bitarray_class, "shift_right",
+            rb_bitarray_shift_right, 1);
+    rb_define_method(rb_bitarray_class, "shift_right!",
+            rb_bitarray_shift_right_bang, 1);
+    rb_define_method(rb_bitarray_class, "rotate", rb_bitarray_rotate, -1);
+    rb_define_method(rb_bitarray_class, "rotate!", rb_bitarray_rotate_bang, -1);
+    rb_define_method(rb_bitarray_class, "reverse", rb_bitarray_reverse, 0);
+    rb_define_method(rb_bitarray_class, "reverse!",
+            rb_bitarray_reverse_bang, 0);
+    rb_define_method(rb_bitarray_class, "and!", rb_bitarray_and_bang, 1);
+    rb_define_method(rb_bitarray_class, "or!", rb_bitarray_or_bang, 1);
+    rb_define_method(rb_bitarray_class, "xor!", rb_bitarray_xor_bang, 1);
+    rb_define_method(rb_bitarray_class, "andnot!", rb_bitarray_andnot_bang,
+            1);
+    rb_define_method(rb_bitarray_class, "intersect_count",
+            rb_bitarray_intersect_count, 1);
+    rb_define_method(rb_bitarray_class, "union_count",
+            rb_bitarray_union_count, 1);
+    rb_define_method(rb_bitarray_class, "xor_count", rb_bitarray_xor_count, 1);
+    rb_define_alias(rb_bitarray_class, "hamming", "xor_count");
+    rb_define_method(rb_bitarray_class, "jaccard", rb_bitarray_jaccard, 1);
+    rb_define_method(rb_bitarray_class, "intersects?",
+            rb_bitarray_intersects_p, 1);
+    rb_define_method(rb_bitarray_class, "subset_of?",
+            rb_bitarray_subset_of_p, 1);
+    rb_define_singleton_method(rb_bitarray_class, "and_all",
+            rb_bitarray_s_and_all, 1);
+    rb_define_singleton_method(rb_bitarray_class, "or_all",
+            rb_bitarray_s_or_all, 1);
+    rb_define_singleton_method(rb_bitarray_class, "threshold",
+            rb_bitarray_s_threshold, 2);
+    rb_define_singleton_method(rb_bitarray_class, "majority",
+            rb_bitarray_s_majority, 1);
     rb_define_method(rb_bitarray_class, "size", rb_bitarray_size, 0);
     rb_define_alias(rb_bitarray_class, "length", "size");
-    rb_define_method(rb_bitarray_class, "total_set", rb_bitarray_total_set, 0);
+    rb_define_method(rb_bitarray_class, "resize", rb_bitarray_resize, 1);
+    rb_define_method(rb_bitarray_class, "push", rb_bitarray_push, -1);
+    rb_define_method(rb_bitarray_class, "<<", rb_bitarray_append, 1);
+    rb_define_method(rb_bitarray_class, "pop", rb_bitarray_pop, 0);
+    rb_define_method(rb_bitarray_class, "total_set", rb_bitarray_total_set,
+            -1);
     rb_define_method(rb_bitarray_class, "set_bit", rb_bitarray_set_bit, 1);
     rb_define_method(rb_bitarray_class, "set_all_bits",
             rb_bitarray_set_all_bits, 0);
+    rb_define_method(rb_bitarray_class, "set_range",
+            rb_bitarray_set_range, -1);
     rb_define_method(rb_bitarray_class, "clear_bit", rb_bitarray_clear_bit, 1);
     rb_define_method(rb_bitarray_class, "clear_all_bits",
             rb_bitarray_clear_all_bits, 0);
+    rb_define_method(rb_bitarray_class, "clear_range",
+            rb_bitarray_clear_range, -1);
     rb_define_method(rb_bitarray_class, "toggle_bit",
             rb_bitarray_toggle_bit, 1);
     rb_define_method(rb_bitarray_class, "toggle_all_bits",
             rb_bitarray_toggle_all_bits, 0);
+    rb_define_method(rb_bitarray_class, "toggle_range",
+            rb_bitarray_toggle_range, -1);
     rb_define_method(rb_bitarray_class, "[]", rb_bitarray_bitref, -1);
     rb_define_alias(rb_bitarray_class, "slice", "[]");
-    rb_define_method(rb_bitarray_class, "[]=", rb_bitarray_assign_bit, 2);
+    rb_define_method(rb_bitarray_class, "[]=", rb_bitarray_assign_bit, -1);
+    rb_define_method(rb_bitarray_class, "view", rb_bitarray_view, -1);
+    rb_define_method(rb_bitarray_class, "set_bits", rb_bitarray_set_bits, 1);
+    rb_define_method(rb_bitarray_class, "clear_bits",
+            rb_bitarray_clear_bits, 1);
+    rb_define_method(rb_bitarray_class, "get_bits", rb_bitarray_get_bits, 1);
+    rb_define_method(rb_bitarray_class, "all_set?", rb_bitarray_all_set_p, 1);
+    rb_define_method(rb_bitarray_class, "any_set?", rb_bitarray_any_set_p, 1);
     rb_define_method(rb_bitarray_class, "to_a", rb_bitarray_to_a, 0);
     rb_define_method(rb_bitarray_class, "inspect", rb_bitarray_inspect, 0);
     rb_define_alias(rb_bitarray_class, "to_s", "inspect");
     rb_define_method(rb_bitarray_class, "each", rb_bitarray_each, 0);
+    rb_define_method(rb_bitarray_class, "to_bytes", rb_bitarray_to_bytes, 0);
+    rb_define_singleton_method(rb_bitarray_class, "from_bytes",
+            rb_bitarray_s_from_bytes, -1);
+    rb_define_method(rb_bitarray_class, "to_hex", rb_bitarray_to_hex, 0);
+    rb_define_singleton_method(rb_bitarray_class, "from_hex",
+            rb_bitarray_s_from_hex, -1);
+    rb_define_method(rb_bitarray_class, "to_base64", rb_bitarray_to_base64, 0);
+    rb_define_singleton_method(rb_bitarray_class, "from_base64",
+            rb_bitarray_s_from_base64, -1);
+    rb_define_method(rb_bitarray_class, "to_ewah", rb_bitarray_to_ewah, 0);
+    rb_define_singleton_method(rb_bitarray_class, "from_ewah",
+            rb_bitarray_s_from_ewah, 1);
+    rb_define_singleton_method(rb_bitarray_class, "ewah_and",
+            rb_bitarray_s_ewah_and, 2);
+    rb_define_singleton_method(rb_bitarray_class, "ewah_or",
+            rb_bitarray_s_ewah_or, 2);
+    rb_define_singleton_method(rb_bitarray_class, "ewah_total_set",
+            rb_bitarray_s_ewah_total_set, 1);
+    rb_define_method(rb_bitarray_class, "_dump", rb_bitarray_dump, 1);
+    rb_define_singleton_method(rb_bitarray_class, "_load",
+            rb_bitarray_s_load, 1);
+    rb_define_singleton_method(rb_bitarray_class, "parallelism",
+            rb_bitarray_s_parallelism, 0);
+    rb_define_singleton_method(rb_bitarray_class, "parallelism=",
+            rb_bitarray_s_set_parallelism, 1);
+    rb_define_singleton_method(rb_bitarray_class, "mmap",
+            rb_bitarray_s_mmap, -1);
+    rb_define_method(rb_bitarray_class, "sync", rb_bitarray_sync, 0);
+    rb_define_method(rb_bitarray_class, "each_set_bit",
+            rb_bitarray_each_set_bit, 0);
+    rb_define_method(rb_bitarray_class, "each_clear_bit",
+            rb_bitarray_each_clear_bit, 0);
+    rb_define_method(rb_bitarray_class, "first_set", rb_bitarray_first_set, 0);
+    rb_define_method(rb_bitarray_class, "next_set", rb_bitarray_next_set, 1);
+    rb_define_method(rb_bitarray_class, "last_set", rb_bitarray_last_set, 0);
+    rb_define_method(rb_bitarray_class, "to_indices",
+            rb_bitarray_to_indices, 0);
+    rb_define_method(rb_bitarray_class, "rank", rb_bitarray_rank, 1);
+    rb_define_method(rb_bitarray_class, "select", rb_bitarray_select, -1);
 
     rb_include_module(rb_bitarray_class, rb_mEnumerable);
+
+    rb_compressed_class = rb_define_class("CompressedBitArray", rb_cObject);
+    rb_define_alloc_func(rb_compressed_class, rb_compressed_alloc);
+    rb_define_method(rb_compressed_class, "initialize",
+            rb_compressed_initialize, 1);
+    rb_define_method(rb_compressed_class, "initialize_copy",
+            rb_compressed_initialize_copy, 1);
+    rb_define_method(rb_compressed_class, "size", rb_compressed_size, 0);
+    rb_define_alias(rb_compressed_class, "length", "size");
+    rb_define_method(rb_compressed_class, "total_set",
+            rb_compressed_total_set, 0);
+    rb_define_method(rb_compressed_class, "set_bit", rb_compressed_set_bit, 1);
+    rb_define_method(rb_compressed_class, "clear_bit",
+            rb_compressed_clear_bit, 1);
+    rb_define_method(rb_compressed_class, "[]", rb_compressed_bitref, 1);
+    rb_define_method(rb_compressed_class, "[]=", rb_compressed_assign_bit, 2);
+    rb_define_method(rb_compressed_class, "&", rb_compressed_intersect, 1);
+    rb_define_method(rb_compressed_class, "|", rb_compressed_union, 1);
+    rb_define_method(rb_compressed_class, "each", rb_compressed_each, 0);
+    rb_define_method(rb_compressed_class, "each_set_bit",
+            rb_compressed_each_set_bit, 0);
+    rb_define_method(rb_compressed_class, "to_indices",
+            rb_compressed_to_indices, 0);
+    rb_define_method(rb_compressed_class, "to_bitarray",
+            rb_compressed_to_bitarray, 0);
+    rb_include_module(rb_compressed_class, rb_mEnumerable);
+
+    rb_bloom_class = rb_define_class_under(rb_bitarray_class, "BloomFilter",
+            rb_cObject);
+    rb_define_alloc_func(rb_bloom_class, rb_bloom_alloc);
+    rb_define_singleton_method(rb_bloom_class, "with_capacity",
+            rb_bloom_s_with_capacity, -1);
+    rb_define_method(rb_bloom_class, "initialize", rb_bloom_initialize, -1);
+    rb_define_method(rb_bloom_class, "initialize_copy",
+            rb_bloom_initialize_copy, 1);
+    rb_define_method(rb_bloom_class, "add", rb_bloom_add, 1);
+    rb_define_alias(rb_bloom_class, "<<", "add");
+    rb_define_method(rb_bloom_class, "include?", rb_bloom_include_p, 1);
+    rb_define_method(rb_bloom_class, "add_all", rb_bloom_add_all, 1);
+    rb_define_method(rb_bloom_class, "include_all?",
+            rb_bloom_include_all_p, 1);
+    rb_define_method(rb_bloom_class, "merge!", rb_bloom_merge_bang, 1);
+    rb_define_method(rb_bloom_class, "|", rb_bloom_union, 1);
+    rb_define_method(rb_bloom_class, "bitmap", rb_bloom_bitmap, 0);
+    rb_define_method(rb_bloom_class, "size", rb_bloom_size, 0);
+    rb_define_method(rb_bloom_class, "hashes", rb_bloom_hashes, 0);
+    rb_define_method(rb_bloom_class, "blocked?", rb_bloom_blocked_p, 0);
+
+    rb_network_class = rb_define_class_under(rb_bitarray_class, "Network",
+            rb_cObject);
+    rb_define_alloc_func(rb_network_class, rb_network_alloc);
+    rb_define_method(rb_network_class, "initialize", rb_network_initialize, 3);
+    rb_define_method(rb_network_class, "size", rb_network_size, 0);
+    rb_define_method(rb_network_class, "call", rb_network_call, -1);
+    rb_define_method(rb_network_class, "step!", rb_network_step_bang, -1);
 }
 
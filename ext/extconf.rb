@@ -1,3 +1,27 @@
 require 'mkmf'
 
+# The popcount kernels are picked at load time, which needs GCC-style target
+# attributes and __builtin_cpu_supports.
+if have_header('immintrin.h') && try_link(<<SRC)
+#include <immintrin.h>
+__attribute__((target("avx512f,avx512bw")))
+static long f(void) { return _mm512_reduce_add_epi64(_mm512_setzero_si512()); }
+int main(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512bw") ? (int)f() : 0;
+}
+SRC
+  $defs.push('-DHAVE_CPU_DISPATCH')
+end
+
+have_header('sys/mman.h')
+
+# Bulk operations on large arrays are run without the GVL where we can.
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl2', 'ruby/thread.h')
+end
+
+# Very large operations can be split between a pool of worker threads.
+have_header('pthread.h')
+
 create_makefile('bitarray');
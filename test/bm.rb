@@ -1,12 +1,14 @@
 require 'bitarray'
 require 'benchmark'
 
-Benchmark.bm(28) { |bm|
+Benchmark.bm(34) { |bm|
   bm.report("BitArray initialize") { 10000.times { BitArray.new(256) } }
   s = "0"*256
   bm.report("BitArray init from string") { 10000.times { BitArray.new(s) } }
   a = [0]*256
   bm.report("BitArray init from array")  { 10000.times { BitArray.new(a) } }
+  bm.report("BitArray initialize (4096)") { 10000.times { BitArray.new(4096) } }
+  bm.report("BitArray with_scratch (4096)") { 10000.times { BitArray.with_scratch(4096) { |s| s } } }
 
   ba = BitArray.new(256)
   
@@ -38,5 +40,156 @@ Benchmark.bm(28) { |bm|
   ba2.set_all_bits
   bm.report("BitArray union")     { 10000.times { ba | ba2 } }
   bm.report("BitArray intersect") { 10000.times { ba & ba2 } }
-}
+  bm.report("BitArray << (100K bits)") {
+    grow = BitArray.new(0)
+    100000.times { grow << 1 }
+  }
+  bm.report("BitArray + (1K bits)") {
+    grow = BitArray.new(0)
+    one = BitArray.new("1")
+    1000.times { grow += one }
+  }
+
+  # Large arrays, where the per-word cost of the bulk operations dominates.
+  size = 1 << 22
+  big = BitArray.new(size)
+  big2 = BitArray.new(size)
+  1000.times { big.set_bit(rand(size)) }
+  big2.set_all_bits
+  bm.report("BitArray total_set (4M)")       { 100.times { big.total_set } }
+  bm.report("BitArray toggle_all_bits (4M)") { 100.times { big.toggle_all_bits } }
+  bm.report("BitArray union (4M)")           { 100.times { big | big2 } }
+  bm.report("BitArray intersect (4M)")       { 100.times { big & big2 } }
+  bm.report("BitArray (&).total_set (4M)")    { 100.times { (big & big2).total_set } }
+  bm.report("BitArray intersect_count (4M)")  { 100.times { big.intersect_count(big2) } }
+  bm.report("BitArray hamming (4M)")          { 100.times { big.hamming(big2) } }
+  bm.report("BitArray jaccard (4M)")          { 100.times { big.jaccard(big2) } }
+  bm.report("BitArray subset_of? (4M)")       { 100.times { big.subset_of?(big2) } }
+  bm.report("BitArray clone (4M)")           { 100.times { big.clone } }
+  bm.report("BitArray each_set_bit (4M)")    { 100.times { big.each_set_bit {|i| i } } }
+  bm.report("BitArray to_indices (4M)")      { 100.times { big.to_indices } }
+  bm.report("BitArray to_bytes (4M)")        { 100.times { big.to_bytes } }
+  bytes = big.to_bytes
+  bm.report("BitArray from_bytes (4M)")      { 100.times { BitArray.from_bytes(bytes) } }
+
+  # Combining many large arrays at once.
+  masks = Array.new(20) do
+    mask = BitArray.new(size)
+    (size / 2).times { mask.set_bit(rand(size)) }
+    mask
+  end
+  bm.report("BitArray inject(:&) (20 x 4M)")  { 10.times { masks.inject(:&) } }
+  bm.report("BitArray.and_all (20 x 4M)")     { 10.times { BitArray.and_all(masks) } }
+  bm.report("BitArray inject(:|) (20 x 4M)")  { 10.times { masks.inject(:|) } }
+  bm.report("BitArray.or_all (20 x 4M)")      { 10.times { BitArray.or_all(masks) } }
+  bm.report("BitArray.threshold (20 x 4M)")   { 10.times { BitArray.threshold(masks, 10) } }
+
+  # Bitmaps made of long runs, compressed with EWAH.
+  runs = BitArray.new(size)
+  runs2 = BitArray.new(size)
+  (0...size).step(1 << 14) {|i| runs.set_bit(i); runs2.set_bit(i + 77) }
+  (0...size).step(1 << 16) {|i| 5000.times {|j| runs[i + j] = 1 } }
+  ewah = runs.to_ewah
+  ewah2 = runs2.to_ewah
+  bm.report("BitArray to_ewah (4M runs)")        { 100.times { runs.to_ewah } }
+  bm.report("BitArray from_ewah (4M runs)")      { 100.times { BitArray.from_ewah(ewah) } }
+  bm.report("BitArray.ewah_and (4M runs)")       { 100.times { BitArray.ewah_and(ewah, ewah2) } }
+  bm.report("BitArray.ewah_or (4M runs)")        { 100.times { BitArray.ewah_or(ewah, ewah2) } }
+  bm.report("BitArray.ewah_total_set (4M runs)") { 100.times { BitArray.ewah_total_set(ewah) } }
+
+  # Sparse bitmaps: 0.1% of a 64M-bit universe set, dense vs compressed.
+  size = 1 << 26
+  sparse = BitArray.new(size)
+  sparse2 = BitArray.new(size)
+  srand(1)
+  (size / 1000).times { sparse.set_bit(rand(size)); sparse2.set_bit(rand(size)) }
+  csparse = CompressedBitArray.new(sparse)
+  csparse2 = CompressedBitArray.new(sparse2)
+  probes = Array.new(100000) { rand(size) }
+  bm.report("BitArray [] (64M sparse)")           { probes.each {|i| sparse[i] } }
+  bm.report("CompressedBitArray [] (64M)")        { probes.each {|i| csparse[i] } }
+  bm.report("BitArray set_bit (64M sparse)")      { probes.each {|i| sparse.set_bit(i) } }
+  bm.report("CompressedBitArray set_bit (64M)")   { probes.each {|i| csparse.set_bit(i) } }
+  bm.report("BitArray set_bits (64M sparse)")     { sparse.set_bits(probes) }
+  bm.report("BitArray all_set? (64M sparse)")     { sparse.all_set?(probes) }
+  bm.report("BitArray total_set (64M sparse)")    { 10.times { sparse.total_set } }
+  bm.report("CompressedBitArray total_set (64M)") { 10.times { csparse.total_set } }
+  bm.report("BitArray & (64M sparse)")            { 10.times { sparse & sparse2 } }
+  bm.report("CompressedBitArray & (64M)")         { 10.times { csparse & csparse2 } }
+  bm.report("BitArray | (64M sparse)")            { 10.times { sparse | sparse2 } }
+  bm.report("CompressedBitArray | (64M)")         { 10.times { csparse | csparse2 } }
+  bm.report("CompressedBitArray.new (64M)")       { 10.times { CompressedBitArray.new(sparse) } }
+  bm.report("CompressedBitArray to_bitarray")     { 10.times { csparse.to_bitarray } }
+
+  # Range operations, against the equivalent single-bit loops.
+  ranged = BitArray.new(10_000_000)
+  bm.report("BitArray clear_bit loop (1M bits)")  { 1_000.upto(1_001_000) {|i| ranged.clear_bit(i) } }
+  bm.report("BitArray clear_range (1M bits)")     { 100.times { ranged.clear_range(1_000, 1_000_000) } }
+  bm.report("BitArray set_range (9M bits)")       { 100.times { ranged.set_range(1_000..9_000_000) } }
+  bm.report("BitArray toggle_range (9M bits)")    { 100.times { ranged.toggle_range(1_000..9_000_000) } }
+  bm.report("BitArray []= range (9M bits)")       { 100.times { ranged[1_000..9_000_000] = 0 } }
 
+  # Copy-on-write clones and views of a 64M array.
+  cow = BitArray.new(1 << 26)
+  bm.report("BitArray dup (64M)")                 { 100.times { cow.dup } }
+  bm.report("BitArray dup + set_bit (64M)")       { 100.times { cow.dup.set_bit(0) } }
+  bm.report("BitArray [] slice (32M of 64M)")     { 100.times { cow[1 << 24, 1 << 25] } }
+  bm.report("BitArray view (32M of 64M)")         { 100.times { cow.view(1 << 24, 1 << 25) } }
+
+  # A random boolean network, one bit at a time and compiled, and a
+  # cellular automaton made of whole-array operations.
+  size = 100_000
+  inputs = Array.new(size) { rand(size) }
+  inputs2 = Array.new(size) { rand(size) }
+  net = BitArray::Network.new(inputs, inputs2, :xor)
+  state = BitArray.new(size).set_bits(Array.new(size / 2) { rand(size) })
+  bm.report("Boolean network, []/[]= (100K)")     { old = state.dup; size.times {|i| state[i] = old[inputs[i]] ^ old[inputs2[i]] } }
+  bm.report("Boolean network, step! (100K)")      { net.step!(state) }
+  bm.report("Boolean network, 100 steps (100K)")  { net.step!(state, 100) }
+  cells = BitArray.new(1_000_000).set_bits(Array.new(1000) { rand(1_000_000) })
+  bm.report("Rule 30, 100 steps (1M)")            { 100.times { cells = cells.rotate(-1) ^ (cells | cells.rotate(1)) } }
+  bm.report("BitArray shift_left (64M)")          { 10.times { cow.shift_left(5) } }
+  bm.report("BitArray shift_left! (64M)")         { 10.times { cow.shift_left!(5) } }
+  bm.report("BitArray rotate! (64M)")             { 10.times { cow.rotate!(-5) } }
+  bm.report("BitArray reverse (64M)")             { 10.times { cow.reverse } }
+  bm.report("BitArray reverse! (64M)")            { 10.times { cow.reverse! } }
+  bm.report("BitArray to_a.reverse (1M)")         { BitArray.new(cow.to_a.first(1_000_000).reverse) }
+
+  # Equality and hashing, against going through to_s.
+  x = BitArray.new(1 << 20)
+  x.set_range(1000, 5000)
+  y = x.dup
+  y.toggle_bit(0)
+  y.toggle_bit(0)
+  bm.report("BitArray == (1M bits)")         { 1000.times { x == y } }
+  bm.report("BitArray to_s == (1M bits)")    { 10.times { x.to_s == y.to_s } }
+  bm.report("BitArray hash (cached)")        { 1000.times { y.hash } }
+  bm.report("BitArray hash (1M bits)")       { 1000.times { y[0] = 0; y.hash } }
+  bm.report("BitArray to_s.hash (1M bits)")  { 10.times { y.to_s.hash } }
+  keys = Array.new(10000) { |i| BitArray.new(256).set_range(i % 256, 1) }
+  bm.report("BitArray as Hash keys (10k)")   { keys.each_with_object({}) { |k, h| h[k] = true } }
+
+  # Bloom filters, 1M keys at a 1% false positive rate.
+  keys = Array.new(1_000_000) { |i| "key#{i}" }
+  [false, true].each do |blocked|
+    name = blocked ? "blocked" : "standard"
+    filter = BitArray::BloomFilter.with_capacity(keys.size, 0.01, blocked)
+    bm.report("BloomFilter add (#{name})")          { keys.each {|k| filter.add(k) } }
+    bm.report("BloomFilter add_all (#{name})")      { filter.add_all(keys) }
+    bm.report("BloomFilter include? (#{name})")     { keys.each {|k| filter.include?(k) } }
+    bm.report("BloomFilter include_all? (#{name})") { filter.include_all?(keys) }
+  end
+
+  # Scaling with BitArray.parallelism, on arrays well past the cutoff.
+  size = 1 << 28
+  huge = BitArray.new(size)
+  huge2 = BitArray.new(size)
+  huge2.set_all_bits
+  [1, 2, 4, 8].each do |n|
+    BitArray.parallelism = n
+    bm.report("BitArray total_set (256M, p=#{n})") { 10.times { huge.total_set } }
+    bm.report("BitArray intersect (256M, p=#{n})") { 10.times { huge & huge2 } }
+    bm.report("BitArray union (256M, p=#{n})")     { 10.times { huge | huge2 } }
+  end
+  BitArray.parallelism = 1
+}
@@ -2,6 +2,8 @@
 # Originally modified from Peter Cooper's BitField test file.
 # http://snippets.dzone.com/posts/show/4234
 require "test/unit"
+require "set"
+require "tmpdir"
 require "bitarray"
 
 class TestLibraryFileName < Test::Unit::TestCase
@@ -101,6 +103,39 @@ class TestLibraryFileName < Test::Unit::TestCase
     assert_equal 2, ba.total_set
   end
 
+  def test_total_set_after_set_all_bits
+    ba = BitArray.new(10)
+    ba.set_all_bits
+    assert_equal 10, ba.total_set
+    ba.toggle_all_bits
+    assert_equal 0, ba.total_set
+  end
+
+  def test_total_set_large
+    ba = BitArray.new(100_000)
+    bits = Array.new(5000) { rand(100_000) }.uniq
+    bits.each {|i| ba.set_bit(i) }
+    assert_equal bits.size, ba.total_set
+    ba.set_all_bits
+    assert_equal 100_000, ba.total_set
+  end
+
+  def test_total_set_range
+    ba = BitArray.new(200)
+    ba.set_all_bits
+    assert_equal 5, ba.total_set(3, 5)
+    assert_equal 100, ba.total_set(50...150)
+    assert_equal 10, ba.total_set(-10, 20)
+    assert_equal 0, ba.total_set(200, 1)
+    ba = BitArray.new(1000)
+    [0, 31, 32, 63, 64, 500, 999].each {|i| ba.set_bit(i) }
+    assert_equal 2, ba.total_set(31..32)
+    assert_equal 5, ba.total_set(1..998)
+    assert_equal ba[17..900].total_set, ba.total_set(17..900)
+    assert_raise(RangeError) { ba.total_set(2000..3000) }
+    assert_raise(IndexError) { ba.total_set(2000, 1) }
+  end
+
   def test_slice_beg_len
     ba = BitArray.new(10)
     ba[1] = 1
@@ -137,6 +172,19 @@ class TestLibraryFileName < Test::Unit::TestCase
     assert_equal "111111100000000000000000000000000000000", ba3.to_s
   end
 
+  def test_concatenation_across_words
+    ba1 = BitArray.new(64)
+    ba2 = BitArray.new(70)
+    ba1.set_bit(63)
+    ba2.set_bit(0)
+    ba2.set_bit(69)
+    ba3 = ba1 + ba2
+    assert_equal 134, ba3.size
+    assert_equal [63, 64, 133], (0...134).select {|i| ba3[i] == 1 }
+    ba3 = ba2 + ba1
+    assert_equal [0, 69, 133], (0...134).select {|i| ba3[i] == 1 }
+  end
+
   def test_concatenation3
     ba1 = BitArray.new(0)
     ba2 = BitArray.new(0)
@@ -211,5 +259,1247 @@ class TestLibraryFileName < Test::Unit::TestCase
     assert_equal "1111111111111111111111111111000000", ba3.to_s
   end
 
-end
+  def test_xor
+    ba1 = BitArray.new("1100110011")
+    ba2 = BitArray.new("10101010101010")
+    ba3 = ba1 ^ ba2
+    assert_equal 14, ba3.size
+    assert_equal "01100110011010", ba3.to_s
+    assert_equal ba3.to_s, (ba2 ^ ba1).to_s
+  end
+
+  def test_difference
+    ba1 = BitArray.new("1111001111")
+    ba2 = BitArray.new("10101")
+    assert_equal "0101001111", (ba1 - ba2).to_s
+    assert_equal "00001", (ba2 - ba1).to_s
+  end
+
+  def test_complement
+    ba = BitArray.new("1100101")
+    assert_equal "0011010", (~ba).to_s
+    assert_equal "1100101", ba.to_s
+    assert_equal 3, (~ba).total_set
+  end
+
+  def test_in_place_operators
+    ba = BitArray.new("1111111111")
+    assert_same ba, ba.and!(BitArray.new("10101"))
+    assert_equal "1010100000", ba.to_s
+    ba.or!(BitArray.new("0000011111111"))
+    assert_equal "1010111111", ba.to_s
+    assert_equal 8, ba.total_set
+    ba.xor!(BitArray.new("11111111111111"))
+    assert_equal "0101000000", ba.to_s
+    assert_equal 2, ba.total_set
+    ba.andnot!(BitArray.new("01"))
+    assert_equal "0001000000", ba.to_s
+  end
+
+  def test_in_place_operators_large
+    ba1 = BitArray.new(1000)
+    ba2 = BitArray.new(1000)
+    300.times { ba1.set_bit(rand(1000)); ba2.set_bit(rand(1000)) }
+    [[:and!, :&], [:or!, :|], [:xor!, :^], [:andnot!, :-]].each do |bang, op|
+      assert_equal ba1.send(op, ba2).to_s, ba1.clone.send(bang, ba2).to_s
+    end
+  end
+
+  def random_bits(n, rng = Random)
+    Array.new(n) { rng.rand(2) }.join
+  end
+
+  # Sizes on either side of the word boundaries.
+  EDGE_SIZES = [1, 63, 64, 65, 127, 1000]
+
+  def test_slice_unaligned
+    str = random_bits(1000)
+    ba = BitArray.new(str)
+    [[0, 1000], [1, 999], [63, 130], [64, 64], [65, 500], [999, 5],
+     [100, 0], [-200, 150]].each do |beg, len|
+      assert_equal str[beg, len], ba[beg, len].to_s
+    end
+    assert_nil ba[-2000, 5]
+  end
+
+  def test_concatenation_unaligned
+    [0, 1, 63, 64, 65, 200].each do |m|
+      [0, 1, 63, 64, 65, 200].each do |n|
+        x, y = random_bits(m), random_bits(n)
+        ba = BitArray.new(x) + BitArray.new(y)
+        assert_equal x + y, ba.to_s
+        assert_equal (x + y).count("1"), ba.total_set
+      end
+    end
+  end
+
+  def test_each_set_bit
+    ba = BitArray.new(300)
+    indices = [0, 5, 63, 64, 128, 250, 299]
+    indices.each {|i| ba.set_bit(i) }
+    found = []
+    assert_same ba, ba.each_set_bit {|i| found << i }
+    assert_equal indices, found
+    assert_equal indices, ba.each_set_bit.to_a
+    assert_equal indices, ba.to_indices
+    assert_equal [], BitArray.new(100).to_indices
+  end
+
+  def test_each_clear_bit
+    ba = BitArray.new(130)
+    ba.set_all_bits
+    [1, 64, 129].each {|i| ba.clear_bit(i) }
+    assert_equal [1, 64, 129], ba.each_clear_bit.to_a
+    ba = BitArray.new(66)
+    ba.set_all_bits
+    assert_equal [], ba.each_clear_bit.to_a
+  end
+
+  def test_first_next_last_set
+    ba = BitArray.new(200)
+    assert_nil ba.first_set
+    assert_nil ba.last_set
+    assert_nil ba.next_set(0)
+    [70, 71, 150].each {|i| ba.set_bit(i) }
+    assert_equal 70, ba.first_set
+    assert_equal 150, ba.last_set
+    assert_equal 70, ba.next_set(0)
+    assert_equal 71, ba.next_set(71)
+    assert_equal 150, ba.next_set(72)
+    assert_equal 150, ba.next_set(-100)
+    assert_nil ba.next_set(151)
+    assert_nil ba.next_set(1000)
+  end
+
+  def test_rank_and_select
+    ba = BitArray.new(10_000)
+    indices = Array.new(800) { rand(10_000) }.uniq.sort
+    indices.each {|i| ba.set_bit(i) }
+    [0, 1, 63, 64, 511, 512, 2047, 2048, 5000, 9999, 10_000].each do |i|
+      assert_equal indices.count {|j| j < i }, ba.rank(i)
+    end
+    indices.each_with_index do |i, k|
+      assert_equal i, ba.select(k)
+      assert_equal k, ba.rank(i)
+    end
+    assert_nil ba.select(indices.size)
+    assert_equal indices.size, ba.rank(ba.size)
+    assert_raise(IndexError) { ba.rank(10_001) }
+
+    # Dense words, where the bit has to be found among many in its word.
+    ba = BitArray.new(5000)
+    indices = (64...5000).select { rand(4) != 0 } + (0...64).to_a
+    indices.sort!
+    indices.each {|i| ba.set_bit(i) }
+    indices.each_with_index do |i, k|
+      assert_equal i, ba.select(k)
+    end
+    assert_nil ba.select(indices.size)
+  end
+
+  def test_rank_after_change
+    ba = BitArray.new(3000)
+    ba.set_bit(2500)
+    assert_equal 1, ba.rank(3000)
+    assert_equal 2500, ba.select(0)
+    ba.set_bit(10)
+    assert_equal 2, ba.rank(3000)
+    assert_equal 10, ba.select(0)
+    ba.toggle_all_bits
+    assert_equal 2998, ba.rank(3000)
+    ba.and!(BitArray.new(100))
+    assert_equal 0, ba.rank(3000)
+    assert_nil ba.select(0)
+  end
+
+  def test_select_with_block
+    ba = BitArray.new("0110001")
+    assert_equal 6, ba.select(2)
+    assert_equal [1, 1, 1], ba.select {|bit| bit == 1 }
+  end
+
+  def test_to_bytes
+    assert_equal "\x0b\x02".b, BitArray.new("1101000001").to_bytes
+    assert_equal "".b, BitArray.new(0).to_bytes
+    ba = BitArray.new(17)
+    ba.set_all_bits
+    assert_equal "\xff\xff\x01".b, ba.to_bytes
+  end
+
+  def test_from_bytes
+    ba = BitArray.from_bytes("\x0b\x02", 10)
+    assert_equal "1101000001", ba.to_s
+    ba = BitArray.from_bytes("\xff\xff", 9)
+    assert_equal 9, ba.total_set
+    assert_equal 16, BitArray.from_bytes("\xff\xff").size
+    assert_raise(ArgumentError) { BitArray.from_bytes("\xff", 9) }
+  end
+
+  def test_bytes_round_trip
+    str = Array.new(1000) { rand(2) }.join
+    ba = BitArray.new(str)
+    assert_equal str, BitArray.from_bytes(ba.to_bytes, 1000).to_s
+  end
+
+  def test_marshal
+    ba = BitArray.new(Array.new(777) { rand(2) }.join)
+    copy = Marshal.load(Marshal.dump(ba))
+    assert_instance_of BitArray, copy
+    assert_equal ba.to_s, copy.to_s
+    assert_equal "", Marshal.load(Marshal.dump(BitArray.new(0))).to_s
+  end
+
+  def test_mmap
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "bits")
+      ba = BitArray.new(Array.new(1000) { rand(2) }.join)
+      File.open(path, "wb") {|f| f.write(ba.to_bytes) }
+
+      mapped = BitArray.mmap(path)
+      assert_equal 1000, mapped.size
+      assert_equal ba.to_s, mapped.to_s
+      assert_equal ba.total_set, mapped.total_set
+      assert mapped.frozen?
+      assert_raise_kind_of(RuntimeError) { mapped.set_bit(0) }
+      assert_raise_kind_of(RuntimeError) { mapped.toggle_all_bits }
+      assert_equal ba.to_s, mapped.dup.toggle_all_bits.toggle_all_bits.to_s
+
+      writable = BitArray.mmap(path, "r+")
+      writable.clear_all_bits
+      writable.set_bit(3)
+      writable.sync
+      assert_equal "\x08".b + "\x00".b * 124, File.binread(path)
+      assert_equal 1, mapped.total_set
+
+      # Hashes of mappings of the same file follow each other's changes.
+      other = BitArray.mmap(path, "r+")
+      writable.hash
+      other.hash
+      other.set_bit(0)
+      assert_equal other.hash, writable.hash
+      assert_equal other, writable
+      assert_equal mapped, writable
+
+      assert_raise(ArgumentError) { BitArray.mmap(path, "w") }
+      assert_raise(Errno::ENOENT) { BitArray.mmap(File.join(dir, "none")) }
+    end
+  end
+
+  def test_mmap_rank_and_select
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "bits")
+      File.binwrite(path, "\x00".b * 4095 + "\x80".b)
+      r = BitArray.mmap(path)
+      w = BitArray.mmap(path, "r+")
+      assert_equal 32767, r.select(0)
+      assert_equal 1, r.rank(r.size)
+
+      # Changes made through another mapping show up in rank and select.
+      w.clear_bit(32767)
+      assert_equal 0, r.total_set
+      assert_equal 0, r.rank(r.size)
+      assert_nil r.select(0)
+      w.set_bit(5)
+      assert_equal 5, r.select(0)
+      assert_equal 1, r.rank(6)
+    end
+  end
+
+  def test_mmap_empty_file
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "empty")
+      File.open(path, "wb") {}
+      assert_equal 0, BitArray.mmap(path).size
+    end
+  end
+
+  def test_large_to_s_and_to_a
+    ba = BitArray.new(20_000_003)
+    ba.set_bit(0)
+    ba.set_bit(-1)
+    str = ba.to_s
+    assert_equal 20_000_003, str.size
+    assert_equal 2, str.count("1")
+    assert_equal "1", str[-1]
+    assert_equal 20_000_003, BitArray.new(str).size
+    a = ba[0, 2_000_001].to_a
+    assert_equal 2_000_001, a.size
+    assert_equal 1, a.inject(:+)
+  end
+
+  def test_init_from_long_str
+    [0, 1, 31, 32, 63, 64, 65, 127, 128, 1000].each do |n|
+      str = Array.new(n) { rand(2) }.join
+      assert_equal str, BitArray.new(str).to_s
+      assert_equal str, BitArray.new(str + "2" + str).to_s
+      assert_equal str.count("1"), BitArray.new(str + "x").total_set
+    end
+  end
+
+  def test_init_from_array_values
+    values = Array.new(300) { [0, 1, nil, false, true, 2**70, 0.0, "0"][rand(8)] }
+    expected = values.map {|v| (v.equal?(0) || !v) ? 0 : 1 }.join
+    assert_equal expected, BitArray.new(values).to_s
+  end
+
+  def test_hex
+    ba = BitArray.new("1101000001")
+    assert_equal "0b02", ba.to_hex
+    assert_equal "1101000001", BitArray.from_hex("0b02", 10).to_s
+    assert_equal "1101000001000000", BitArray.from_hex("0B02").to_s
+    assert_equal "", BitArray.new(0).to_hex
+    assert_raise(ArgumentError) { BitArray.from_hex("0b0") }
+    assert_raise(ArgumentError) { BitArray.from_hex("0g") }
+    assert_raise(ArgumentError) { BitArray.from_hex("0b", 9) }
+    ba = BitArray.new(Array.new(999) { rand(2) }.join)
+    assert_equal ba.to_bytes.unpack("H*").first, ba.to_hex
+    assert_equal ba.to_s, BitArray.from_hex(ba.to_hex, 999).to_s
+  end
+
+  def test_base64
+    [0, 1, 8, 9, 16, 17, 24, 25, 999].each do |n|
+      ba = BitArray.new(Array.new(n) { rand(2) }.join)
+      assert_equal [ba.to_bytes].pack("m0"), ba.to_base64
+      assert_equal ba.to_s, BitArray.from_base64(ba.to_base64, n).to_s
+    end
+    assert_equal 16, BitArray.from_base64("CwI=").size
+    assert_raise(ArgumentError) { BitArray.from_base64("CwI") }
+    assert_raise(ArgumentError) { BitArray.from_base64("C=I=") }
+    assert_raise(ArgumentError) { BitArray.from_base64("Cw*=") }
+  end
+
+  def test_bulk_operations_on_large_arrays
+    size = 20_000_037
+    ba1 = BitArray.new(size)
+    ba2 = BitArray.new(size - 100)
+    ones = [0, 1, 64, 1_000_000, 12_345_677, size - 1]
+    ones.each {|i| ba1.set_bit(i) }
+    ba2.set_all_bits
+    assert_equal ones.size, ba1.total_set
+    assert_equal size - 100, ba2.total_set
+    assert_equal ones.size - 1, (ba1 & ba2).total_set
+    assert_equal size - 99, (ba1 | ba2).total_set
+    assert_equal size - 100 - (ones.size - 1) + 1, (ba1 ^ ba2).total_set
+    assert_equal ones.size, ba1.clone.total_set
+    assert_equal ones.size - 2, ba1[1, size - 2].total_set
+    assert_equal 2 * ones.size, (ba1 + ba1).total_set
+    ba3 = ba1.clone.toggle_all_bits
+    assert_equal size - ones.size, ba3.total_set
+    ba3.and!(ba1)
+    assert_equal 0, ba3.total_set
+  end
+
+  def test_changing_locked_array
+    ba = BitArray.new(50_000_000)
+    errors = []
+    # Keep counting until a change is tried while a count is running.
+    20.times do
+      t = Thread.new { 20.times { ba.total_set } }
+      while t.alive? && errors.size < 10
+        begin
+          ba.set_bit(0)
+          ba.clear_bit(0)
+        rescue ThreadError => e
+          errors << e
+        end
+      end
+      t.join
+      break unless errors.empty?
+    end
+    assert !errors.empty?, "no change was refused while counting"
+    assert errors.all? {|e| e.message =~ /in use/ }
+    # Either change may have been refused, so bit 0 can end up either way.
+    assert_equal ba[0], ba.total_set
+  end
+
+  def test_resizing_array_during_concat
+    x = BitArray.new(50_000_000)
+    y = BitArray.new(10)
+    sizes = [x.size + 10, x.size + 4_000_000]
+    errors = []
+    results = []
+    # Keep concatenating until a resize is tried while the copy of x is
+    # running. y is locked too, so the resize has to be refused.
+    20.times do
+      t = Thread.new { 5.times { results << (x + y) } }
+      while t.alive? && errors.size < 10
+        begin
+          y.resize(10)
+          y.resize(4_000_000)
+        rescue ThreadError => e
+          errors << e
+        end
+      end
+      t.join
+      break unless errors.empty?
+    end
+    assert !errors.empty?, "no resize was refused while concatenating"
+    assert errors.all? {|e| e.message =~ /in use/ }
+    results.each do |z|
+      assert sizes.include?(z.size)
+      assert_equal 0, z.total_set
+    end
+  end
+
+  def test_rank_of_locked_array
+    ba = BitArray.new(100_000_000)
+    t = Thread.new { 11.times { ba.toggle_all_bits } }
+    ba.rank(ba.size) while t.alive?
+    t.join
+    # An index built while the bits were changing isn't kept.
+    assert_equal ba.total_set, ba.rank(ba.size)
+    assert_equal 0, ba.select(0)
+  end
+
+  def test_parallelism
+    assert_equal 1, BitArray.parallelism
+    assert_raise(ArgumentError) { BitArray.parallelism = 0 }
+
+    size = 40_000_003
+    ba1 = BitArray.new(size)
+    ba2 = BitArray.new(size)
+    ones = [0, 5, 2_000_000, 2_097_151, 2_097_152, 33_333_333, size - 1]
+    ones.each {|i| ba1.set_bit(i) }
+    ba2.set_all_bits
+    expected = [ba1.total_set, (ba1 | ba2).total_set, (ba1 ^ ba2).total_set,
+                ba1[3, size - 3].total_set, (ba1 + ba1).to_indices]
+
+    [2, 3, 8, 1].each do |n|
+      BitArray.parallelism = n
+      assert_equal n, BitArray.parallelism
+      assert_equal expected, [ba1.total_set, (ba1 | ba2).total_set,
+                              (ba1 ^ ba2).total_set, ba1[3, size - 3].total_set,
+                              (ba1 + ba1).to_indices]
+    end
+  ensure
+    BitArray.parallelism = 1
+  end
+
+  def test_parallel_intersects
+    BitArray.parallelism = 4
+    size = 40_000_003
+    x = BitArray.new(size)
+    y = BitArray.new(size).set_all_bits
+    assert !x.intersects?(BitArray.new(size))
+    assert x.subset_of?(y)
+    [0, 1_000_000, 20_000_000, size - 1].each do |i|
+      x.set_bit(i)
+      assert x.intersects?(y)
+      assert !x.subset_of?(~y)
+      assert !y.subset_of?(x)
+      x.clear_bit(i)
+    end
+  ensure
+    BitArray.parallelism = 1
+  end
+
+  def test_push_and_pop
+    ba = BitArray.new(0)
+    assert_nil ba.pop
+    expected = ""
+    200.times do |i|
+      bit = (i % 3 == 0) ? 1 : 0
+      ba << bit
+      expected << bit.to_s
+    end
+    assert_equal expected, ba.to_s
+    assert_equal 200, ba.size
+    assert_equal expected.count("1"), ba.total_set
+
+    ba.push(1, 1, 0)
+    assert_equal expected + "110", ba.to_s
+    assert_equal 0, ba.pop
+    assert_equal 1, ba.pop
+    assert_equal 1, ba.pop
+    assert_equal expected, ba.to_s
+    assert_raise(ArgumentError) { ba << 2 }
+    assert_equal 200, ba.size
+
+    130.times { ba.pop }
+    assert_equal expected[0, 70], ba.to_s
+    ba << 0
+    assert_equal expected[0, 70] + "0", ba.to_s
+  end
+
+  def test_resize
+    ba = BitArray.new(100)
+    ba.set_all_bits
+    assert_equal ba, ba.resize(70)
+    assert_equal "1" * 70, ba.to_s
+    ba.resize(130)
+    assert_equal "1" * 70 + "0" * 60, ba.to_s
+    assert_equal 70, ba.total_set
+    ba.resize(0)
+    assert_equal "", ba.to_s
+    ba.resize(5)
+    assert_equal "00000", ba.to_s
+    assert_raise(ArgumentError) { ba.resize(-1) }
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "bits")
+      File.binwrite(path, "\xff" * 8)
+      mapped = BitArray.mmap(path, "r+")
+      assert_raise(TypeError) { mapped << 1 }
+      assert_equal 64, mapped.size
+    end
+  end
+
+  # A BitArray with a sparse chunk, a dense chunk, a chunk of runs, and a few
+  # bits in the last, partial, chunk.
+  def compressed_fixture
+    ba = BitArray.new(5 * 65536 + 100)
+    [3, 700, 65535].each {|i| ba.set_bit(i) }
+    (65536...2 * 65536).step(7) {|i| ba.set_bit(i) }
+    (3 * 65536 + 10...3 * 65536 + 30000).each {|i| ba.set_bit(i) }
+    (4 * 65536 - 100...4 * 65536 + 200).each {|i| ba.set_bit(i) }
+    ba.set_bit(5 * 65536 + 99)
+    ba
+  end
+
+  def test_compressed_conversion
+    ba = compressed_fixture
+    cb = CompressedBitArray.new(ba)
+    assert_equal ba.size, cb.size
+    assert_equal ba.total_set, cb.total_set
+    assert_equal ba.to_indices, cb.to_indices
+    assert_equal ba.to_s, cb.to_bitarray.to_s
+    [0, 3, 4, 65535, 65536, 65543, 65544, 3 * 65536 + 9, 3 * 65536 + 10,
+     4 * 65536 + 199, 4 * 65536 + 200, -1, -2].each do |i|
+      assert_equal ba[i], cb[i], "bit #{i}"
+    end
+    assert_raise(IndexError) { cb[ba.size] }
+
+    empty = CompressedBitArray.new(1000)
+    assert_equal 0, empty.total_set
+    assert_equal [], empty.to_indices
+    assert_equal "0" * 1000, empty.to_bitarray.to_s
+    assert_equal [0] * 1000, empty.each.to_a
+  end
+
+  def test_compressed_set_and_clear
+    ba = compressed_fixture
+    cb = CompressedBitArray.new(ba)
+    rng = Random.new(14)
+    3000.times do
+      i = rng.rand(ba.size)
+      if rng.rand(2) == 0
+        ba.set_bit(i)
+        cb.set_bit(i)
+      else
+        ba.clear_bit(i)
+        cb[i] = 0
+      end
+    end
+    # Grow an array container into a bitmap, then shrink it back.
+    (0...5000).each {|i| ba.set_bit(2 * 65536 + i * 3); cb[2 * 65536 + i * 3] = 1 }
+    assert_equal ba.to_indices, cb.to_indices
+    (0...5000).each {|i| ba.clear_bit(2 * 65536 + i * 3); cb.clear_bit(2 * 65536 + i * 3) }
+    assert_equal ba.to_indices, cb.to_indices
+    assert_equal ba.total_set, cb.total_set
+    assert_equal ba.to_s, cb.to_bitarray.to_s
+
+    copy = cb.dup
+    copy.set_bit(0)
+    assert_not_equal copy.total_set, cb.total_set
+    assert_raise(ArgumentError) { cb[0] = 2 }
+  end
 
+  def test_compressed_operators
+    x = compressed_fixture
+    y = BitArray.new(3 * 65536 + 5000)
+    rng = Random.new(15)
+    20000.times { y.set_bit(rng.rand(y.size)) }
+    (65536...2 * 65536).each {|i| y.set_bit(i) if i % 3 == 0 }
+    cx = CompressedBitArray.new(x)
+    cy = CompressedBitArray.new(y)
+
+    assert_equal((x & y).to_s, (cx & cy).to_bitarray.to_s)
+    assert_equal((x | y).to_s, (cx | cy).to_bitarray.to_s)
+    assert_equal((y & x).to_s, (cy & cx).to_bitarray.to_s)
+    assert_equal((y | x).total_set, (cy | cx).total_set)
+    assert_equal((x & y).to_indices, (cx & cy).each_set_bit.to_a)
+    assert_raise(TypeError) { cx & x }
+    assert_raise(TypeError) { x & cx }
+    assert_raise(TypeError) { x.dup.xor!(cx) }
+  end
+
+  def test_operators_need_bitarrays
+    x = BitArray.new(1000)
+    others = [CompressedBitArray.new(BitArray.new(10)),
+              BitArray::BloomFilter.new(1000, 3), "1010", 5, nil]
+    others.each do |y|
+      [:+, :&, :|, :^, :-, :and!, :or!, :xor!, :andnot!, :intersect_count,
+       :union_count, :xor_count, :jaccard, :intersects?, :subset_of?].each do |op|
+        assert_raise(TypeError) { x.send(op, y) }
+      end
+      assert_raise(TypeError) { x.send(:initialize_copy, y) }
+    end
+    assert_equal 1000, x.size
+  end
+
+  # Runs of zeros and ones of assorted lengths, with some noise.
+  def ewah_fixture(size, seed)
+    rng = Random.new(seed)
+    ba = BitArray.new(size)
+    i = rng.rand(300)
+    while i < size
+      len = [rng.rand(700), size - i].min
+      len.times {|j| ba.set_bit(i + j) }
+      i += len + rng.rand(900)
+      ba.set_bit(i) if i < size && rng.rand(2) == 0
+      i += 1
+    end
+    ba
+  end
+
+  def test_ewah
+    [0, 1, 64, 100, 6400, 20_000, 20_031].each do |size|
+      ba = ewah_fixture(size, size)
+      ewah = ba.to_ewah
+      assert_equal Encoding::BINARY, ewah.encoding
+      assert_equal ba.to_s, BitArray.from_ewah(ewah).to_s
+      assert_equal ba.total_set, BitArray.ewah_total_set(ewah)
+    end
+
+    ones = BitArray.new(100_000)
+    ones.set_all_bits
+    assert ones.to_ewah.bytesize < 64
+    assert_equal ones.to_s, BitArray.from_ewah(ones.to_ewah).to_s
+    assert_equal 100_000, BitArray.ewah_total_set(ones.to_ewah)
+
+    assert_raise(ArgumentError) { BitArray.from_ewah("abc") }
+    assert_raise(ArgumentError) { BitArray.from_ewah(ones.to_ewah[0..-2]) }
+    assert_raise(ArgumentError) { BitArray.ewah_total_set([65].pack("Q<")) }
+  end
+
+  def test_ewah_operators
+    sizes = [[20_000, 20_000], [20_031, 9_000], [100, 130], [6400, 6430]]
+    sizes.each_with_index do |(x_size, y_size), i|
+      x = ewah_fixture(x_size, i)
+      y = ewah_fixture(y_size, i + 100)
+      y.set_all_bits if i == 3
+      and_ewah = BitArray.ewah_and(x.to_ewah, y.to_ewah)
+      or_ewah = BitArray.ewah_or(x.to_ewah, y.to_ewah)
+      assert_equal((x & y).to_s, BitArray.from_ewah(and_ewah).to_s)
+      assert_equal((x | y).to_s, BitArray.from_ewah(or_ewah).to_s)
+      assert_equal((x & y).total_set, BitArray.ewah_total_set(and_ewah))
+      assert_equal((x | y).total_set, BitArray.ewah_total_set(or_ewah))
+      assert_equal((x | y).to_ewah, or_ewah)
+      assert_equal((y & x).to_ewah, BitArray.ewah_and(y.to_ewah, x.to_ewah))
+    end
+  end
+
+  def test_multiway_operations
+    a = BitArray.new("1100110011")
+    b = BitArray.new("1010101")
+    c = BitArray.new("100110011011")
+    assert_equal((a & b & c).to_s, BitArray.and_all([a, b, c]).to_s)
+    assert_equal((a | b | c).to_s, BitArray.or_all([a, b, c]).to_s)
+    assert_equal a.to_s, BitArray.and_all([a]).to_s
+    assert_equal "100010001000", BitArray.threshold([a, b, c], 2).to_s
+    assert_equal BitArray.threshold([a, b, c], 2).to_s, BitArray.majority([a, b, c]).to_s
+    assert_equal((a | b | c).to_s, BitArray.threshold([a, b, c], 1).to_s)
+    assert_equal "0" * 12, BitArray.threshold([a, b, c], 4).to_s
+    assert_raise(ArgumentError) { BitArray.and_all([]) }
+    assert_raise(ArgumentError) { BitArray.threshold([a], 0) }
+    assert_raise(TypeError) { BitArray.or_all([a, "101"]) }
+
+    # Enough inputs to need several counter slices, across several blocks.
+    rng = Random.new(16)
+    size = 64 * 200 + 13
+    list = Array.new(37) do |k|
+      ba = BitArray.new(size - rng.rand(100))
+      (size / 3).times { ba.set_bit(rng.rand(ba.size)) }
+      ba
+    end
+    counts = Array.new(size, 0)
+    list.each {|ba| ba.each_set_bit {|i| counts[i] += 1 } }
+    [1, 2, 5, 18, 19, 37].each do |t|
+      expected = counts.map {|n| n >= t ? 1 : 0 }.join
+      assert_equal expected, BitArray.threshold(list, t).to_s, "threshold #{t}"
+    end
+    assert_equal list.inject(:&).to_s, BitArray.and_all(list).to_s
+    assert_equal list.inject(:|).to_s, BitArray.or_all(list).to_s
+  end
+
+  def test_fused_counts
+    rng = Random.new(17)
+    [[10, 10], [100, 70], [5000, 9000], [64 * 300, 64 * 300 + 1]].each do |xs, ys|
+      x = BitArray.new(xs)
+      y = BitArray.new(ys)
+      (xs / 2).times { x.set_bit(rng.rand(xs)) }
+      (ys / 2).times { y.set_bit(rng.rand(ys)) }
+      [[x, y], [y, x]].each do |a, b|
+        assert_equal((a & b).total_set, a.intersect_count(b))
+        assert_equal((a | b).total_set, a.union_count(b))
+        assert_equal((a ^ b).total_set, a.xor_count(b))
+        assert_equal((a ^ b).total_set, a.hamming(b))
+        assert_in_delta((a & b).total_set.to_f / (a | b).total_set, a.jaccard(b), 1e-12)
+        assert_equal((a & b).total_set > 0, a.intersects?(b))
+        assert_equal((a - b).total_set == 0, a.subset_of?(b))
+      end
+    end
+
+    # Big enough to run without the GVL, and across the worker pool.
+    x = BitArray.from_bytes(rng.bytes(5_000_000), 40_000_000)
+    y = BitArray.from_bytes(rng.bytes(5_000_001), 40_000_003)
+    both = (x & y).total_set
+    either = (x | y).total_set
+    begin
+      [1, 4].each do |n|
+        BitArray.parallelism = n
+        assert_equal both, x.intersect_count(y)
+        assert_equal either, y.union_count(x)
+        assert_in_delta both.to_f / either, x.jaccard(y), 1e-12
+        assert_in_delta both.to_f / either, y.jaccard(x), 1e-12
+      end
+    ensure
+      BitArray.parallelism = 1
+    end
+  end
+
+  def test_intersects_and_subset
+    a = BitArray.new("0010000000")
+    b = BitArray.new("0110")
+    c = BitArray.new("1101")
+    assert a.intersects?(b)
+    assert !a.intersects?(c)
+    assert a.subset_of?(b)
+    assert !b.subset_of?(a)
+    assert !BitArray.new("00000000001").subset_of?(b)
+    assert BitArray.new("0000000000").subset_of?(BitArray.new(0))
+    assert_equal 1.0, BitArray.new(10).jaccard(BitArray.new(20))
+  end
+
+  def test_batch_bits
+    ba = BitArray.new(200)
+    assert_equal ba, ba.set_bits([3, 70, 199, -2, 3])
+    assert_equal [3, 70, 198, 199], ba.to_indices
+    assert_equal [1, 0, 1, 1], ba.get_bits([3, 4, 70, -1])
+    assert ba.all_set?([3, 70, 199])
+    assert !ba.all_set?([3, 71, 199])
+    assert ba.any_set?([0, 1, 199])
+    assert !ba.any_set?([0, 1, 2])
+    assert ba.all_set?([])
+    assert !ba.any_set?([])
+    ba.clear_bits([70, -1])
+    assert_equal [3, 198], ba.to_indices
+
+    packed = [5, 150, -3].pack("q*")
+    ba.set_bits(packed)
+    assert_equal [3, 5, 150, 197, 198], ba.to_indices
+    assert_equal [1, 1, 1], ba.get_bits(packed)
+    assert ba.all_set?(packed)
+    ba.clear_bits(packed)
+    assert !ba.any_set?(packed)
+
+    # Nothing changes if any index is bad.
+    assert_raise(IndexError) { ba.set_bits([1, 2, 200]) }
+    assert_raise(IndexError) { ba.set_bits([-201]) }
+    assert_raise(IndexError) { ba.get_bits([-1000].pack("q*")) }
+    assert_raise(ArgumentError) { ba.set_bits("abc") }
+    assert_equal [3, 198], ba.to_indices
+
+    # An index whose to_int shrinks the BitArray.
+    ba = BitArray.new(600)
+    keep = []
+    evil = Object.new
+    evil.define_singleton_method(:to_int) { ba.resize(300); keep << ba.dup; 0 }
+    assert_raise(IndexError) { ba.set_bits((512...600).to_a + [evil]) }
+    assert_equal 300, ba.size
+    assert_equal 0, ba.total_set
+    assert_equal 0, keep[0].total_set
+
+    rng = Random.new(18)
+    big = BitArray.new(100_000)
+    indices = Array.new(5000) { rng.rand(big.size) }
+    big.set_bits(indices)
+    assert_equal indices.uniq.sort, big.to_indices
+    assert_equal [1] * 5000, big.get_bits(indices)
+  end
+
+  def test_bloom_filter
+    [false, true].each do |blocked|
+      f = BitArray::BloomFilter.new(1000, 3, blocked)
+      assert_equal (blocked ? 1024 : 1000), f.size
+      assert_equal 3, f.hashes
+      assert_equal blocked, f.blocked?
+      assert_equal f, f.add("apple")
+      f << "banana" << 42
+      assert f.include?("apple")
+      assert f.include?("banana")
+      assert f.include?(42)
+      assert !f.include?("cherry")
+      assert_equal 9, f.bitmap.total_set
+
+      f.add_all(%w{cherry date})
+      assert f.include_all?(["apple", 42, "cherry", "date"])
+      assert !f.include_all?(["apple", "elderberry"])
+      assert f.include_all?([])
+
+      # The bitmap is a plain BitArray, and a filter can be rebuilt from it.
+      g = BitArray::BloomFilter.new(BitArray.new(f.bitmap.to_s), 3, blocked)
+      assert g.include_all?(["apple", 42, "cherry", "date"])
+      f.bitmap.clear_all_bits
+      assert !f.include?("apple")
+    end
+
+    assert_raise(ArgumentError) { BitArray::BloomFilter.new(0, 3) }
+    assert_raise(ArgumentError) { BitArray::BloomFilter.new(1000, 0) }
+    assert_raise(ArgumentError) { BitArray::BloomFilter.new(BitArray.new(1000), 3, true) }
+    assert_raise(TypeError) { BitArray::BloomFilter.new(1000, 3).add_all("apple") }
+
+    # Integers that fit in 64 bits are hashed by value, whether or not they're
+    # Fixnums; bigger ones by their to_s.
+    bitmap = lambda { |key| BitArray::BloomFilter.new(1000, 3).add(key).bitmap }
+    [42, 2**40, 2**62, 2**63 - 1, -2**63].each do |n|
+      assert_not_equal bitmap[n.to_s], bitmap[n]
+    end
+    [2**63, -2**63 - 1, 2**64 - 1, 2**100].each do |n|
+      assert_equal bitmap[n.to_s], bitmap[n]
+    end
+
+    # Keys whose to_s empties the Array being added.
+    keys = (0...40).map { |i| "key#{i}" }
+    evil = Object.new
+    evil.define_singleton_method(:to_s) { keys.clear; "evil" }
+    keys[3] = evil
+    f = BitArray::BloomFilter.new(1000, 3)
+    f.add_all(keys)
+    assert f.include?("key39")
+    assert f.include?("evil")
+  end
+
+  def test_bloom_filter_sizing_and_merge
+    f = BitArray::BloomFilter.with_capacity(1000, 0.01)
+    assert_equal 9586, f.size
+    assert_equal 7, f.hashes
+    assert_raise(ArgumentError) { BitArray::BloomFilter.with_capacity(1000, 1.5) }
+    assert_raise(ArgumentError) { BitArray::BloomFilter.with_capacity(0, 0.01) }
+
+    keys = (0...1000).map { |i| "key#{i}" }
+    f.add_all(keys)
+    assert keys.all? { |k| f.include?(k) }
+    false_positives = (0...10000).count { |i| f.include?("other#{i}") }
+    assert false_positives < 200
+
+    a = BitArray::BloomFilter.with_capacity(1000, 0.01)
+    b = a.dup
+    a.add_all(keys[0, 500])
+    b.add_all(keys[500, 500])
+    assert !b.include?(keys[0])
+    c = a | b
+    assert c.include_all?(keys)
+    assert !a.include?(keys[999])
+    a.merge!(b)
+    assert_equal f.bitmap.to_s, a.bitmap.to_s
+    assert_equal f.bitmap.to_s, c.bitmap.to_s
+
+    assert_raise(ArgumentError) { a.merge!(BitArray::BloomFilter.new(a.size, 6)) }
+    assert_raise(ArgumentError) { a | BitArray::BloomFilter.new(100, 7) }
+    assert_raise(TypeError) { a.merge!(a.bitmap) }
+  end
+
+  def test_range_operations
+    ba = BitArray.new(200)
+    assert_equal ba, ba.set_range(3, 5)
+    assert_equal [3, 4, 5, 6, 7], ba.to_indices
+    ba.set_range(60..130)
+    assert_equal 76, ba.total_set
+    ba.clear_range(62...129)
+    assert_equal [3, 4, 5, 6, 7, 60, 61, 129, 130], ba.to_indices
+    ba.toggle_range(-10, 20)
+    assert_equal (190..199).to_a, ba.to_indices.last(10)
+    ba.toggle_range(0..-1)
+    assert_equal 200 - 19, ba.total_set
+    ba.set_range(10, 0)
+    ba.clear_range(200, 5)
+    assert_equal 200 - 19, ba.total_set
+
+    ba = BitArray.new(20)
+    ba[2..5] = 1
+    ba[4, 3] = 0
+    assert_equal "00110000000000000000", ba.to_s
+    ba[-3..-1] = 1
+    ba[15..100] = 1
+    assert_equal "00110000000000011111", ba.to_s
+    assert_equal 0, (ba[0...20] = 0)
+    assert_equal 0, ba.total_set
+
+    assert_raise(ArgumentError) { ba[0..3] = 2 }
+    assert_raise(RangeError) { ba[21..25] = 1 }
+    assert_raise(IndexError) { ba[-21, 2] = 1 }
+    assert_raise(IndexError) { ba.set_range(5, -1) }
+    assert_raise(TypeError) { ba.set_range("a") }
+    assert_raise(ArgumentError) { ba.[]=(1) }
+    assert_raise(ArgumentError) { ba.[]=(1, 2, 3, 4) }
+
+    # Check ranges against single bits, including ones big enough to be done
+    # in parallel.
+    rng = Random.new(20)
+    [1000, 5_000_000].each do |size|
+      ba = BitArray.new(size)
+      20.times do
+        beg = rng.rand(size)
+        len = rng.rand(size - beg + 1)
+        inside = ba.total_set(beg, len)
+        outside = ba.total_set - inside
+        ba.toggle_range(beg, len)
+        assert_equal outside + len - inside, ba.total_set
+        ba.toggle_range(beg...beg + len)
+        assert_equal inside, ba.total_set(beg, len)
+        ba[beg, len] = 1
+        assert_equal len, ba.total_set(beg, len)
+        ba.clear_range(beg, len)
+        assert_equal 0, ba.total_set(beg, len)
+        ba.toggle_range(beg, len)
+        assert_equal outside + len, ba.total_set
+      end
+    end
+  end
+
+  def test_copy_on_write
+    # Big enough not to be stored inline, which is copied instead of shared.
+    a = BitArray.new("1010" * 200)
+    b = a.clone
+    c = a.dup
+    b.set_bit(1)
+    assert_equal "1110", b.to_s[0, 4]
+    assert_equal "1010", a.to_s[0, 4]
+    a.clear_bit(0)
+    assert_equal "0010", a.to_s[0, 4]
+    assert_equal "1010" * 200, c.to_s
+
+    # Every kind of change gets its own copy first.
+    [
+      lambda { |x| x.toggle_all_bits },
+      lambda { |x| x.set_range(3..150) },
+      lambda { |x| x[0, 10] = 0 },
+      lambda { |x| x.and!(BitArray.new(800)) },
+      lambda { |x| x.xor!(BitArray.new("1" * 800)) },
+      lambda { |x| x.set_bits([5, 7, 799]) },
+      lambda { |x| x.push(1) },
+      lambda { |x| x.pop },
+      lambda { |x| x.resize(2000).set_bit(1999) },
+    ].each do |change|
+      orig = c.dup
+      copy = orig.clone
+      change.call(copy)
+      assert_equal "1010" * 200, orig.to_s
+      expected = BitArray.new("1010" * 200)
+      change.call(expected)
+      assert_equal expected.to_s, copy.to_s
+    end
+
+    # A copy taken after a change sees it, and a copy of a copy is separate.
+    d = c.dup
+    d.set_bit(-1)
+    e = d.dup
+    f = e.dup
+    e.clear_bit(-1)
+    assert_equal 1, d[-1]
+    assert_equal 0, e[-1]
+    assert_equal 1, f[-1]
+    assert_equal "1010" * 200, c.to_s
+  end
+
+  def test_view
+    a = BitArray.new(300)
+    a.set_range(60, 80)
+    v = a.view(64, 128)
+    assert_equal 128, v.size
+    assert_equal a[64, 128].to_s, v.to_s
+    assert_equal 76, v.total_set
+    assert_equal a[128..-1].to_s, a.view(128..-1).to_s
+    assert_equal a.to_s, a.view(0, 1000).to_s
+    assert_equal 0, a.view(256, 0).size
+    assert_equal a[256, 44].to_s, a.view(-44, 64).to_s
+
+    # Changing either side leaves the other alone.
+    v.set_bit(127)
+    assert_equal 0, a[191]
+    a.clear_all_bits
+    assert_equal 77, v.total_set
+    w = v.view(64..-1)
+    w.toggle_all_bits
+    assert_equal 77, v.total_set
+    assert_equal 64 - 13, w.total_set
+
+    # Views outlive the arrays they came from, and can grow.
+    x = BitArray.new("1" * 1000).view(512, 488)
+    GC.start
+    assert_equal 488, x.total_set
+    x.push(0, 1)
+    x.resize(5000)
+    assert_equal 489, x.total_set
+    assert_equal "1101", x[486, 4].to_s
+
+    assert_raise(ArgumentError) { a.view(1, 64) }
+    assert_raise(ArgumentError) { a.view(64, 65) }
+    assert_raise(ArgumentError) { a.view(0...100) }
+    assert_raise(IndexError) { a.view(301, 1) }
+  end
+
+  def test_shift_and_rotate
+    ba = BitArray.new("1100101")
+    assert_equal "1001010", ba.shift_left(1).to_s
+    assert_equal "0101000", ba.shift_left(3).to_s
+    assert_equal "0110010", ba.shift_right(1).to_s
+    assert_equal "0110010", ba.shift_left(-1).to_s
+    assert_equal "0000000", ba.shift_left(7).to_s
+    assert_equal "0000000", ba.shift_right(2**62).to_s
+    assert_equal "0000000", ba.shift_right(-2**63).to_s
+    assert_equal ba.to_s, ba.shift_left(0).to_s
+    assert_equal "1001011", ba.rotate.to_s
+    assert_equal "0101110", ba.rotate(3).to_s
+    assert_equal "1110010", ba.rotate(-1).to_s
+    assert_equal ba.to_s, ba.rotate(14).to_s
+    assert_equal "1100101", ba.to_s
+    assert_equal "", BitArray.new(0).rotate(3).to_s
+    assert_equal "", BitArray.new(0).shift_left(3).to_s
+
+    rng = Random.new(22)
+    EDGE_SIZES.each do |size|
+      ba = BitArray.new(random_bits(size, rng))
+      bits = ba.to_a
+      [1, 5, 63, 64, 65, size - 1].each do |n|
+        assert_equal bits.rotate(n), ba.rotate(n).to_a
+        assert_equal bits.rotate(-n), ba.rotate(-n).to_a
+        assert_equal bits.drop(n) + [0] * [n, size].min, ba.shift_left(n).to_a
+        assert_equal ([0] * [n, size].min + bits).first(size), ba.shift_right(n).to_a
+        assert_equal ba.shift_left(n).total_set, ba.shift_left(n).to_a.count(1)
+      end
+    end
+  end
+
+  def test_network
+    ops = { and: 8, or: 14, xor: 6, nand: 7, nor: 1, xnor: 9 }
+    net = BitArray::Network.new([1, 2, 0], [2, 0, 1], [:and, :or, :xor])
+    assert_equal 3, net.size
+    assert_equal "010", net.call(BitArray.new("110")).to_s
+
+    rng = Random.new(22)
+    [1, 64, 100, 3000].each do |size|
+      a = Array.new(size) { rng.rand(size) }
+      b = Array.new(size) { rng.rand(size) }
+      fs = Array.new(size) { [*ops.keys, *0..15].sample(random: rng) }
+      net = BitArray::Network.new(a, b, fs)
+      state = BitArray.new(random_bits(size, rng))
+      expected = state.to_a
+      out = BitArray.new(size)
+      3.times do |step|
+        expected = Array.new(size) do |i|
+          table = fs[i].is_a?(Symbol) ? ops[fs[i]] : fs[i]
+          (table >> (expected[a[i]] * 2 + expected[b[i]])) & 1
+        end
+        input = state.dup
+        assert_equal out, net.call(input, out)
+        assert_equal expected, out.to_a
+        assert_equal expected, net.call(input).to_a
+        assert_equal state, net.step!(state)
+        assert_equal expected, state.to_a
+        assert_equal expected.count(1), state.total_set
+      end
+      copy = state.dup
+      net.step!(state, 4)
+      4.times { copy = net.call(copy) }
+      assert_equal copy.to_s, state.to_s
+    end
+
+    # One operation for every output, and inputs from a bigger array.
+    net = BitArray::Network.new([0, 2, 4], [1, 3, 5], :xor)
+    assert_equal "100", net.call(BitArray.new("1000111")).to_s
+    assert_raise(IndexError) { net.call(BitArray.new(5)) }
+    assert_raise(ArgumentError) { net.step!(BitArray.new(6)) }
+    assert_raise(ArgumentError) { net.call(BitArray.new(6), BitArray.new(4)) }
+    s = BitArray.new(3)
+    assert_raise(ArgumentError) { BitArray::Network.new([0], [0], :xor).call(s, s) }
+    assert_raise(TypeError) { net.call("101") }
+
+    assert_raise(ArgumentError) { BitArray::Network.new([0], [0, 1], :and) }
+    assert_raise(ArgumentError) { BitArray::Network.new([0], [0], [:and, :or]) }
+    assert_raise(ArgumentError) { BitArray::Network.new([0], [0], :implies) }
+    assert_raise(ArgumentError) { BitArray::Network.new([0], [0], 16) }
+    assert_raise(IndexError) { BitArray::Network.new([0], [-1], :and) }
+    huge = BitArray::Network.new([2**63 - 1], [0], :and)
+    assert_raise(IndexError) { huge.call(BitArray.new(10)) }
+    assert_raise(IndexError) { huge.step!(BitArray.new(1)) }
+  end
+
+  def test_network_step_from_two_threads
+    # Big enough to run without the GVL, so that the steps overlap.
+    size = 1 << 23
+    inputs = (0...size).to_a
+    net = BitArray::Network.new(inputs, inputs, :and)
+    ones = BitArray.new(size).set_all_bits
+    zeros = BitArray.new(size)
+    [ones, zeros].map { |state| Thread.new { net.step!(state, 4) } }.each(&:join)
+    assert_equal size, ones.total_set
+    assert_equal 0, zeros.total_set
+  end
+
+  def test_in_place_shift_rotate_and_reverse
+    ba = BitArray.new("1100101")
+    assert_equal "1010011", ba.reverse.to_s
+    assert_equal "1100101", ba.to_s
+    assert_equal ba, ba.reverse!
+    assert_equal "1010011", ba.to_s
+    assert_equal "0100110", ba.shift_left!(1).to_s
+    assert_equal "0001001", ba.shift_right!(2).to_s
+    assert_equal "0010010", ba.rotate!.to_s
+    assert_equal "1000100", ba.rotate!(-2).to_s
+    assert_equal "0000000", ba.shift_right!(10).to_s
+    assert_equal "", BitArray.new(0).reverse!.to_s
+
+    rng = Random.new(23)
+    EDGE_SIZES.each do |size|
+      ba = BitArray.new(random_bits(size, rng))
+      bits = ba.to_a
+      assert_equal bits.reverse, ba.reverse.to_a
+      assert_equal bits.count(1), ba.reverse.total_set
+      [0, 1, 7, 64, 65, size].each do |n|
+        assert_equal ba.shift_left(n).to_s, ba.dup.shift_left!(n).to_s
+        assert_equal ba.shift_right(n).to_s, ba.dup.shift_right!(n).to_s
+        assert_equal ba.rotate(-n).to_s, ba.dup.rotate!(-n).to_s
+      end
+      copy = ba.dup
+      assert_equal bits.reverse, copy.reverse!.to_a
+      assert_equal bits, copy.reverse!.to_a
+      assert_equal bits, ba.to_a
+    end
+
+    # Clones are unaffected, and growing afterwards still works.
+    ba = BitArray.new("1" * 100)
+    copy = ba.clone
+    ba.shift_left!(30)
+    assert_equal 100, copy.total_set
+    assert_equal 70, ba.total_set
+    ba.push(1)
+    assert_equal 71, ba.total_set
+  end
+
+  def test_equality_hashing_and_comparison
+    a = BitArray.new("1100101")
+    b = BitArray.new("1100101")
+    assert_equal a, b
+    assert a.eql?(b)
+    assert_equal a.hash, b.hash
+    assert_not_equal a, BitArray.new("1100100")
+    assert_not_equal a, BitArray.new("11001010")
+    assert_not_equal a, "1100101"
+    assert !a.eql?([1, 1, 0, 0, 1, 0, 1])
+    assert_equal BitArray.new(0), BitArray.new(0)
+
+    # Hash keys and Set members.
+    h = { a => :a }
+    assert_equal :a, h[b]
+    assert_equal :a, h[a.dup]
+    assert_nil h[BitArray.new("1100100")]
+    assert_equal 1, Set.new([a, b, a.clone]).size
+    assert_equal 2, [a, b, ~a].uniq.size
+
+    # The cached hash goes away when the bits change.
+    h = a.hash
+    a[0] = 0
+    assert_not_equal a, b
+    assert_equal BitArray.new("0100101").hash, a.hash
+    a[0] = 1
+    assert_equal h, a.hash
+    c = b.dup
+    c.toggle_all_bits
+    assert_not_equal b.hash, c.hash
+    c.toggle_all_bits
+    assert_equal b.hash, c.hash
+
+    # Sizes that don't fill the last word.
+    rng = Random.new(24)
+    EDGE_SIZES.each do |size|
+      bits = random_bits(size, rng)
+      x = BitArray.new(bits)
+      y = BitArray.new(bits)
+      assert_equal x, y
+      assert_equal x.hash, y.hash
+      y.toggle_bit(size - 1)
+      assert_not_equal x, y
+      y.toggle_bit(size - 1)
+      y.push(0)
+      assert_not_equal x, y
+      assert_equal x, y.view(0, size) if size % 64 == 0
+    end
+
+    # Comparison is the same as comparing to_a's.
+    strings = ["", "0", "1", "00", "01", "10", "1100101", "1100100",
+               "0" * 64, "0" * 63 + "1", "0" * 65, "0" * 64 + "1",
+               "1" * 130, "1" * 129 + "0"]
+    strings.product(strings).each do |x, y|
+      expected = x.chars.map(&:to_i) <=> y.chars.map(&:to_i)
+      assert_equal expected, BitArray.new(x) <=> BitArray.new(y)
+    end
+    assert_nil a <=> "1100101"
+    assert_equal strings.sort_by { |x| x.chars.map(&:to_i) },
+      strings.map { |x| BitArray.new(x) }.sort.map(&:to_s)
+  end
+
+  def test_inline_and_recycled_storage
+    # Growing out of the inline words and back again.
+    ba = BitArray.new(0)
+    bits = []
+    600.times do |i|
+      ba.push(i % 3 == 0 ? 1 : 0)
+      bits << (i % 3 == 0 ? 1 : 0)
+    end
+    assert_equal bits, ba.to_a
+    ba.resize(100)
+    assert_equal bits[0, 100], ba.to_a
+    copy = ba.dup
+    ba.resize(700)
+    assert_equal bits[0, 100] + [0] * 600, ba.to_a
+    assert_equal bits[0, 100], copy.to_a
+
+    # Storage freed by one BitArray is cleared before another uses it.
+    rng = Random.new(25)
+    [1, 256, 257, 300, 513, 1000, 4096, 65536, 65537, 100000].each do |size|
+      arrays = Array.new(20) { BitArray.new(size).set_all_bits }
+      arrays.each { |x| assert_equal size, x.total_set }
+      arrays = nil
+      GC.start
+      20.times do
+        x = BitArray.new(size)
+        assert_equal 0, x.total_set
+        bits = random_bits(size, rng)
+        assert_equal bits, BitArray.new(bits).to_s
+      end
+    end
+  end
+
+  def test_with_scratch
+    kept = nil
+    saved = nil
+    result = BitArray.with_scratch(1000) do |s|
+      saved = s
+      assert_equal 1000, s.size
+      assert_equal 0, s.total_set
+      s.set_range(10, 20)
+      kept = s.dup
+      s.push(1)
+      s.total_set
+    end
+    assert_equal 21, result
+    assert_equal 0, saved.size
+    assert_equal 20, kept.total_set
+    assert_equal 1000, kept.size
+
+    # Recycled scratch storage starts out clear.
+    BitArray.with_scratch(1000) { |s| s.set_all_bits }
+    BitArray.with_scratch(1000) { |s| assert_equal 0, s.total_set }
+    BitArray.with_scratch(10) { |s| s.set_all_bits }
+    assert_equal 0, BitArray.with_scratch(10) { |s| s.total_set }
+
+    # The storage is given up even if the block raises.
+    assert_raise(RuntimeError) do
+      BitArray.with_scratch(500) { |s| saved = s; raise "oops" }
+    end
+    assert_equal 0, saved.size
+    assert_raise(LocalJumpError) { BitArray.with_scratch(10) }
+  end
+end